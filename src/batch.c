@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "image.h"
+#include "args.h"
+#include "stb_image.h"
+
+// Batch conversion driven by a manifest, one job per line:
+//
+//   # input         output              operations...
+//   data/dog.jpg    out/dog_small.png   resize:256x341:area blur:1 hsv:.1,1.2,1
+//   data/dog.jpg    out/dog_edges.jpg   gray sobel
+//
+// Operations: gray, sobel, blur:sigma, hsv:hue,saturation,value and
+// resize:HxW[:nearest|bilinear|area|lanczos]. Outputs ending in .png are
+// written as PNG, anything else as JPEG.
+
+// Peak bytes per 8-bit sample of a job, input and output buffers plus the
+// float rows kernels widen into.
+#define BATCH_BYTES_PER_SAMPLE 8
+
+typedef struct{
+    char *input, *output;
+    image_op *ops;
+    int n;
+    int max_pixels;         // Largest resize target, 0 if none
+} batch_job;
+
+typedef struct{
+    batch_job *jobs;
+    int n;
+    int next;               // Next job to claim
+    int failed;
+    size_t budget, in_flight;
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+} batch_queue;
+
+static int parse_resample(const char *s, RESAMPLE *mode)
+{
+    if(!s || 0 == strcmp(s, "bilinear")) *mode = BILINEAR;
+    else if(0 == strcmp(s, "nearest")) *mode = NEAREST;
+    else if(0 == strcmp(s, "area")) *mode = AREA;
+    else if(0 == strcmp(s, "lanczos")) *mode = LANCZOS3;
+    else return 0;
+    return 1;
+}
+
+static int parse_op(char *s, image_op *op, batch_job *job)
+{
+    char *args = strchr(s, ':');
+    if(args) *args++ = 0;
+    if(0 == strcmp(s, "gray")){
+        *op = grayscale_op();
+    } else if(0 == strcmp(s, "sobel")){
+        *op = sobel_op();
+    } else if(0 == strcmp(s, "blur") && args){
+        *op = blur_op(atof(args));
+    } else if(0 == strcmp(s, "hsv") && args){
+        float h = 0, sat = 1, v = 1;
+        if(sscanf(args, "%f,%f,%f", &h, &sat, &v) != 3) return 0;
+        *op = hsv_op(h, sat, v);
+    } else if(0 == strcmp(s, "resize") && args){
+        int h, w;
+        RESAMPLE mode;
+        char *m = strchr(args, ':');
+        if(m) *m++ = 0;
+        if(sscanf(args, "%dx%d", &h, &w) != 2 || h <= 0 || w <= 0 || !parse_resample(m, &mode)) return 0;
+        *op = resize_op(h, w, mode);
+        if(h*w > job->max_pixels) job->max_pixels = h*w;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Parse one manifest line. Inputs load with 1 or 3 channels, so orders
+// that can't run on either, like gray before hsv, are errors.
+// returns: 1 for a job, 0 for a blank or comment line, -1 on error.
+static int parse_job(char *line, batch_job *job)
+{
+    int c = 0;              // Channels at this point, 0 if still unknown
+    char *save = 0;
+    char *tok = strtok_r(line, " \t\r", &save);
+    if(!tok || tok[0] == '#') return 0;
+    memset(job, 0, sizeof(batch_job));
+    job->input = strdup(tok);
+    tok = strtok_r(0, " \t\r", &save);
+    if(!tok) return -1;
+    job->output = strdup(tok);
+    while((tok = strtok_r(0, " \t\r", &save))){
+        job->ops = realloc(job->ops, (job->n + 1)*sizeof(image_op));
+        image_op *op = job->ops + job->n;
+        if(!parse_op(tok, op, job)) return -1;
+        int fits = c ? image_op_accepts(*op, c) : image_op_accepts(*op, 1) || image_op_accepts(*op, 3);
+        if(!fits) return -1;
+        if(op->out_c) c = op->out_c;
+        ++job->n;
+    }
+    return 1;
+}
+
+static void free_job(batch_job job)
+{
+    free(job.input);
+    free(job.output);
+    free(job.ops);
+}
+
+// returns: 1 if the output was written.
+static int save_output(image_u8 im, const char *output)
+{
+    char *name = strdup(output);
+    char *ext = strrchr(name, '.');
+    int png = ext && 0 == strcmp(ext, ".png");
+    if(ext && (png || 0 == strcmp(ext, ".jpg") || 0 == strcmp(ext, ".jpeg"))) *ext = 0;
+    int ok = png ? save_png_u8(im, name) : save_image_u8(im, name);
+    free(name);
+    return ok;
+}
+
+// Wait until cost bytes fit in the budget. A job that is bigger than the
+// whole budget still runs, alone.
+static void reserve_memory(batch_queue *q, size_t cost)
+{
+    pthread_mutex_lock(&q->lock);
+    while(q->in_flight && q->in_flight + cost > q->budget){
+        pthread_cond_wait(&q->freed, &q->lock);
+    }
+    q->in_flight += cost;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void release_memory(batch_queue *q, size_t cost)
+{
+    pthread_mutex_lock(&q->lock);
+    q->in_flight -= cost;
+    pthread_cond_broadcast(&q->freed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Each worker decodes, processes and encodes whole jobs, so with several
+// workers those stages of different images overlap.
+static void *batch_worker(void *arg)
+{
+    batch_queue *q = arg;
+#ifdef _OPENMP
+    // Parallelism comes from the workers, keep kernels single threaded.
+    omp_set_num_threads(1);
+#endif
+    while(1){
+        pthread_mutex_lock(&q->lock);
+        int i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        if(i >= q->n) break;
+        batch_job *job = q->jobs + i;
+
+        int w, h, c;
+        int ok = stbi_info(job->input, &w, &h, &c);
+        if(!ok){
+            fprintf(stderr, "Cannot load image \"%s\"\n", job->input);
+        } else {
+            size_t pixels = MAX((size_t)w*h, (size_t)job->max_pixels);
+            size_t cost = pixels*c*BATCH_BYTES_PER_SAMPLE;
+            reserve_memory(q, cost);
+            // The header can be fine and the data still not decode.
+            image_u8 im = try_load_image_u8_interleaved(job->input);
+            ok = im.data != 0;
+            if(ok){
+                // Ops can still refuse the channels this input has.
+                im = run_pipeline(im, job->ops, job->n, INTERLEAVED);
+                ok = im.data && save_output(im, job->output);
+                free_image_u8(im);
+            }
+            release_memory(q, cost);
+        }
+        if(!ok){
+            pthread_mutex_lock(&q->lock);
+            ++q->failed;
+            pthread_mutex_unlock(&q->lock);
+        }
+    }
+    return 0;
+}
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+// Run the batch subcommand: uwimg batch manifest [-threads n] [-mem MB]
+// returns: number of jobs that failed.
+int run_batch(int argc, char **argv)
+{
+    int threads = find_int_arg(argc, argv, "-threads", sysconf(_SC_NPROCESSORS_ONLN));
+    int mem = find_int_arg(argc, argv, "-mem", 512);
+    if(argc < 3 || !argv[2]){
+        fprintf(stderr, "usage: %s batch <manifest> [-threads n] [-mem MB]\n", argv[0]);
+        return 1;
+    }
+    FILE *fp = fopen(argv[2], "r");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", argv[2]);
+        return 1;
+    }
+    batch_queue q = {0};
+    char *line;
+    int lineno = 0;
+    int bad = 0;
+    while((line = fgetl(fp))){
+        ++lineno;
+        batch_job job;
+        int r = parse_job(line, &job);
+        if(r < 0){
+            fprintf(stderr, "%s:%d: bad job\n", argv[2], lineno);
+            free_job(job);
+            ++bad;
+        } else if(r > 0){
+            q.jobs = realloc(q.jobs, (q.n + 1)*sizeof(batch_job));
+            q.jobs[q.n++] = job;
+        }
+        free(line);
+    }
+    fclose(fp);
+
+    if(threads < 1) threads = 1;
+    q.budget = (size_t)MAX(mem, 1) << 20;
+    pthread_mutex_init(&q.lock, 0);
+    pthread_cond_init(&q.freed, 0);
+    pthread_t *pool = calloc(threads, sizeof(pthread_t));
+    double start = now();
+    int i;
+    for(i = 0; i < threads; ++i) pthread_create(pool + i, 0, batch_worker, &q);
+    for(i = 0; i < threads; ++i) pthread_join(pool[i], 0);
+    double elapsed = now() - start;
+
+    int done = q.n - q.failed;
+    printf("%d images, %d failed, %.2f s, %.1f images/sec\n",
+        done, q.failed + bad, elapsed, elapsed > 0 ? done / elapsed : 0);
+    for(i = 0; i < q.n; ++i) free_job(q.jobs[i]);
+    free(q.jobs);
+    free(pool);
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.freed);
+    return q.failed + bad;
+}
@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "image.h"
+#include "matrix.h"
+#include "args.h"
+#include "bench.h"
+
+// Microbenchmarks for the hot kernels, run with
+//
+//   uwimg bench [-size n] [-kernel k] [-threads t] [-reps r] [-warmup w]
+//               [-only name] [-json out.json] [-baseline base.json] [-tolerance .1]
+//
+// -size, -kernel and -threads take comma separated lists, e.g. -size 128,512,
+// and every benchmark runs once per combination.
+// Every benchmark is run warmup times untimed, then reps times timed. The
+// median and percentiles of the timed runs are printed, and optionally
+// written as JSON, one benchmark object per line. With -baseline each
+// median is compared to the entry of the same name and parameters in an
+// earlier JSON file, and the command fails if any got slower than
+// tolerance allows.
+
+typedef struct{
+    const char *name;
+    void *(*setup)(bench_params p);
+    void (*run)(void *ctx);
+    void (*teardown)(void *ctx);
+} benchmark;
+
+typedef struct{
+    char name[64];
+    char params[64];
+    int reps;
+    double median, p10, p90, min, mean;    // Milliseconds
+} bench_result;
+
+static double now_ms()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1e3 + t.tv_nsec*1e-6;
+}
+
+static image random_image(int c, int h, int w)
+{
+    image im = make_image(c, h, w);
+    int i;
+    for(i = 0; i < c*h*w; ++i) im.data[i] = rand() / (float)RAND_MAX;
+    return im;
+}
+
+typedef struct{
+    image im, filter;
+} convolve_ctx;
+
+static void *convolve_setup(bench_params p)
+{
+    convolve_ctx *c = calloc(1, sizeof(convolve_ctx));
+    c->im = random_image(3, p.size, p.size);
+    c->filter = make_box_filter(p.kernel);
+    return c;
+}
+
+static void convolve_run(void *ctx)
+{
+    convolve_ctx *c = ctx;
+    free_image(convolve_image(c->im, c->filter, 1));
+}
+
+static void convolve_teardown(void *ctx)
+{
+    convolve_ctx *c = ctx;
+    free_image(c->im);
+    free_image(c->filter);
+    free(c);
+}
+
+static void *resize_setup(bench_params p)
+{
+    image *im = calloc(1, sizeof(image));
+    *im = random_image(3, p.size, p.size);
+    return im;
+}
+
+static void resize_run(void *ctx)
+{
+    image *im = ctx;
+    free_image(bilinear_resize(*im, im->h*3/2, im->w*3/2));
+}
+
+static void resize_teardown(void *ctx)
+{
+    image *im = ctx;
+    free_image(*im);
+    free(im);
+}
+
+typedef struct{
+    descriptor *a, *b;
+    int n;
+} match_ctx;
+
+static descriptor *random_descriptors(int n, int len)
+{
+    descriptor *d = calloc(n, sizeof(descriptor));
+    int i, j;
+    for(i = 0; i < n; ++i){
+        d[i].p = make_point(rand() % 512, rand() % 512);
+        d[i].n = len;
+        d[i].data = calloc(len, sizeof(float));
+        for(j = 0; j < len; ++j) d[i].data[j] = rand() / (float)RAND_MAX;
+    }
+    return d;
+}
+
+static void *match_setup(bench_params p)
+{
+    match_ctx *c = calloc(1, sizeof(match_ctx));
+    c->n = p.size;
+    c->a = random_descriptors(c->n, 75);
+    c->b = random_descriptors(c->n, 75);
+    return c;
+}
+
+static void match_run(void *ctx)
+{
+    match_ctx *c = ctx;
+    int mn = 0;
+    free(match_descriptors(c->a, c->n, c->b, c->n, &mn));
+}
+
+static void match_teardown(void *ctx)
+{
+    match_ctx *c = ctx;
+    free_descriptors(c->a, c->n);
+    free_descriptors(c->b, c->n);
+    free(c);
+}
+
+typedef struct{
+    match *m;
+    int n;
+} ransac_ctx;
+
+// Matches related by a fixed homography, with a quarter of them outliers.
+static void *ransac_setup(bench_params p)
+{
+    ransac_ctx *c = calloc(1, sizeof(ransac_ctx));
+    c->n = p.size;
+    c->m = calloc(c->n, sizeof(match));
+    matrix H = make_translation_homography(-120, 14);
+    H.data[0][0] = 1.05; H.data[0][1] = .02; H.data[2][0] = 1e-4;
+    int i;
+    for(i = 0; i < c->n; ++i){
+        c->m[i].p = make_point(rand() % 640, rand() % 480);
+        c->m[i].q = (i % 4) ? project_point(H, c->m[i].p) : make_point(rand() % 640, rand() % 480);
+        c->m[i].ai = c->m[i].bi = i;
+    }
+    free_matrix(H);
+    return c;
+}
+
+static void ransac_run(void *ctx)
+{
+    ransac_ctx *c = ctx;
+    srand(10);
+    free_matrix(RANSAC(c->m, c->n, 2, 200, c->n));
+}
+
+static void ransac_teardown(void *ctx)
+{
+    ransac_ctx *c = ctx;
+    free(c->m);
+    free(c);
+}
+
+typedef struct{
+    matrix a, b;
+} mult_ctx;
+
+static void *mult_setup(bench_params p)
+{
+    mult_ctx *c = calloc(1, sizeof(mult_ctx));
+    c->a = random_matrix(p.size, p.size, .5);
+    c->b = random_matrix(p.size, p.size, .5);
+    return c;
+}
+
+static void mult_run(void *ctx)
+{
+    mult_ctx *c = ctx;
+    free_matrix(matrix_mult_matrix(c->a, c->b));
+}
+
+static void mult_teardown(void *ctx)
+{
+    mult_ctx *c = ctx;
+    free_matrix(c->a);
+    free_matrix(c->b);
+    free(c);
+}
+
+typedef struct{
+    model m;
+    data d;
+} train_ctx;
+
+// A two layer MNIST sized model on random data, 10 steps per run.
+static void *train_setup(bench_params p)
+{
+    train_ctx *c = calloc(1, sizeof(train_ctx));
+    int n = MAX(p.size, 128);
+    c->d.X = random_matrix(n, 784, .5);
+    c->d.y = make_matrix(n, 10);
+    int i;
+    for(i = 0; i < n; ++i) c->d.y.data[i][rand() % 10] = 1;
+    c->m.n = 2;
+    c->m.layers = calloc(2, sizeof(layer));
+    c->m.layers[0] = make_layer(784, 64, RELU);
+    c->m.layers[1] = make_layer(64, 10, SOFTMAX);
+    return c;
+}
+
+static void train_run(void *ctx)
+{
+    train_ctx *c = ctx;
+    train_model(c->m, c->d, 128, 10, .01, .9, .0005);
+}
+
+static void train_teardown(void *ctx)
+{
+    train_ctx *c = ctx;
+    free_model(c->m);
+    free_data(c->d);
+    free(c);
+}
+
+static benchmark benchmarks[] = {
+    {"convolve_image", convolve_setup, convolve_run, convolve_teardown},
+    {"bilinear_resize", resize_setup, resize_run, resize_teardown},
+    {"match_descriptors", match_setup, match_run, match_teardown},
+    {"RANSAC", ransac_setup, ransac_run, ransac_teardown},
+    {"matrix_mult_matrix", mult_setup, mult_run, mult_teardown},
+    {"train_model", train_setup, train_run, train_teardown},
+};
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Percentile of sorted samples with linear interpolation.
+static double percentile(const double *t, int n, double q)
+{
+    double pos = q*(n - 1);
+    int i = (int)pos;
+    if(i + 1 >= n) return t[n - 1];
+    return t[i] + (pos - i)*(t[i + 1] - t[i]);
+}
+
+// Point stdout and stderr at /dev/null while benchmarks run, so progress
+// the kernels print (training loss, RANSAC inliers) stays out of the
+// results table and out of the timings' terminal I/O.
+// int *saved: the two original descriptors, restored by unquiet.
+static void quiet(int *saved)
+{
+    fflush(stdout);
+    fflush(stderr);
+    saved[0] = dup(STDOUT_FILENO);
+    saved[1] = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if(null < 0) return;
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+}
+
+static void unquiet(const int *saved)
+{
+    fflush(stdout);
+    fflush(stderr);
+    if(saved[0] >= 0) dup2(saved[0], STDOUT_FILENO), close(saved[0]);
+    if(saved[1] >= 0) dup2(saved[1], STDERR_FILENO), close(saved[1]);
+}
+
+static bench_result run_benchmark(benchmark b, bench_params p, int warmup, int reps)
+{
+    bench_result r = {{0}};
+    snprintf(r.name, sizeof(r.name), "%s", b.name);
+    snprintf(r.params, sizeof(r.params), "size=%d kernel=%d threads=%d", p.size, p.kernel, p.threads);
+    r.reps = reps;
+    srand(0);
+    int saved[2];
+    quiet(saved);
+    void *ctx = b.setup(p);
+    double *t = calloc(reps, sizeof(double));
+    int i;
+    for(i = 0; i < warmup; ++i) b.run(ctx);
+    for(i = 0; i < reps; ++i){
+        double start = now_ms();
+        b.run(ctx);
+        t[i] = now_ms() - start;
+        r.mean += t[i] / reps;
+    }
+    b.teardown(ctx);
+    unquiet(saved);
+    qsort(t, reps, sizeof(double), compare_double);
+    r.min = t[0];
+    r.median = percentile(t, reps, .5);
+    r.p10 = percentile(t, reps, .1);
+    r.p90 = percentile(t, reps, .9);
+    free(t);
+    return r;
+}
+
+static void write_json(FILE *fp, bench_result *r, int n)
+{
+    int i;
+    fprintf(fp, "{\"benchmarks\":[\n");
+    for(i = 0; i < n; ++i){
+        fprintf(fp, "{\"name\":\"%s\",\"params\":\"%s\",\"reps\":%d,\"median_ms\":%.6f,"
+            "\"p10_ms\":%.6f,\"p90_ms\":%.6f,\"min_ms\":%.6f,\"mean_ms\":%.6f}%s\n",
+            r[i].name, r[i].params, r[i].reps, r[i].median, r[i].p10, r[i].p90,
+            r[i].min, r[i].mean, i + 1 < n ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+}
+
+// Copy the string value of "key":"..." from a line of our own JSON.
+static int json_string(const char *line, const char *key, char *out, int size)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+    const char *s = strstr(line, pattern);
+    if(!s) return 0;
+    s += strlen(pattern);
+    const char *e = strchr(s, '"');
+    if(!e || e - s >= size) return 0;
+    memcpy(out, s, e - s);
+    out[e - s] = 0;
+    return 1;
+}
+
+static int json_number(const char *line, const char *key, double *out)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *s = strstr(line, pattern);
+    return s && sscanf(s + strlen(pattern), "%lf", out) == 1;
+}
+
+// Compare medians against a baseline written by -json.
+// returns: number of benchmarks slower than the baseline allows.
+static int compare_baseline(const char *fname, bench_result *r, int n, double tolerance)
+{
+    FILE *fp = fopen(fname, "r");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return 1;
+    }
+    int regressions = 0;
+    char *line;
+    while((line = fgetl(fp))){
+        char name[64], params[64];
+        double median;
+        int i;
+        if(json_string(line, "name", name, sizeof(name)) &&
+           json_string(line, "params", params, sizeof(params)) &&
+           json_number(line, "median_ms", &median)){
+            for(i = 0; i < n; ++i){
+                if(strcmp(r[i].name, name) || strcmp(r[i].params, params)) continue;
+                double change = median > 0 ? r[i].median / median - 1 : 0;
+                int slow = change > tolerance;
+                printf("%-20s %-32s %10.3f ms -> %10.3f ms %+7.1f%%%s\n", name, params, median, r[i].median,
+                    100*change, slow ? "  REGRESSION" : "");
+                regressions += slow;
+            }
+        }
+        free(line);
+    }
+    fclose(fp);
+    return regressions;
+}
+
+#define MAX_SWEEP 16
+
+// Parse a comma separated list of positive or zero ints.
+// returns: number parsed, 0 on a malformed list.
+static int parse_sweep(const char *s, int *out)
+{
+    int n = 0;
+    while(*s && n < MAX_SWEEP){
+        char *end;
+        long v = strtol(s, &end, 10);
+        if(end == s || v < 0 || (*end && *end != ',')) return 0;
+        out[n++] = v;
+        s = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+// Run the bench subcommand.
+// returns: number of regressions against the baseline, 0 without one.
+int run_bench(int argc, char **argv)
+{
+    char *sizes_arg = find_char_arg(argc, argv, "-size", "256");
+    char *kernels_arg = find_char_arg(argc, argv, "-kernel", "7");
+    char *threads_arg = find_char_arg(argc, argv, "-threads", "0");
+    int reps = find_int_arg(argc, argv, "-reps", 11);
+    int warmup = find_int_arg(argc, argv, "-warmup", 2);
+    char *only = find_char_arg(argc, argv, "-only", 0);
+    char *json = find_char_arg(argc, argv, "-json", 0);
+    char *baseline = find_char_arg(argc, argv, "-baseline", 0);
+    float tolerance = find_float_arg(argc, argv, "-tolerance", .1);
+    if(reps < 1) reps = 1;
+    int sizes[MAX_SWEEP], kernels[MAX_SWEEP], threads[MAX_SWEEP];
+    int ns = parse_sweep(sizes_arg, sizes);
+    int nk = parse_sweep(kernels_arg, kernels);
+    int nt = parse_sweep(threads_arg, threads);
+    if(!ns || !nk || !nt){
+        fprintf(stderr, "usage: %s bench [-size n,...] [-kernel k,...] [-threads t,...] [-reps r] [-warmup w]\n"
+            "       [-only name] [-json out.json] [-baseline base.json] [-tolerance .1]\n", argv[0]);
+        return 1;
+    }
+
+    int n = sizeof(benchmarks)/sizeof(benchmarks[0]);
+    bench_result *results = calloc(n*ns*nk*nt, sizeof(bench_result));
+    int count = 0;
+    int i, s, k, t;
+    printf("%-20s %-32s %10s %10s %10s %10s\n", "benchmark", "params", "median ms", "p10 ms", "p90 ms", "min ms");
+#ifdef _OPENMP
+    int default_threads = omp_get_max_threads();
+#endif
+    for(t = 0; t < nt; ++t){
+#ifdef _OPENMP
+        omp_set_num_threads(threads[t] > 0 ? threads[t] : default_threads);
+#endif
+        for(s = 0; s < ns; ++s){
+            for(k = 0; k < nk; ++k){
+                bench_params p = {sizes[s], kernels[k], threads[t]};
+                for(i = 0; i < n; ++i){
+                    if(only && strcmp(only, benchmarks[i].name)) continue;
+                    bench_result r = run_benchmark(benchmarks[i], p, warmup, reps);
+                    printf("%-20s %-32s %10.3f %10.3f %10.3f %10.3f\n", r.name, r.params, r.median, r.p10, r.p90, r.min);
+                    fflush(stdout);
+                    results[count++] = r;
+                }
+            }
+        }
+    }
+
+    if(json){
+        FILE *fp = fopen(json, "w");
+        if(fp){
+            write_json(fp, results, count);
+            fclose(fp);
+        } else {
+            fprintf(stderr, "Couldn't open file %s\n", json);
+        }
+    }
+    int regressions = baseline ? compare_baseline(baseline, results, count, tolerance) : 0;
+    if(baseline) printf("%d regression(s) beyond %.0f%%\n", regressions, 100*tolerance);
+    free(results);
+    return regressions;
+}
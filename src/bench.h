@@ -0,0 +1,12 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Parameters shared by every benchmark, set from the command line.
+typedef struct{
+    int size;       // Image edge or matrix size
+    int kernel;     // Filter edge
+    int threads;    // OpenMP threads, 0 leaves the default
+} bench_params;
+
+int run_bench(int argc, char **argv);
+#endif
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "instrument.h"
+#include "matrix.h"
+
+// Panorama blending, one strip of canvas rows at a time.
+//
+// Where each image lands on a canvas row is worked out from the projected
+// outline of b, so pixels covered by one image are copied or sampled
+// directly and only the overlap pays for blending. Feathering weights each
+// image by its distance to its own edge. Multi-band blending splits a
+// region around the overlap into Laplacian pyramids and joins every band
+// with a Gaussian pyramid of the seam mask (Burt and Adelson), so low
+// frequencies mix over a wide band and detail over a narrow one.
+//
+// Multi-band regions carry a halo wider than the pyramid's reach and are
+// aligned to the coarsest level's grid, so strips agree where they meet and
+// working memory depends on the strip, not the canvas.
+
+// Canvas rows per strip, at least.
+#define BLEND_STRIP 128
+
+typedef struct{
+    image a, b;
+    matrix H;           // a coordinates to b coordinates
+    int dx, dy;         // Canvas origin in a coordinates
+    point outline[4];   // Edges of b in a coordinates
+} blend_geometry;
+
+static point project(matrix H, float x, float y)
+{
+    double **m = H.data;
+    double z = m[2][0]*x + m[2][1]*y + m[2][2];
+    return make_point((m[0][0]*x + m[0][1]*y + m[0][2]) / z,
+                      (m[1][0]*x + m[1][1]*y + m[1][2]) / z);
+}
+
+// Bilinear sample of channel c at (x, y), clamping at the edges.
+static float sample_bilinear(image im, int c, float x, float y)
+{
+    int x0 = floorf(x), y0 = floorf(y);
+    float fx = x - x0, fy = y - y0;
+    int x1 = MIN(im.w - 1, MAX(0, x0 + 1)), y1 = MIN(im.h - 1, MAX(0, y0 + 1));
+    x0 = MAX(0, MIN(im.w - 1, x0));
+    y0 = MAX(0, MIN(im.h - 1, y0));
+    const float *p = im.data + (size_t)c*im.h*im.w;
+    float top = p[y0*im.w + x0] + fx*(p[y0*im.w + x1] - p[y0*im.w + x0]);
+    float bot = p[y1*im.w + x0] + fx*(p[y1*im.w + x1] - p[y1*im.w + x0]);
+    return top + fy*(bot - top);
+}
+
+static int inside_b(const blend_geometry *g, point p)
+{
+    return p.x >= 0 && p.y >= 0 && p.x < g->b.w && p.y < g->b.h;
+}
+
+// Canvas columns [*x0, *x1) of row y that can map inside b: where the row
+// crosses b's outline, one pixel wider for rounding. Empty if x0 >= x1.
+static void b_span(const blend_geometry *g, int y, int w, int *x0, int *x1)
+{
+    float Y = y + g->dy;
+    float lo = 1e30, hi = -1e30;
+    int i;
+    for(i = 0; i < 4; ++i){
+        point p = g->outline[i], q = g->outline[(i + 1) % 4];
+        if(p.y == q.y || Y < MIN(p.y, q.y) || Y > MAX(p.y, q.y)) continue;
+        float x = p.x + (Y - p.y)*(q.x - p.x)/(q.y - p.y);
+        lo = MIN(lo, x);
+        hi = MAX(hi, x);
+    }
+    *x0 = lo > hi ? 0 : MAX(0, (int)floorf(lo) - 1 - g->dx);
+    *x1 = lo > hi ? 0 : MIN(w, (int)ceilf(hi) + 2 - g->dx);
+}
+
+// Canvas columns [*x0, *x1) of row y covered by a.
+static void a_span(const blend_geometry *g, int y, int *x0, int *x1)
+{
+    int ay = y + g->dy;
+    int in = ay >= 0 && ay < g->a.h;
+    *x0 = in ? -g->dx : 0;
+    *x1 = in ? g->a.w - g->dx : 0;
+}
+
+// Distance from a pixel to the nearest edge of a, in pixels.
+static float a_weight(const blend_geometry *g, int x, int y)
+{
+    int ax = x + g->dx, ay = y + g->dy;
+    return MIN(MIN(ax + 1, g->a.w - ax), MIN(ay + 1, g->a.h - ay));
+}
+
+// Distance from a point of b to the nearest edge of b.
+static float b_weight(const blend_geometry *g, point p)
+{
+    return MIN(MIN(p.x + 1, g->b.w - p.x), MIN(p.y + 1, g->b.h - p.y));
+}
+
+// Fill one canvas row: a where only a covers it, b where only b does, and
+// the overlap by mode. Multi-band overlaps are left for blend_region.
+static void compose_row(const blend_geometry *g, image c, int y, BLEND mode)
+{
+    int ax0, ax1, bx0, bx1, x, k;
+    a_span(g, y, &ax0, &ax1);
+    b_span(g, y, c.w, &bx0, &bx1);
+    for(k = 0; k < c.c && ax0 < ax1; ++k){
+        const float *src = g->a.data + ((size_t)k*g->a.h + y + g->dy)*g->a.w;
+        memcpy(c.data + ((size_t)k*c.h + y)*c.w + ax0, src, (ax1 - ax0)*sizeof(float));
+    }
+    for(x = bx0; x < bx1; ++x){
+        point p = project(g->H, x + g->dx, y + g->dy);
+        if(!inside_b(g, p)) continue;
+        int overlap = x >= ax0 && x < ax1;
+        if(overlap && mode == BLEND_MULTIBAND) continue;
+        float wa = 0, wb = 1;
+        if(overlap && mode == BLEND_FEATHER){
+            wa = a_weight(g, x, y);
+            wb = b_weight(g, p);
+        }
+        for(k = 0; k < c.c; ++k){
+            float *o = c.data + ((size_t)k*c.h + y)*c.w + x;
+            *o = (wa*(*o) + wb*sample_bilinear(g->b, k, p.x, p.y))/(wa + wb);
+        }
+    }
+}
+
+// out = m*a + (1-m)*b for every channel of a and b.
+static image mix_images(image a, image b, image m)
+{
+    image out = make_image(a.c, a.h, a.w);
+    int n = a.h*a.w, k, i;
+    for(k = 0; k < a.c; ++k){
+        const float *pa = a.data + (size_t)k*n, *pb = b.data + (size_t)k*n;
+        float *po = out.data + (size_t)k*n;
+        for(i = 0; i < n; ++i) po[i] = pb[i] + m.data[i]*(pa[i] - pb[i]);
+    }
+    return out;
+}
+
+// Multi-band blend of the canvas region starting at (x0, y0), writing rows
+// wy0 to wy1 of it back wherever a or b covers the canvas. Sizes are
+// multiples of 2^(bands-1) so every level halves exactly.
+static void blend_region(const blend_geometry *g, image c, int x0, int y0, int h, int w,
+        int wy0, int wy1, int bands)
+{
+    image A = make_image(c.c, h, w);
+    image B = make_image(c.c, h, w);
+    image M = make_image(1, h, w);
+    int x, y, k, l;
+    for(y = 0; y < h; ++y){
+        for(x = 0; x < w; ++x){
+            int cx = x0 + x, cy = y0 + y;
+            int ax = MIN(MAX(cx + g->dx, 0), g->a.w - 1), ay = MIN(MAX(cy + g->dy, 0), g->a.h - 1);
+            point p = project(g->H, cx + g->dx, cy + g->dy);
+            size_t i = (size_t)y*w + x;
+            int in_a = ax == cx + g->dx && ay == cy + g->dy;
+            int in_b = inside_b(g, p);
+            // Outside its own coverage each image takes the other's pixels,
+            // and outside both the nearer clamped edge, so the coarse bands
+            // don't pull in one image's clamped edge next to the other.
+            int use_a = in_a, use_b = in_b;
+            if(!in_a && !in_b){
+                float da = fabsf(ax - cx - g->dx) + fabsf(ay - cy - g->dy);
+                float db = fabsf(MIN(MAX(p.x, 0), g->b.w - 1) - p.x) + fabsf(MIN(MAX(p.y, 0), g->b.h - 1) - p.y);
+                use_a = da <= db;
+                use_b = !use_a;
+            }
+            for(k = 0; k < c.c; ++k){
+                float va = g->a.data[((size_t)k*g->a.h + ay)*g->a.w + ax];
+                float vb = sample_bilinear(g->b, k, p.x, p.y);
+                A.data[k*h*w + i] = use_a || !use_b ? va : vb;
+                B.data[k*h*w + i] = use_b || !use_a ? vb : va;
+            }
+            // Binary seam where the two images are equally far from their
+            // edges, the pyramid softens it per band.
+            float wa = in_a ? a_weight(g, cx, cy) : 0;
+            float wb = in_b ? b_weight(g, p) : 0;
+            M.data[i] = wa >= wb ? 1 : 0;
+        }
+    }
+
+    image *lap = calloc(bands, sizeof(image));
+    image ga = A, gb = B, gm = M;
+    for(l = 0; l < bands; ++l){
+        if(l == bands - 1){
+            lap[l] = mix_images(ga, gb, gm);
+        } else {
+            image na = resize_image(ga, ga.h/2, ga.w/2, AREA);
+            image nb = resize_image(gb, gb.h/2, gb.w/2, AREA);
+            image nm = resize_image(gm, gm.h/2, gm.w/2, AREA);
+            image ua = resize_image(na, ga.h, ga.w, BILINEAR);
+            image ub = resize_image(nb, gb.h, gb.w, BILINEAR);
+            image da = sub_image(ga, ua);
+            image db = sub_image(gb, ub);
+            lap[l] = mix_images(da, db, gm);
+            free_image(ua); free_image(ub); free_image(da); free_image(db);
+            free_image(ga); free_image(gb); free_image(gm);
+            ga = na; gb = nb; gm = nm;
+        }
+    }
+    free_image(ga); free_image(gb); free_image(gm);
+
+    image out = lap[bands - 1];
+    for(l = bands - 2; l >= 0; --l){
+        image up = resize_image(out, lap[l].h, lap[l].w, BILINEAR);
+        free_image(out);
+        out = add_image(up, lap[l]);
+        free_image(up);
+        free_image(lap[l]);
+    }
+    free(lap);
+
+    for(y = wy0; y < wy1; ++y){
+        int cy = y0 + y;
+        if(cy < 0 || cy >= c.h) continue;
+        int ax0, ax1;
+        a_span(g, cy, &ax0, &ax1);
+        for(x = 0; x < w; ++x){
+            int cx = x0 + x;
+            if(cx < 0 || cx >= c.w) continue;
+            int in_a = cx >= ax0 && cx < ax1;
+            if(!in_a && !inside_b(g, project(g->H, cx + g->dx, cy + g->dy))) continue;
+            for(k = 0; k < c.c; ++k){
+                c.data[((size_t)k*c.h + cy)*c.w + cx] = out.data[((size_t)k*h + y)*w + x];
+            }
+        }
+    }
+    free_image(out);
+}
+
+// Combine images like combine_images, blending where they overlap.
+// image a, b: images to stitch, same number of channels.
+// matrix H: homography from image a coordinates to image b coordinates.
+// BLEND mode: BLEND_NONE pastes b over a, BLEND_FEATHER weights each image
+//             by the distance to its edge, BLEND_MULTIBAND blends Laplacian
+//             pyramid bands.
+// int bands: pyramid levels for BLEND_MULTIBAND. Typical: 4-6
+// returns: combined image.
+image combine_images_blend(image a, image b, matrix H, BLEND mode, int bands)
+{
+    PROFILE_SCOPE("combine_images_blend");
+    assert(a.c == b.c);
+    bands = MAX(1, bands);
+    blend_geometry g;
+    g.a = a;
+    g.b = b;
+    g.H = H;
+    matrix Hinv = matrix_invert(H);
+    g.outline[0] = project(Hinv, 0, 0);
+    g.outline[1] = project(Hinv, b.w, 0);
+    g.outline[2] = project(Hinv, b.w, b.h);
+    g.outline[3] = project(Hinv, 0, b.h);
+
+    // Canvas as combine_images lays it out, from b's corner pixels.
+    point corners[4] = {project(Hinv, 0, 0), project(Hinv, b.w - 1, 0),
+                        project(Hinv, 0, b.h - 1), project(Hinv, b.w - 1, b.h - 1)};
+    free_matrix(Hinv);
+    float minx = corners[0].x, maxx = corners[0].x, miny = corners[0].y, maxy = corners[0].y;
+    int i;
+    for(i = 1; i < 4; ++i){
+        minx = MIN(minx, corners[i].x); maxx = MAX(maxx, corners[i].x);
+        miny = MIN(miny, corners[i].y); maxy = MAX(maxy, corners[i].y);
+    }
+    g.dx = MIN(0, minx);
+    g.dy = MIN(0, miny);
+    int w = MAX(a.w, maxx) - g.dx;
+    int h = MAX(a.h, maxy) - g.dy;
+    if(w > 7000 || h > 7000) fprintf(stderr, "output too big, stopping\n");
+    image c = make_image(a.c, h, w);
+
+    // Levels reach about two coarsest pixels, regions start on that grid.
+    int unit = 1 << (bands - 1);
+    int halo = 2*unit;
+    int strip = ((MAX(BLEND_STRIP, 2*halo) + unit - 1)/unit)*unit;
+    int strips = (h + strip - 1)/strip;
+    #pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < strips; ++i){
+        int y0 = i*strip, y1 = MIN(h, y0 + strip);
+        int y;
+        for(y = y0; y < y1; ++y) compose_row(&g, c, y, mode);
+        if(mode != BLEND_MULTIBAND) continue;
+
+        // Columns where a and b overlap within reach of this strip.
+        int ox0 = w, ox1 = 0;
+        for(y = MAX(0, y0 - halo); y < MIN(h, y1 + halo); ++y){
+            int ax0, ax1, bx0, bx1;
+            a_span(&g, y, &ax0, &ax1);
+            b_span(&g, y, w, &bx0, &bx1);
+            if(MAX(ax0, bx0) < MIN(ax1, bx1)){
+                ox0 = MIN(ox0, MAX(ax0, bx0));
+                ox1 = MAX(ox1, MIN(ax1, bx1));
+            }
+        }
+        if(ox0 >= ox1) continue;
+        int rx0 = (int)floorf((float)(ox0 - halo)/unit)*unit;
+        int rx1 = (int)ceilf((float)(ox1 + halo)/unit)*unit;
+        int ry0 = y0 - halo;
+        int rh = ((y1 + halo - ry0 + unit - 1)/unit)*unit;
+        blend_region(&g, c, rx0, ry0, rh, rx1 - rx0, halo, halo + y1 - y0, bands);
+    }
+    return c;
+}
@@ -0,0 +1,651 @@
+// 8-bit and half precision images. Kernels in here keep pixels in their
+// compact form and only widen to float a few rows at a time, where the math
+// needs the precision.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+#include "image.h"
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+// Number of rows widened to float at a time by per-pixel kernels.
+#define ROW_BLOCK 32
+
+// How to widen a row of compact pixels to float and narrow it back.
+typedef struct{
+    size_t size;
+    void (*load)(const void *src, float *dst, int n);
+    void (*store)(const float *src, void *dst, int n);
+} pixel_codec;
+
+image_u8 make_image_u8(int c, int h, int w)
+{
+    image_u8 out;
+    out.c = c;
+    out.h = h;
+    out.w = w;
+    out.data = calloc((size_t)c*h*w, sizeof(unsigned char));
+    out.layout = PLANAR;
+    return out;
+}
+
+void free_image_u8(image_u8 im)
+{
+    free(im.data);
+}
+
+image_f16 make_image_f16(int c, int h, int w)
+{
+    image_f16 out;
+    out.c = c;
+    out.h = h;
+    out.w = w;
+    out.data = calloc((size_t)c*h*w, sizeof(unsigned short));
+    return out;
+}
+
+void free_image_f16(image_f16 im)
+{
+    free(im.data);
+}
+
+// Convert a float to IEEE 754 half precision, rounding to nearest even.
+// float f: value to convert.
+// returns: raw bits of the half.
+unsigned short float_to_half(float f)
+{
+    union { float f; unsigned int u; } v = {f};
+    unsigned int sign = (v.u >> 16) & 0x8000;
+    unsigned int mant = v.u & 0x7fffff;
+    int exp = (v.u >> 23) & 0xff;
+    if(exp == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+    int e = exp - 127 + 15;
+    if(e >= 0x1f) return sign | 0x7c00;
+    if(e <= 0){
+        // Subnormal half, shift the mantissa with its implicit bit.
+        if(e < -10) return sign;
+        mant |= 0x800000;
+        int shift = 14 - e;
+        unsigned int h = mant >> shift;
+        unsigned int rem = mant & ((1u << shift) - 1);
+        unsigned int half = 1u << (shift - 1);
+        if(rem > half || (rem == half && (h & 1))) ++h;
+        return sign | h;
+    }
+    // A carry out of the mantissa correctly bumps the exponent.
+    unsigned int h = (e << 10) | (mant >> 13);
+    unsigned int rem = mant & 0x1fff;
+    if(rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;
+    return sign | h;
+}
+
+// Convert IEEE 754 half precision bits to a float, exactly.
+// unsigned short h: raw bits of the half.
+// returns: value as float.
+float half_to_float(unsigned short h)
+{
+    unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1f;
+    unsigned int mant = h & 0x3ff;
+    union { unsigned int u; float f; } v;
+    if(exp == 0){
+        v.f = mant * (1.f / 16777216.f);
+        v.u |= sign;
+    } else if(exp == 0x1f){
+        v.u = sign | 0x7f800000 | (mant << 13);
+    } else {
+        v.u = sign | ((unsigned int)(exp - 15 + 127) << 23) | (mant << 13);
+    }
+    return v.f;
+}
+
+static void load_row_u8(const void *src, float *dst, int n)
+{
+    const unsigned char *s = src;
+    int i;
+    for(i = 0; i < n; ++i) dst[i] = s[i] * (1.f / 255);
+}
+
+static void store_row_u8(const float *src, void *dst, int n)
+{
+    unsigned char *d = dst;
+    int i;
+    for(i = 0; i < n; ++i) d[i] = (unsigned char)(fminf(fmaxf(src[i], 0), 1) * 255 + .5f);
+}
+
+static void load_row_f16(const void *src, float *dst, int n)
+{
+    const unsigned short *s = src;
+    int i = 0;
+#ifdef __F16C__
+    for(; i + 8 <= n; i += 8){
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(s + i))));
+    }
+#endif
+    for(; i < n; ++i) dst[i] = half_to_float(s[i]);
+}
+
+static void store_row_f16(const float *src, void *dst, int n)
+{
+    unsigned short *d = dst;
+    int i = 0;
+#ifdef __F16C__
+    for(; i + 8 <= n; i += 8){
+        _mm_storeu_si128((__m128i *)(d + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+    for(; i < n; ++i) d[i] = float_to_half(src[i]);
+}
+
+static const pixel_codec u8_codec = {sizeof(unsigned char), load_row_u8, store_row_u8};
+static const pixel_codec f16_codec = {sizeof(unsigned short), load_row_f16, store_row_f16};
+
+static const char *pixel_at(const void *data, const pixel_codec *codec, size_t i)
+{
+    return (const char *)data + i*codec->size;
+}
+
+// Widen a whole compact buffer to a float image.
+static image compact_to_image(const void *data, int c, int h, int w, const pixel_codec *codec)
+{
+    image im = make_image(c, h, w);
+    int y;
+    #pragma omp parallel for
+    for(y = 0; y < c*h; ++y){
+        codec->load(pixel_at(data, codec, (size_t)y*w), im.data + (size_t)y*w, w);
+    }
+    return im;
+}
+
+// Narrow a float image into a compact buffer of the same size.
+static void image_to_compact(image im, void *data, const pixel_codec *codec)
+{
+    int y;
+    #pragma omp parallel for
+    for(y = 0; y < im.c*im.h; ++y){
+        codec->store(im.data + (size_t)y*im.w, (char *)data + (size_t)y*im.w*codec->size, im.w);
+    }
+}
+
+// Layout changes go a row at a time. A row reads c contiguous plane spans
+// and writes one contiguous interleaved span (or the reverse), so every
+// access streams and there is nothing to gain from tiling in 2d.
+
+// Copy planes into an interleaved buffer.
+static void planar_to_interleaved_u8(const unsigned char *src, unsigned char *dst, int c, int h, int w)
+{
+    const size_t plane = (size_t)h*w;
+    int y;
+    #pragma omp parallel for
+    for(y = 0; y < h; ++y){
+        const unsigned char *s = src + (size_t)y*w;
+        unsigned char *d = dst + (size_t)y*w*c;
+        int x, k;
+        if(c == 3){
+            const unsigned char *r = s, *g = s + plane, *b = s + 2*plane;
+            for(x = 0; x < w; ++x){
+                d[3*x] = r[x];
+                d[3*x+1] = g[x];
+                d[3*x+2] = b[x];
+            }
+        } else {
+            for(k = 0; k < c; ++k){
+                const unsigned char *p = s + k*plane;
+                for(x = 0; x < w; ++x) d[x*c + k] = p[x];
+            }
+        }
+    }
+}
+
+// Split an interleaved buffer into planes.
+static void interleaved_to_planar_u8(const unsigned char *src, unsigned char *dst, int c, int h, int w)
+{
+    const size_t plane = (size_t)h*w;
+    int y;
+    #pragma omp parallel for
+    for(y = 0; y < h; ++y){
+        const unsigned char *s = src + (size_t)y*w*c;
+        unsigned char *d = dst + (size_t)y*w;
+        int x, k;
+        if(c == 3){
+            unsigned char *r = d, *g = d + plane, *b = d + 2*plane;
+            for(x = 0; x < w; ++x){
+                r[x] = s[3*x];
+                g[x] = s[3*x+1];
+                b[x] = s[3*x+2];
+            }
+        } else {
+            for(k = 0; k < c; ++k){
+                unsigned char *p = d + k*plane;
+                for(x = 0; x < w; ++x) p[x] = s[x*c + k];
+            }
+        }
+    }
+}
+
+// Copy an 8-bit image into the requested layout.
+// image_u8 im: image to convert.
+// LAYOUT layout: PLANAR or INTERLEAVED.
+// returns: new image, a plain copy if im already has that layout.
+image_u8 u8_to_layout(image_u8 im, LAYOUT layout)
+{
+    image_u8 out = make_image_u8(im.c, im.h, im.w);
+    out.layout = layout;
+    if(im.layout == layout || im.c == 1){
+        memcpy(out.data, im.data, (size_t)im.c*im.h*im.w);
+    } else if(layout == INTERLEAVED){
+        planar_to_interleaved_u8(im.data, out.data, im.c, im.h, im.w);
+    } else {
+        interleaved_to_planar_u8(im.data, out.data, im.c, im.h, im.w);
+    }
+    return out;
+}
+
+image_u8 image_to_u8(image im)
+{
+    image_u8 out = make_image_u8(im.c, im.h, im.w);
+    image_to_compact(im, out.data, &u8_codec);
+    return out;
+}
+
+image u8_to_image(image_u8 im)
+{
+    if(im.layout == INTERLEAVED && im.c > 1){
+        image_u8 planar = u8_to_layout(im, PLANAR);
+        image out = compact_to_image(planar.data, im.c, im.h, im.w, &u8_codec);
+        free_image_u8(planar);
+        return out;
+    }
+    return compact_to_image(im.data, im.c, im.h, im.w, &u8_codec);
+}
+
+image_f16 image_to_f16(image im)
+{
+    image_f16 out = make_image_f16(im.c, im.h, im.w);
+    image_to_compact(im, out.data, &f16_codec);
+    return out;
+}
+
+image f16_to_image(image_f16 im)
+{
+    return compact_to_image(im.data, im.c, im.h, im.w, &f16_codec);
+}
+
+// Load an image as 8 bits per channel, planar, without going through float.
+// char *filename: image to load.
+// returns: the image, alpha is dropped like load_image does.
+image_u8 load_image_u8(char *filename)
+{
+    image_u8 raw = load_image_u8_interleaved(filename);
+    image_u8 im = u8_to_layout(raw, PLANAR);
+    free_image_u8(raw);
+    return im;
+}
+
+// Load an image as 8 bits per channel in stb's own interleaved layout. The
+// decoded buffer becomes the image, nothing is copied or transposed.
+// char *filename: image to load.
+// returns: the image, alpha is dropped. 0 x 0 x 0 with no data if the file
+//          couldn't be decoded.
+image_u8 try_load_image_u8_interleaved(char *filename)
+{
+    image_u8 im = {0};
+    int w, h, c;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, 0);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        return im;
+    }
+    // Drop alpha of gray or RGB images in place, each pixel moves down to
+    // an index it has already been read from.
+    if(c == 2 || c == 4){
+        size_t i, n = (size_t)w*h;
+        int k;
+        for(i = 0; i < n; ++i){
+            for(k = 0; k < c - 1; ++k) data[(c - 1)*i + k] = data[c*i + k];
+        }
+        c -= 1;
+    }
+    im.c = c;
+    im.h = h;
+    im.w = w;
+    im.data = data;
+    im.layout = INTERLEAVED;
+    return im;
+}
+
+// As try_load_image_u8_interleaved, but exits if the file can't be decoded.
+image_u8 load_image_u8_interleaved(char *filename)
+{
+    image_u8 im = try_load_image_u8_interleaved(filename);
+    if(!im.data) exit(0);
+    return im;
+}
+
+static int save_image_u8_stb(image_u8 im, const char *name, int png)
+{
+    char buff[256];
+    unsigned char *data = im.data;
+    if(im.layout != INTERLEAVED && im.c > 1){
+        data = malloc((size_t)im.w*im.h*im.c);
+        planar_to_interleaved_u8(im.data, data, im.c, im.h, im.w);
+    }
+    int success = 0;
+    if(png){
+        sprintf(buff, "%s.png", name);
+        success = stbi_write_png(buff, im.w, im.h, im.c, data, im.w*im.c);
+    } else {
+        sprintf(buff, "%s.jpg", name);
+        success = stbi_write_jpg(buff, im.w, im.h, im.c, data, 100);
+    }
+    if(data != im.data) free(data);
+    if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
+    return success;
+}
+
+// returns: 1 on success, 0 if the file couldn't be written.
+int save_image_u8(image_u8 im, const char *name)
+{
+    return save_image_u8_stb(im, name, 0);
+}
+
+int save_png_u8(image_u8 im, const char *name)
+{
+    return save_image_u8_stb(im, name, 1);
+}
+
+// Grayscale with 16 bit fixed point weights that sum to exactly 1.
+image_u8 rgb_to_grayscale_u8(image_u8 im)
+{
+    assert(im.c == 3);
+    image_u8 gray = make_image_u8(1, im.h, im.w);
+    const int n = im.h * im.w;
+    unsigned char *y = gray.data;
+    int i;
+    if(im.layout == INTERLEAVED){
+        const unsigned char *p = im.data;
+        #pragma omp parallel for simd
+        for(i = 0; i < n; ++i){
+            y[i] = (19595*p[3*i] + 38470*p[3*i+1] + 7471*p[3*i+2] + 32768) >> 16;
+        }
+        return gray;
+    }
+    const unsigned char *r = im.data;
+    const unsigned char *g = im.data + n;
+    const unsigned char *b = im.data + 2*n;
+    #pragma omp parallel for simd
+    for(i = 0; i < n; ++i){
+        y[i] = (19595*r[i] + 38470*g[i] + 7471*b[i] + 32768) >> 16;
+    }
+    return gray;
+}
+
+image_f16 rgb_to_grayscale_f16(image_f16 im)
+{
+    assert(im.c == 3);
+    image_f16 gray = make_image_f16(1, im.h, im.w);
+    const int n = im.h * im.w;
+    int y;
+    #pragma omp parallel
+    {
+        float *rgb = calloc(3*im.w, sizeof(float));
+        #pragma omp for
+        for(y = 0; y < im.h; ++y){
+            int k, x;
+            for(k = 0; k < 3; ++k) load_row_f16(im.data + (size_t)k*n + (size_t)y*im.w, rgb + k*im.w, im.w);
+            for(x = 0; x < im.w; ++x){
+                rgb[x] = 0.299f*rgb[x] + 0.587f*rgb[im.w + x] + 0.114f*rgb[2*im.w + x];
+            }
+            store_row_f16(rgb, gray.data + (size_t)y*im.w, im.w);
+        }
+        free(rgb);
+    }
+    return gray;
+}
+
+// Run a float kernel over a compact image in blocks of rows. Every block is
+// widened into a small planar float image, processed and narrowed back.
+static void map_row_blocks(void *data, int c, int h, int w, const pixel_codec *codec,
+        void (*op)(image, const float *), const float *args)
+{
+    int blocks = (h + ROW_BLOCK - 1) / ROW_BLOCK;
+    int b;
+    #pragma omp parallel
+    {
+        image block = make_image(c, ROW_BLOCK, w);
+        #pragma omp for
+        for(b = 0; b < blocks; ++b){
+            int y0 = b*ROW_BLOCK;
+            int rows = MIN(ROW_BLOCK, h - y0);
+            image view = block;
+            view.h = rows;
+            int k;
+            for(k = 0; k < c; ++k){
+                codec->load(pixel_at(data, codec, (size_t)k*h*w + (size_t)y0*w), view.data + (size_t)k*rows*w, rows*w);
+            }
+            op(view, args);
+            for(k = 0; k < c; ++k){
+                codec->store(view.data + (size_t)k*rows*w, (char *)data + ((size_t)k*h*w + (size_t)y0*w)*codec->size, rows*w);
+            }
+        }
+        free_image(block);
+    }
+}
+
+// Same as map_row_blocks for an interleaved 8-bit image. Each block is
+// split into float planes in cache, so the kernel still sees planar rows.
+static void map_row_blocks_interleaved_u8(image_u8 im,
+        void (*op)(image, const float *), const float *args)
+{
+    const int c = im.c, w = im.w;
+    int blocks = (im.h + ROW_BLOCK - 1) / ROW_BLOCK;
+    int b;
+    #pragma omp parallel
+    {
+        image block = make_image(c, ROW_BLOCK, w);
+        #pragma omp for
+        for(b = 0; b < blocks; ++b){
+            int y0 = b*ROW_BLOCK;
+            int rows = MIN(ROW_BLOCK, im.h - y0);
+            const size_t n = (size_t)rows*w;
+            unsigned char *p = im.data + (size_t)y0*w*c;
+            image view = block;
+            view.h = rows;
+            size_t i;
+            int k;
+            for(i = 0; i < n; ++i){
+                for(k = 0; k < c; ++k) view.data[k*n + i] = p[i*c + k] * (1.f / 255);
+            }
+            op(view, args);
+            for(i = 0; i < n; ++i){
+                for(k = 0; k < c; ++k) p[i*c + k] = (unsigned char)(fminf(fmaxf(view.data[k*n + i], 0), 1) * 255 + .5f);
+            }
+        }
+        free_image(block);
+    }
+}
+
+static void adjust_hsv_op(image im, const float *args)
+{
+    adjust_hsv(im, args[0], args[1], args[2]);
+}
+
+static void rgb_to_hsv_op(image im, const float *args)
+{
+    rgb_to_hsv(im);
+}
+
+static void hsv_to_rgb_op(image im, const float *args)
+{
+    hsv_to_rgb(im);
+}
+
+void adjust_hsv_u8(image_u8 im, float hue, float saturation, float value)
+{
+    float args[3] = {hue, saturation, value};
+    if(im.layout == INTERLEAVED){
+        map_row_blocks_interleaved_u8(im, adjust_hsv_op, args);
+        return;
+    }
+    map_row_blocks(im.data, im.c, im.h, im.w, &u8_codec, adjust_hsv_op, args);
+}
+
+void adjust_hsv_f16(image_f16 im, float hue, float saturation, float value)
+{
+    float args[3] = {hue, saturation, value};
+    map_row_blocks(im.data, im.c, im.h, im.w, &f16_codec, adjust_hsv_op, args);
+}
+
+void rgb_to_hsv_f16(image_f16 im)
+{
+    map_row_blocks(im.data, im.c, im.h, im.w, &f16_codec, rgb_to_hsv_op, 0);
+}
+
+void hsv_to_rgb_f16(image_f16 im)
+{
+    map_row_blocks(im.data, im.c, im.h, im.w, &f16_codec, hsv_to_rgb_op, 0);
+}
+
+// Convolution with the semantics of convolve_image. Each output row only
+// needs filter.h source rows per channel, so those are widened to float
+// into a ring of rows padded with the clamped edge pixels. Like
+// convolve_image, a filter of even size runs 2*(size/2)+1 taps and reads
+// its last row and column again for the extra one.
+static void convolve_compact(const void *src, void *dst, int c, int h, int w,
+        image filter, int preserve, const pixel_codec *codec)
+{
+    assert(c == filter.c || filter.c == 1);
+    const int fh = filter.h, fw = filter.w;
+    const int ry = fh / 2, rx = fw / 2;
+    const int th = 2*ry + 1, tw = 2*rx + 1;
+    const int pw = w + 2*rx;
+    int y;
+    #pragma omp parallel
+    {
+        // ring[k][slot] holds source row `held[k][slot]` of channel k.
+        float *ring = calloc((size_t)c*th*pw, sizeof(float));
+        int *held = malloc((size_t)c*th*sizeof(int));
+        float *row = calloc(w, sizeof(float));
+        int i;
+        for(i = 0; i < c*th; ++i) held[i] = -1;
+        #pragma omp for schedule(static)
+        for(y = 0; y < h; ++y){
+            int k, x, fy, fx;
+            if(!preserve) memset(row, 0, w*sizeof(float));
+            for(k = 0; k < c; ++k){
+                const int fk = filter.c == 1 ? 0 : k;
+                if(preserve) memset(row, 0, w*sizeof(float));
+                for(fy = -ry; fy <= ry; ++fy){
+                    int sy = MIN(MAX(y + fy, 0), h - 1);
+                    int slot = sy % th;
+                    float *r = ring + ((size_t)k*th + slot)*pw;
+                    if(held[k*th + slot] != sy){
+                        codec->load(pixel_at(src, codec, ((size_t)k*h + sy)*w), r + rx, w);
+                        for(x = 0; x < rx; ++x){
+                            r[x] = r[rx];
+                            r[rx + w + x] = r[rx + w - 1];
+                        }
+                        held[k*th + slot] = sy;
+                    }
+                    const float *f = filter.data + ((size_t)fk*fh + MIN(fy + ry, fh - 1))*fw;
+                    for(fx = 0; fx < tw; ++fx){
+                        const float wt = f[MIN(fx, fw - 1)];
+                        const float *s = r + fx;
+                        #pragma omp simd
+                        for(x = 0; x < w; ++x) row[x] += wt*s[x];
+                    }
+                }
+                if(preserve) codec->store(row, (char *)dst + ((size_t)k*h + y)*w*codec->size, w);
+            }
+            if(!preserve) codec->store(row, (char *)dst + (size_t)y*w*codec->size, w);
+        }
+        free(ring);
+        free(held);
+        free(row);
+    }
+}
+
+image_u8 convolve_image_u8(image_u8 im, image filter, int preserve)
+{
+    assert(im.layout == PLANAR || im.c == 1);
+    image_u8 out = make_image_u8(preserve ? im.c : 1, im.h, im.w);
+    convolve_compact(im.data, out.data, im.c, im.h, im.w, filter, preserve, &u8_codec);
+    return out;
+}
+
+image_f16 convolve_image_f16(image_f16 im, image filter, int preserve)
+{
+    image_f16 out = make_image_f16(preserve ? im.c : 1, im.h, im.w);
+    convolve_compact(im.data, out.data, im.c, im.h, im.w, filter, preserve, &f16_codec);
+    return out;
+}
+
+// Resize with the same tables as resize_image. Source rows are widened one
+// at a time for the horizontal pass, the narrow intermediate stays float.
+static void resize_compact(const void *src, void *dst, int c, int h, int w,
+        resample_plan *p, const pixel_codec *codec)
+{
+    const resample_axis cols = p->cols;
+    const resample_axis rows = p->rows;
+    float *tmp = calloc((size_t)c*h*p->w, sizeof(float));
+    int y;
+    #pragma omp parallel
+    {
+        float *line = calloc(MAX(w, p->w), sizeof(float));
+        #pragma omp for
+        for(y = 0; y < c*h; ++y){
+            int x, t;
+            codec->load(pixel_at(src, codec, (size_t)y*w), line, w);
+            float *out = tmp + (size_t)y*p->w;
+            for(x = 0; x < cols.n; ++x){
+                const int *index = cols.index + x*cols.taps;
+                const float *weight = cols.weight + x*cols.taps;
+                float sum = 0;
+                for(t = 0; t < cols.taps; ++t) sum += weight[t]*line[index[t]];
+                out[x] = sum;
+            }
+        }
+        #pragma omp for
+        for(y = 0; y < c*p->h; ++y){
+            int k = y / p->h;
+            const int *index = rows.index + (y % p->h)*rows.taps;
+            const float *weight = rows.weight + (y % p->h)*rows.taps;
+            int x, t;
+            memset(line, 0, p->w*sizeof(float));
+            for(t = 0; t < rows.taps; ++t){
+                const float *s = tmp + ((size_t)k*h + index[t])*p->w;
+                const float wt = weight[t];
+                #pragma omp simd
+                for(x = 0; x < p->w; ++x) line[x] += wt*s[x];
+            }
+            codec->store(line, (char *)dst + (size_t)y*p->w*codec->size, p->w);
+        }
+        free(line);
+    }
+    free(tmp);
+}
+
+image_u8 resize_image_u8(image_u8 im, int h, int w, RESAMPLE mode)
+{
+    assert(im.layout == PLANAR || im.c == 1);
+    image_u8 out = make_image_u8(im.c, h, w);
+    resample_plan *p = get_resample_plan(im.h, im.w, h, w, mode, BORDER_CLAMP, 0);
+    resize_compact(im.data, out.data, im.c, im.h, im.w, p, &u8_codec);
+    release_resample_plan(p);
+    return out;
+}
+
+image_f16 resize_image_f16(image_f16 im, int h, int w, RESAMPLE mode)
+{
+    image_f16 out = make_image_f16(im.c, h, w);
+    resample_plan *p = get_resample_plan(im.h, im.w, h, w, mode, BORDER_CLAMP, 0);
+    resize_compact(im.data, out.data, im.c, im.h, im.w, p, &f16_codec);
+    release_resample_plan(p);
+    return out;
+}
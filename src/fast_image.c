@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include "image.h"
+#include "instrument.h"
+
+// FAST corners with ORB style descriptors: an intensity centroid
+// orientation and 256 rotated BRIEF intensity comparisons packed into bits,
+// compared with popcount instead of float differences. Single scale, meant
+// for quick stitching previews rather than large scale changes.
+
+#define FAST_ARC 9
+#define ORB_BITS 256
+#define ORB_WORDS (ORB_BITS/64)
+#define ORB_RADIUS 15       // Orientation patch radius
+#define ORB_PAIR_RADIUS 13  // Test points stay within this, rotated or not
+#define ORB_BORDER 16
+#define ORB_ANGLES 30       // Precomputed pattern rotations, 12 degrees apart
+
+// Bresenham circle of radius 3, clockwise from the top.
+static const int circle_x[16] = {0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1};
+static const int circle_y[16] = {-3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3};
+
+// Test pairs x1, y1, x2, y2 for every rotation.
+static signed char orb_pattern[ORB_ANGLES][ORB_BITS][4];
+static int orb_umax[ORB_RADIUS + 1];
+static pthread_once_t orb_once = PTHREAD_ONCE_INIT;
+
+// Pairs are drawn once from an isotropic Gaussian around the keypoint (BRIEF
+// G II) with a fixed generator, so descriptors are the same on every run.
+static void init_orb_pattern()
+{
+    unsigned int state = 12345;
+    float base[ORB_BITS][4];
+    int i, j, a;
+    for(i = 0; i < ORB_BITS; ++i){
+        for(j = 0; j < 4; j += 2){
+            float x, y;
+            do {
+                state = state*1103515245 + 12345;
+                float u = ((state >> 8) + 1) / 16777217.0f;
+                state = state*1103515245 + 12345;
+                float v = ((state >> 8) & 0xffffff) / 16777216.0f;
+                float r = sqrtf(-2*logf(u))*ORB_PAIR_RADIUS/2.5f;
+                x = r*cosf(TWOPI*v);
+                y = r*sinf(TWOPI*v);
+            } while(x*x + y*y > ORB_PAIR_RADIUS*ORB_PAIR_RADIUS);
+            base[i][j] = x;
+            base[i][j+1] = y;
+        }
+    }
+    for(a = 0; a < ORB_ANGLES; ++a){
+        float c = cosf(a*TWOPI/ORB_ANGLES), s = sinf(a*TWOPI/ORB_ANGLES);
+        for(i = 0; i < ORB_BITS; ++i){
+            for(j = 0; j < 4; j += 2){
+                orb_pattern[a][i][j] = lrintf(c*base[i][j] - s*base[i][j+1]);
+                orb_pattern[a][i][j+1] = lrintf(s*base[i][j] + c*base[i][j+1]);
+            }
+        }
+    }
+    for(i = 0; i <= ORB_RADIUS; ++i) orb_umax[i] = sqrtf(ORB_RADIUS*ORB_RADIUS - i*i);
+}
+
+// Segment test score of one pixel: 0 unless FAST_ARC contiguous circle
+// pixels are all brighter than p + t or all darker than p - t, otherwise the
+// sum of how far the circle pixels on that side exceed the threshold.
+static float fast_score(const float *p, int stride, float t)
+{
+    float v = *p;
+    int state[16];
+    int i;
+    // At least two of the four compass points are inside any arc of 9.
+    int up = 0, down = 0;
+    for(i = 0; i < 16; i += 4){
+        float q = p[circle_y[i]*stride + circle_x[i]];
+        up += q > v + t;
+        down += q < v - t;
+    }
+    if(up < 2 && down < 2) return 0;
+
+    for(i = 0; i < 16; ++i){
+        float q = p[circle_y[i]*stride + circle_x[i]];
+        state[i] = q > v + t ? 1 : (q < v - t ? -1 : 0);
+    }
+    int side = 0, run = 0;
+    for(i = 0; i < 16 + FAST_ARC - 1 && !side; ++i){
+        int s = state[i & 15];
+        run = (s && i && s == state[(i - 1) & 15]) ? run + 1 : (s ? 1 : 0);
+        if(run >= FAST_ARC) side = s;
+    }
+    if(!side) return 0;
+    float score = 0;
+    for(i = 0; i < 16; ++i){
+        if(state[i] == side) score += fabsf(p[circle_y[i]*stride + circle_x[i]] - v) - t;
+    }
+    return score;
+}
+
+// Orientation of the intensity centroid of a disk around a pixel.
+static float centroid_angle(const float *p, int stride)
+{
+    float m01 = 0, m10 = 0;
+    int u, v;
+    for(u = -ORB_RADIUS; u <= ORB_RADIUS; ++u) m10 += u*p[u];
+    for(v = 1; v <= ORB_RADIUS; ++v){
+        int d = orb_umax[v];
+        float sum = 0;
+        for(u = -d; u <= d; ++u){
+            float below = p[v*stride + u], above = p[-v*stride + u];
+            sum += below - above;
+            m10 += u*(below + above);
+        }
+        m01 += v*sum;
+    }
+    return atan2f(m01, m10);
+}
+
+// Separable [1 4 6 4 1]/16 blur with clamped borders, BRIEF tests on raw
+// pixels are too noisy.
+static image binomial_blur(image im)
+{
+    static const float k[5] = {1/16.f, 4/16.f, 6/16.f, 4/16.f, 1/16.f};
+    image tmp = make_image(1, im.h, im.w);
+    image out = make_image(1, im.h, im.w);
+    int y, x, i;
+    #pragma omp parallel for private(x, i)
+    for(y = 0; y < im.h; ++y){
+        const float *row = im.data + (size_t)y*im.w;
+        float *t = tmp.data + (size_t)y*im.w;
+        for(x = 0; x < im.w; ++x){
+            float sum = 0;
+            for(i = -2; i <= 2; ++i) sum += k[i + 2]*row[MIN(MAX(x + i, 0), im.w - 1)];
+            t[x] = sum;
+        }
+    }
+    #pragma omp parallel for private(x, i)
+    for(y = 0; y < im.h; ++y){
+        float *o = out.data + (size_t)y*im.w;
+        for(x = 0; x < im.w; ++x) o[x] = 0;
+        for(i = -2; i <= 2; ++i){
+            const float *t = tmp.data + (size_t)MIN(MAX(y + i, 0), im.h - 1)*im.w;
+            for(x = 0; x < im.w; ++x) o[x] += k[i + 2]*t[x];
+        }
+    }
+    free_image(tmp);
+    return out;
+}
+
+typedef struct{
+    float score;
+    int i;
+} fast_corner;
+
+static int by_score(const void *a, const void *b)
+{
+    const fast_corner *x = a, *y = b;
+    if(x->score != y->score) return x->score < y->score ? 1 : -1;
+    return x->i - y->i;
+}
+
+// Detect FAST corners and describe them with oriented binary descriptors.
+// image im: input image, 1 or 3 channels in [0,1].
+// float thresh: how much brighter or darker the arc must be. Typical: .05-.1
+// int nms: distance to look for stronger corners.
+// int k: most corners to keep, strongest first.
+// int *n: pointer to number of corners found, should fill in.
+// returns: array of binary descriptors (n = 256 bits, data = 0).
+descriptor *orb_detector(image im, float thresh, int nms, int k, int *n)
+{
+    PROFILE_SCOPE("orb_detector");
+    pthread_once(&orb_once, init_orb_pattern);
+    *n = 0;
+    image gray = im.c == 3 ? rgb_to_grayscale(im) : copy_image(im);
+    if(gray.c != 1 || gray.w <= 2*ORB_BORDER || gray.h <= 2*ORB_BORDER){
+        free_image(gray);
+        return 0;
+    }
+    image score = make_image(1, gray.h, gray.w);
+    int y, x, i;
+    #pragma omp parallel for private(x)
+    for(y = ORB_BORDER; y < gray.h - ORB_BORDER; ++y){
+        for(x = ORB_BORDER; x < gray.w - ORB_BORDER; ++x){
+            score.data[y*gray.w + x] = fast_score(gray.data + y*gray.w + x, gray.w, thresh);
+        }
+    }
+    int count = 0;
+    int *idx = nms_maxima(score, nms, 0, &count);
+    fast_corner *c = calloc(count, sizeof(fast_corner));
+    for(i = 0; i < count; ++i){
+        c[i].score = score.data[idx[i]];
+        c[i].i = idx[i];
+    }
+    qsort(c, count, sizeof(fast_corner), by_score);
+    if(k >= 0 && count > k) count = k;
+
+    image smooth = binomial_blur(gray);
+    descriptor *d = calloc(count, sizeof(descriptor));
+    #pragma omp parallel for
+    for(i = 0; i < count; ++i){
+        int cy = c[i].i/gray.w, cx = c[i].i%gray.w;
+        float angle = centroid_angle(gray.data + c[i].i, gray.w);
+        int bin = (int)lrintf(angle*ORB_ANGLES/TWOPI);
+        bin = ((bin % ORB_ANGLES) + ORB_ANGLES) % ORB_ANGLES;
+        const float *s = smooth.data + c[i].i;
+        unsigned long long *bits = calloc(ORB_WORDS, sizeof(unsigned long long));
+        int j;
+        for(j = 0; j < ORB_BITS; ++j){
+            const signed char *t = orb_pattern[bin][j];
+            if(s[t[1]*gray.w + t[0]] < s[t[3]*gray.w + t[2]]) bits[j/64] |= 1ULL << (j%64);
+        }
+        d[i].p = make_point(cx, cy);
+        d[i].n = ORB_BITS;
+        d[i].data = 0;
+        d[i].bits = bits;
+    }
+    *n = count;
+    PROFILE_COUNT("orb_detector", count);
+
+    free(idx);
+    free(c);
+    free_image(gray);
+    free_image(score);
+    free_image(smooth);
+    return d;
+}
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include <assert.h>
+#include "image.h"
+#include "instrument.h"
+
+// Convolution through the FFT, for filters too big to apply directly.
+//
+// The image is cut into output tiles. Each tile reads a block with a halo of
+// the filter size through border_index, so results match the direct
+// convolution with the same border mode. The block is transformed,
+// multiplied by the conjugate spectrum of the filter (convolve_image
+// correlates, it doesn't flip), and transformed back. Outputs whose window
+// wrapped around the block are dropped (overlap-save).
+//
+// Two real channels share one complex transform as the real and imaginary
+// parts. Their spectra are separated again with the Hermitian symmetry of
+// real signals, so each channel can have its own filter.
+
+// Smallest FFT block edge used for tiling, blocks also grow to four times
+// the filter so the halo doesn't dominate.
+#define FFT_BLOCK 256
+
+typedef float complex cfloat;
+
+typedef struct{
+    int n, log2n;
+    int *rev;               // Bit reversal permutation
+    cfloat *twiddle;        // exp(-2 pi i k/n), k < n/2
+} fft_plan;
+
+static fft_plan make_fft_plan(int n)
+{
+    fft_plan p;
+    p.n = n;
+    for(p.log2n = 0; (1 << p.log2n) < n; ++p.log2n);
+    assert((1 << p.log2n) == n);
+    p.rev = calloc(n, sizeof(int));
+    p.twiddle = calloc(n/2 + 1, sizeof(cfloat));
+    int i, b;
+    for(i = 0; i < n; ++i){
+        int r = 0;
+        for(b = 0; b < p.log2n; ++b) r |= ((i >> b) & 1) << (p.log2n - 1 - b);
+        p.rev[i] = r;
+    }
+    for(i = 0; i < n/2; ++i) p.twiddle[i] = cexp(-TWOPI*I*i/n);
+    return p;
+}
+
+static void free_fft_plan(fft_plan p)
+{
+    free(p.rev);
+    free(p.twiddle);
+}
+
+// In-place iterative radix-2 FFT of n values spaced stride apart. The
+// inverse is unscaled.
+static void fft(const fft_plan *p, cfloat *x, int stride, int inverse)
+{
+    int n = p->n;
+    int i, j, len;
+    for(i = 0; i < n; ++i){
+        j = p->rev[i];
+        if(j > i){
+            cfloat t = x[i*stride];
+            x[i*stride] = x[j*stride];
+            x[j*stride] = t;
+        }
+    }
+    for(len = 2; len <= n; len <<= 1){
+        int half = len/2, step = n/len;
+        for(i = 0; i < n; i += len){
+            for(j = 0; j < half; ++j){
+                cfloat w = p->twiddle[j*step];
+                if(inverse) w = conjf(w);
+                cfloat a = x[(i + j)*stride];
+                cfloat b = x[(i + j + half)*stride]*w;
+                x[(i + j)*stride] = a + b;
+                x[(i + j + half)*stride] = a - b;
+            }
+        }
+    }
+}
+
+// 2d FFT of an h x w row-major block, rows then columns. Columns are
+// gathered into scratch so the transform runs on contiguous memory.
+static void fft2(const fft_plan *rows, const fft_plan *cols, cfloat *x, cfloat *scratch, int inverse)
+{
+    int h = cols->n, w = rows->n;
+    int i, j;
+    for(i = 0; i < h; ++i) fft(rows, x + (size_t)i*w, 1, inverse);
+    for(j = 0; j < w; ++j){
+        for(i = 0; i < h; ++i) scratch[i] = x[(size_t)i*w + j];
+        fft(cols, scratch, 1, inverse);
+        for(i = 0; i < h; ++i) x[(size_t)i*w + j] = scratch[i];
+    }
+}
+
+static int next_pow2(int n)
+{
+    int p = 1;
+    while(p < n) p <<= 1;
+    return p;
+}
+
+// FFT block edge for one dimension, big enough for the whole image and its
+// halo if that fits in a tile block.
+static int fft_block_size(int size, int taps)
+{
+    return MIN(next_pow2(size + taps - 1), next_pow2(MAX(FFT_BLOCK, 4*taps)));
+}
+
+// Whether convolve_image should go through the FFT. The direct method costs
+// a multiply-add per tap and output, the FFT about 2 log2(block) butterflies
+// per output and transform, and needs odd filter sizes.
+// image im, filter: as in convolve_image.
+// returns: 1 to use convolve_image_fft.
+int use_fft_convolution(image im, image filter)
+{
+    if(!(filter.w & 1) || !(filter.h & 1)) return 0;
+    int bh = fft_block_size(im.h, filter.h), bw = fft_block_size(im.w, filter.w);
+    int th = bh - filter.h + 1, tw = bw - filter.w + 1;
+    float per_output = (float)bh*bw/(MIN(th, im.h)*MIN(tw, im.w));
+    float fft_cost = 8*log2f((float)bh*bw)*per_output;
+    return filter.w*filter.h > fft_cost;
+}
+
+// Convolve an image with a filter through the FFT, with the same result as
+// the direct convolve_image up to float rounding.
+// image im: image to filter.
+// image filter: odd sized filter, 1 channel or one per image channel.
+// int preserve: keep channels separate (1) or sum them into one (0).
+// returns: filtered image.
+image convolve_image_fft(image im, image filter, int preserve)
+{
+    return convolve_image_fft_border(im, filter, preserve, BORDER_CLAMP, 0);
+}
+
+// As convolve_image_fft, reading outside pixels by a border mode.
+// BORDER border: how pixels outside the image are filled.
+// float value: outside value for BORDER_CONSTANT.
+image convolve_image_fft_border(image im, image filter, int preserve, BORDER border, float value)
+{
+    PROFILE_SCOPE("convolve_image_fft");
+    assert(filter.c == 1 || filter.c == im.c);
+    assert((filter.w & 1) && (filter.h & 1));
+    int bh = fft_block_size(im.h, filter.h), bw = fft_block_size(im.w, filter.w);
+    int th = bh - filter.h + 1, tw = bw - filter.w + 1;
+    int rh = filter.h/2, rw = filter.w/2;
+    fft_plan rows = make_fft_plan(bw), cols = make_fft_plan(bh);
+    size_t block = (size_t)bh*bw;
+    image out = make_image(preserve ? im.c : 1, im.h, im.w);
+
+    // Conjugate spectra of the filters, so products correlate.
+    cfloat *spectra = calloc(block*filter.c, sizeof(cfloat));
+    cfloat *scratch = calloc(bh, sizeof(cfloat));
+    int c, i, j;
+    for(c = 0; c < filter.c; ++c){
+        cfloat *k = spectra + block*c;
+        for(i = 0; i < filter.h; ++i){
+            for(j = 0; j < filter.w; ++j) k[(size_t)i*bw + j] = filter.data[(c*filter.h + i)*filter.w + j];
+        }
+        fft2(&rows, &cols, k, scratch, 0);
+        for(i = 0; i < block; ++i) k[i] = conjf(k[i]);
+    }
+    free(scratch);
+
+    int tiles_y = (im.h + th - 1)/th, tiles_x = (im.w + tw - 1)/tw;
+    int t;
+    #pragma omp parallel
+    {
+        cfloat *z = malloc(block*sizeof(cfloat));
+        cfloat *sum = malloc(block*sizeof(cfloat));
+        cfloat *col = malloc(bh*sizeof(cfloat));
+        int *sx = malloc(bw*sizeof(int));
+        #pragma omp for schedule(dynamic)
+        for(t = 0; t < tiles_y*tiles_x; ++t){
+            int y0 = t/tiles_x*th, x0 = t%tiles_x*tw;
+            int oh = MIN(th, im.h - y0), ow = MIN(tw, im.w - x0);
+            int c0, y, x;
+            if(!preserve) memset(sum, 0, block*sizeof(cfloat));
+            for(x = 0; x < bw; ++x) sx[x] = border_index(x0 + x - rw, im.w, border);
+            for(c0 = 0; c0 < im.c; c0 += 2){
+                int c1 = c0 + 1 < im.c ? c0 + 1 : -1;
+                // Block of two channels, read through the border mode.
+                for(y = 0; y < bh; ++y){
+                    int sy = border_index(y0 + y - rh, im.h, border);
+                    cfloat *zr = z + (size_t)y*bw;
+                    if(sy < 0){
+                        for(x = 0; x < bw; ++x) zr[x] = value + (c1 < 0 ? 0 : value)*I;
+                        continue;
+                    }
+                    const float *a = im.data + ((size_t)c0*im.h + sy)*im.w;
+                    const float *b = c1 < 0 ? 0 : im.data + ((size_t)c1*im.h + sy)*im.w;
+                    for(x = 0; x < bw; ++x){
+                        float va = sx[x] < 0 ? value : a[sx[x]];
+                        float vb = sx[x] < 0 ? value : (b ? b[sx[x]] : 0);
+                        zr[x] = va + vb*I;
+                    }
+                }
+                fft2(&rows, &cols, z, col, 0);
+
+                const cfloat *ka = spectra + block*(filter.c == 1 ? 0 : c0);
+                const cfloat *kb = spectra + block*(filter.c == 1 || c1 < 0 ? 0 : c1);
+                cfloat *dst = preserve ? z : sum;
+                // Split the packed spectrum, A(k) = (Z(k) + Z*(-k))/2 and
+                // B(k) = (Z(k) - Z*(-k))/2i, and filter each. Pairs k, -k
+                // are updated together since dst may be z itself.
+                for(y = 0; y < bh; ++y){
+                    int ny = (bh - y) & (bh - 1);
+                    for(x = 0; x < bw; ++x){
+                        int nx = (bw - x) & (bw - 1);
+                        size_t p = (size_t)y*bw + x, q = (size_t)ny*bw + nx;
+                        if(q < p) continue;
+                        cfloat zp = z[p], zq = z[q];
+                        cfloat ap = (zp + conjf(zq))/2, bp = (zp - conjf(zq))/(2*I);
+                        cfloat aq = (zq + conjf(zp))/2, bq = (zq - conjf(zp))/(2*I);
+                        if(preserve){
+                            dst[p] = ap*ka[p] + I*bp*kb[p];
+                            dst[q] = aq*ka[q] + I*bq*kb[q];
+                        } else {
+                            dst[p] += ap*ka[p] + (c1 < 0 ? 0 : bp*kb[p]);
+                            if(q != p) dst[q] += aq*ka[q] + (c1 < 0 ? 0 : bq*kb[q]);
+                        }
+                    }
+                }
+                if(!preserve) continue;
+                fft2(&rows, &cols, z, col, 1);
+                float scale = 1.0f/block;
+                for(y = 0; y < oh; ++y){
+                    float *oa = out.data + ((size_t)c0*im.h + y0 + y)*im.w + x0;
+                    float *ob = c1 < 0 ? 0 : out.data + ((size_t)c1*im.h + y0 + y)*im.w + x0;
+                    const cfloat *zr = z + (size_t)y*bw;
+                    for(x = 0; x < ow; ++x){
+                        oa[x] = crealf(zr[x])*scale;
+                        if(ob) ob[x] = cimagf(zr[x])*scale;
+                    }
+                }
+            }
+            if(!preserve){
+                fft2(&rows, &cols, sum, col, 1);
+                float scale = 1.0f/block;
+                for(y = 0; y < oh; ++y){
+                    float *o = out.data + (size_t)(y0 + y)*im.w + x0;
+                    const cfloat *sr = sum + (size_t)y*bw;
+                    for(x = 0; x < ow; ++x) o[x] = crealf(sr[x])*scale;
+                }
+            }
+        }
+        free(z);
+        free(sum);
+        free(col);
+        free(sx);
+    }
+    free(spectra);
+    free_fft_plan(rows);
+    free_fft_plan(cols);
+    return out;
+}
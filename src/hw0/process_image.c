@@ -43,36 +43,35 @@ image rgb_to_grayscale(image im)
 {
     assert(im.c == 3);
     image gray = make_image(1, im.h, im.w);
-    for (int i = 0; i < im.h; i++)
-        for (int j = 0; j < im.w; j++)
-        {
-            float r = get_pixel(im, 0, i, j);
-            float g = get_pixel(im, 1, i, j);
-            float b = get_pixel(im, 2, i, j);
-            float grayscale_weighted_sum = 0.299 * r + 0.587 * g + 0.114 * b;
-            set_pixel(gray, 0, i, j, grayscale_weighted_sum);
-        }
-    
+    const int n = im.h * im.w;
+    const float *r = im.data;
+    const float *g = im.data + n;
+    const float *b = im.data + 2*n;
+    float *y = gray.data;
+    #pragma omp parallel for simd
+    for (int i = 0; i < n; i++)
+        y[i] = 0.299f * r[i] + 0.587f * g[i] + 0.114f * b[i];
+
     return gray;
 }
 
 void shift_image(image im, int c, float v)
 {
     assert(c >=0 && c <= 2);
-    for (int i = 0; i < im.h; i++)
-        for (int j = 0; j < im.w; j++)
-            set_pixel(im, c, i, j, get_pixel(im, c, i, j) + v);
+    const int n = im.h * im.w;
+    float *p = im.data + c * n;
+    #pragma omp parallel for simd
+    for (int i = 0; i < n; i++)
+        p[i] += v;
 }
 
 void clamp_image(image im)
 {
-    for (int i = 0; i < im.c * im.h * im.w; i++)
-    {
-        if (im.data[i] < 0)
-            im.data[i] = 0;
-        if (im.data[i] > 1)
-            im.data[i] = 1;
-    }
+    const int n = im.c * im.h * im.w;
+    float *p = im.data;
+    #pragma omp parallel for simd
+    for (int i = 0; i < n; i++)
+        p[i] = fminf(fmaxf(p[i], 0), 1);
 }
 
 // These might be handy
@@ -86,112 +85,117 @@ float three_way_min(float a, float b, float c)
     return (a < b) ? ( (a < c) ? a : c) : ( (b < c) ? b : c) ;
 }
 
+// Branch-free conversion of one pixel from RGB to HSV.
+// Written with selects instead of ifs so the loops calling it vectorize.
+static inline void rgb_to_hsv_pixel(float R, float G, float B, float *H, float *S, float *V)
+{
+    float v = fmaxf(R, fmaxf(G, B));
+    float m = fminf(R, fminf(G, B));
+    float C = v - m;
+    float inv_C = C > 0 ? 1 / C : 0;
+    float h = (v == R) ? (G - B) * inv_C
+            : (v == G) ? (B - R) * inv_C + 2
+            :            (R - G) * inv_C + 4;
+    h = C > 0 ? h / 6 : 0;
+    *H = h < 0 ? h + 1 : h;
+    *S = v != 0 ? C / v : 0;
+    *V = v;
+}
+
+// Branch-free conversion of one pixel from HSV to RGB.
+// Each channel is V - C*clamp(min(k, 4 - k), 0, 1) with k = (n + 6H) mod 6,
+// n = 5, 3, 1 for R, G, B, which matches the six hue sectors.
+static inline void hsv_to_rgb_pixel(float H, float S, float V, float *R, float *G, float *B)
+{
+    float C = V * S;
+    float h = H * 6;
+    float kr = 5 + h, kg = 3 + h, kb = 1 + h;
+    kr -= 6 * floorf(kr / 6);
+    kg -= 6 * floorf(kg / 6);
+    kb -= 6 * floorf(kb / 6);
+    *R = V - C * fmaxf(0, fminf(fminf(kr, 4 - kr), 1));
+    *G = V - C * fmaxf(0, fminf(fminf(kg, 4 - kg), 1));
+    *B = V - C * fmaxf(0, fminf(fminf(kb, 4 - kb), 1));
+}
+
 void rgb_to_hsv(image im)
 {
-    for (int i = 0; i < im.h; i++)
-        for (int j = 0; j < im.w; j++)
-        {
-            float R = get_pixel(im, 0, i, j);
-            float G = get_pixel(im, 1, i, j);
-            float B = get_pixel(im, 2, i, j);
-            
-            float V = three_way_max(R, G, B);
-            float m = three_way_min(R, G, B);
-            float C = V - m;
-            float S = 0;
-            if (V != 0)
-                S = C / V;
-            float H_prime = 0;
-            if (C > 0 && V == R)
-                H_prime = (G - B) / C;
-            else if (C > 0 && V == G)
-                H_prime = (B - R) / C + 2;
-            else if (C > 0 && V == B)
-                H_prime = (R - G) / C + 4;
-            
-            float H = H_prime / 6;
-            if (H < 0)
-                H += 1;
-            
-            set_pixel(im, 0, i, j, H);
-            set_pixel(im, 1, i, j, S);
-            set_pixel(im, 2, i, j, V);
-        }
+    assert(im.c >= 3);
+    const int n = im.h * im.w;
+    float *c0 = im.data;
+    float *c1 = im.data + n;
+    float *c2 = im.data + 2*n;
+    #pragma omp parallel for simd
+    for (int i = 0; i < n; i++)
+    {
+        float H, S, V;
+        rgb_to_hsv_pixel(c0[i], c1[i], c2[i], &H, &S, &V);
+        c0[i] = H;
+        c1[i] = S;
+        c2[i] = V;
+    }
 }
 
+// Hue outside [0,1) gives gray V - C, as the sector by sector version
+// did. hsv_to_rgb_pixel itself wraps hue, adjust_hsv relies on that.
 void hsv_to_rgb(image im)
 {
-    for (int i = 0; i < im.h; i++)
-        for (int j = 0; j < im.w; j++)
-        {
-            float H = get_pixel(im, 0, i, j);
-            float S = get_pixel(im, 1, i, j);
-            float V = get_pixel(im, 2, i, j);
-            
-            float H_prime = H * 6;
-            float C = V * S;
-            float R = 0, G = 0, B = 0;
-            if (0 <= H_prime && H_prime < 1)
-            {
-                float X = 1 - (1 - H_prime);
-                X *= C;
-                R = C;
-                G = X;
-                B = 0;
-            }
-            else if (1 <= H_prime && H_prime < 2)
-            {
-                float X = 1 - (H_prime - 1);
-                X *= C;
-                R = X;
-                G = C;
-                B = 0;
-            }
-            else if (2 <= H_prime && H_prime < 3)
-            {
-                float X = 1 - (1 - (H_prime - 2));
-                X *= C;
-                R = 0;
-                G = C;
-                B = X;
-            } 
-            else if (3 <= H_prime && H_prime < 4)
-            {
-                float X = 1 - (H_prime - 2 - 1);
-                X *= C;
-                R = 0;
-                G = X;
-                B = C;
-            }
-            else if (4 <= H_prime && H_prime < 5)
-            {
-                float X = 1 - (1 - (H_prime - 4));
-                X *= C;
-                R = X;
-                G = 0;
-                B = C;
-            }
-            else if (5 <= H_prime && H_prime < 6)
-            {
-                float X = 1 - (H_prime - 4 - 1);
-                X *= C;
-                R = C;
-                G = 0;
-                B = X;
-            }
-            float m = V - C;
-
-            set_pixel(im, 0, i, j, R + m);
-            set_pixel(im, 1, i, j, G + m);
-            set_pixel(im, 2, i, j, B + m);
-        }
+    assert(im.c >= 3);
+    const int n = im.h * im.w;
+    float *c0 = im.data;
+    float *c1 = im.data + n;
+    float *c2 = im.data + 2*n;
+    #pragma omp parallel for simd
+    for (int i = 0; i < n; i++)
+    {
+        float H = c0[i], S = c1[i], V = c2[i];
+        float R, G, B;
+        hsv_to_rgb_pixel(H, S, V, &R, &G, &B);
+        int in_range = H >= 0 && H < 1;
+        float gray = V - V * S;
+        c0[i] = in_range ? R : gray;
+        c1[i] = in_range ? G : gray;
+        c2[i] = in_range ? B : gray;
+    }
 }
 
 void scale_image(image im, int c, float v)
 {
     assert(c >=0 && c <= 2);
-    for (int i = 0; i < im.h; i++)
-        for (int j = 0; j < im.w; j++)
-            set_pixel(im, c, i, j, get_pixel(im, c, i, j) * v);
+    const int n = im.h * im.w;
+    float *p = im.data + c * n;
+    #pragma omp parallel for simd
+    for (int i = 0; i < n; i++)
+        p[i] *= v;
     clamp_image(im);
 }
+
+// Adjust an RGB image in HSV space in a single pass over memory.
+// Same result as rgb_to_hsv, shifting hue, scaling saturation and value,
+// clamping, hsv_to_rgb and clamp_image, except that hue wraps around.
+// image im: RGB image, modified in place.
+// float hue: amount to add to hue, 1 is a full turn.
+// float saturation: factor to scale saturation by.
+// float value: factor to scale value (exposure) by.
+void adjust_hsv(image im, float hue, float saturation, float value)
+{
+    assert(im.c >= 3);
+    const int n = im.h * im.w;
+    float *c0 = im.data;
+    float *c1 = im.data + n;
+    float *c2 = im.data + 2*n;
+    #pragma omp parallel for simd
+    for (int i = 0; i < n; i++)
+    {
+        float H, S, V, R, G, B;
+        rgb_to_hsv_pixel(c0[i], c1[i], c2[i], &H, &S, &V);
+        H += hue;
+        H -= floorf(H);
+        S = fminf(fmaxf(S * saturation, 0), 1);
+        V = fminf(fmaxf(V * value, 0), 1);
+        hsv_to_rgb_pixel(H, S, V, &R, &G, &B);
+        c0[i] = fminf(fmaxf(R, 0), 1);
+        c1[i] = fminf(fmaxf(G, 0), 1);
+        c2[i] = fminf(fmaxf(B, 0), 1);
+    }
+}
@@ -1,6 +1,12 @@
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
 #include "image.h"
 
+#define RESAMPLE_CACHE_SIZE 8
+
 float nn_interpolate(image im, int c, float h, float w)
 {
     return get_pixel(im, c, round(h), round(w));
@@ -8,15 +14,7 @@ float nn_interpolate(image im, int c, float h, float w)
 
 image nn_resize(image im, int h, int w)
 {
-    image resized_image = make_image(im.c, h, w);
-    for (int i = 0; i < h; i++)
-        for (int j = 0; j < w; j++)
-        {
-            set_pixel(resized_image, 0, i, j, nn_interpolate(im, 0, i * (1.0 * im.h / h) - 0.5 + 0.5 * (1.0 * im.h / h), j * (1.0 * im.w / w) - 0.5 + 0.5 * (1.0 * im.w / w)));
-            set_pixel(resized_image, 1, i, j, nn_interpolate(im, 1, i * (1.0 * im.h / h) - 0.5 + 0.5 * (1.0 * im.h / h), j * (1.0 * im.w / w) - 0.5 + 0.5 * (1.0 * im.w / w)));
-            set_pixel(resized_image, 2, i, j, nn_interpolate(im, 2, i * (1.0 * im.h / h) - 0.5 + 0.5 * (1.0 * im.h / h), j * (1.0 * im.w / w) - 0.5 + 0.5 * (1.0 * im.w / w)));
-        }
-    return resized_image;
+    return resize_image(im, h, w, NEAREST);
 }
 
 float bilinear_interpolate(image im, int c, float h, float w)
@@ -49,14 +47,312 @@ float bilinear_interpolate(image im, int c, float h, float w)
 
 image bilinear_resize(image im, int h, int w)
 {
-    image resized_image = make_image(im.c, h, w);
-    for (int i = 0; i < h; i++)
-        for (int j = 0; j < w; j++)
-        {
-            set_pixel(resized_image, 0, i, j, bilinear_interpolate(im, 0, i * (1.0 * im.h / h) - 0.5 + 0.5 * (1.0 * im.h / h), j * (1.0 * im.w / w) - 0.5 + 0.5 * (1.0 * im.w / w)));
-            set_pixel(resized_image, 1, i, j, bilinear_interpolate(im, 1, i * (1.0 * im.h / h) - 0.5 + 0.5 * (1.0 * im.h / h), j * (1.0 * im.w / w) - 0.5 + 0.5 * (1.0 * im.w / w)));
-            set_pixel(resized_image, 2, i, j, bilinear_interpolate(im, 2, i * (1.0 * im.h / h) - 0.5 + 0.5 * (1.0 * im.h / h), j * (1.0 * im.w / w) - 0.5 + 0.5 * (1.0 * im.w / w)));
+    return resize_image(im, h, w, BILINEAR);
+}
+
+// Source coordinate of the center of output sample i, the same mapping
+// nn_resize and bilinear_resize have always used.
+static float source_coordinate(int i, int src, int dst)
+{
+    return i * (1.0 * src / dst) - 0.5 + 0.5 * (1.0 * src / dst);
+}
+
+// Lanczos window with a = 3.
+static float lanczos3(float x)
+{
+    if(x == 0) return 1;
+    if(x <= -3 || x >= 3) return 0;
+    float px = M_PI * x;
+    return 3 * sin(px) * sin(px / 3) / (px * px);
+}
+
+// Build the index/weight table for one axis.
+// int src: number of samples along the axis in the source image.
+// int dst: number of samples along the axis in the output image.
+// RESAMPLE mode: interpolation to use.
+// BORDER border: how source samples past the edges are read.
+// returns: table with dst*taps source indexes and weights. Border taps are
+//          mapped into the source here, or for BORDER_CONSTANT given index 0
+//          and weight 0 with their weight moved to outside.
+resample_axis make_resample_axis(int src, int dst, RESAMPLE mode, BORDER border)
+{
+    resample_axis a;
+    float scale = 1.0 * src / dst;
+    // Lanczos stretches its window when shrinking so it also antialiases.
+    float support = 3 * MAX(scale, 1);
+    a.n = dst;
+    if(mode == NEAREST) a.taps = 1;
+    else if(mode == BILINEAR) a.taps = 2;
+    else if(mode == AREA) a.taps = (int)ceil(scale) + 1;
+    else a.taps = 2*(int)ceil(support) + 1;
+    a.index = calloc((size_t)dst*a.taps, sizeof(int));
+    a.weight = calloc((size_t)dst*a.taps, sizeof(float));
+    a.outside = 0;
+    int i, t;
+    for(i = 0; i < dst; ++i){
+        float x = source_coordinate(i, src, dst);
+        int *index = a.index + i*a.taps;
+        float *weight = a.weight + i*a.taps;
+        if(mode == NEAREST){
+            index[0] = (int)round(x);
+            weight[0] = 1;
+        } else if(mode == BILINEAR){
+            int x0 = floor(x);
+            float f = x - x0;
+            index[0] = x0;
+            index[1] = x0 + 1;
+            weight[0] = 1 - f;
+            weight[1] = f;
+        } else if(mode == AREA){
+            // Output sample i covers [i*scale, (i+1)*scale) of the source,
+            // every source pixel is weighted by how much of it is covered.
+            double lo = i * (double)src / dst;
+            double hi = (i + 1) * (double)src / dst;
+            int j0 = floor(lo);
+            for(t = 0; t < a.taps; ++t){
+                int j = j0 + t;
+                double overlap = MIN(hi, j + 1) - MAX(lo, j);
+                index[t] = j;
+                weight[t] = overlap > 0 ? overlap / (hi - lo) : 0;
+            }
+        } else {
+            int j0 = (int)floor(x - support) + 1;
+            float sum = 0;
+            for(t = 0; t < a.taps; ++t){
+                int j = j0 + t;
+                index[t] = j;
+                weight[t] = lanczos3((j - x) / MAX(scale, 1));
+                sum += weight[t];
+            }
+            for(t = 0; t < a.taps; ++t) weight[t] /= sum;
+        }
+    }
+    for(i = 0; i < dst*a.taps; ++i){
+        int j = border_index(a.index[i], src, border);
+        if(j < 0){
+            if(!a.outside) a.outside = calloc(dst, sizeof(float));
+            a.outside[i/a.taps] += a.weight[i];
+            a.weight[i] = 0;
+            j = 0;
+        }
+        a.index[i] = j;
+    }
+    return a;
+}
+
+void free_resample_axis(resample_axis a)
+{
+    free(a.index);
+    free(a.weight);
+    free(a.outside);
+}
+
+// Precompute everything needed to resample images of one geometry.
+// int src_h, src_w: size of source images.
+// int h, w: size of output images.
+// RESAMPLE mode: interpolation to use.
+// BORDER border: how source pixels past the edges are read.
+// float value: outside value for BORDER_CONSTANT.
+// returns: plan to pass to resample_image, free with free_resample_plan.
+resample_plan *make_resample_plan(int src_h, int src_w, int h, int w, RESAMPLE mode, BORDER border, float value)
+{
+    resample_plan *p = calloc(1, sizeof(resample_plan));
+    p->src_h = src_h;
+    p->src_w = src_w;
+    p->h = h;
+    p->w = w;
+    p->mode = mode;
+    p->border = border;
+    p->value = value;
+    p->rows = make_resample_axis(src_h, h, mode, border);
+    p->cols = make_resample_axis(src_w, w, mode, border);
+    return p;
+}
+
+void free_resample_plan(resample_plan *p)
+{
+    if(!p) return;
+    free_resample_axis(p->rows);
+    free_resample_axis(p->cols);
+    free(p);
+}
+
+// Area downscale by integer factors: every output pixel is the mean of an
+// fy x fx block, computed a row at a time so each source pixel is read once.
+// image im: image to shrink.
+// int fy, fx: shrink factors, im.h and im.w must be multiples of them.
+// returns: downscaled image.
+static image area_downscale(image im, int fy, int fx)
+{
+    image out = make_image(im.c, im.h/fy, im.w/fx);
+    const float norm = 1.f / (fy * fx);
+    int y;
+    #pragma omp parallel for
+    for(y = 0; y < out.c*out.h; ++y){
+        float *dst = out.data + (size_t)y*out.w;
+        const float *src = im.data + (size_t)y*fy*im.w;
+        int k, x, t;
+        for(k = 0; k < fy; ++k, src += im.w){
+            if(fx == 1){
+                #pragma omp simd
+                for(x = 0; x < out.w; ++x) dst[x] += src[x];
+            } else {
+                for(x = 0; x < out.w; ++x){
+                    const float *block = src + x*fx;
+                    float sum = 0;
+                    for(t = 0; t < fx; ++t) sum += block[t];
+                    dst[x] += sum;
+                }
+            }
         }
-    return resized_image;
+        #pragma omp simd
+        for(x = 0; x < out.w; ++x) dst[x] *= norm;
+    }
+    return out;
 }
 
+// Resample an image with a precomputed plan: a horizontal pass into a
+// src_h x w buffer, then a vertical pass that blends whole rows.
+// image im: image to resample, any number of channels.
+// resample_plan *p: plan made for im's size.
+// returns: resampled image.
+image resample_image(image im, resample_plan *p)
+{
+    assert(im.h == p->src_h && im.w == p->src_w);
+    if(p->mode == AREA && im.h % p->h == 0 && im.w % p->w == 0){
+        return area_downscale(im, im.h / p->h, im.w / p->w);
+    }
+    image out = make_image(im.c, p->h, p->w);
+    image tmp = make_image(im.c, im.h, p->w);
+    const resample_axis cols = p->cols;
+    const resample_axis rows = p->rows;
+    int y;
+
+    #pragma omp parallel for
+    for(y = 0; y < im.c*im.h; ++y){
+        const float *src = im.data + (size_t)y*im.w;
+        float *dst = tmp.data + (size_t)y*tmp.w;
+        int x, t;
+        for(x = 0; x < cols.n; ++x){
+            const int *index = cols.index + x*cols.taps;
+            const float *weight = cols.weight + x*cols.taps;
+            float sum = 0;
+            for(t = 0; t < cols.taps; ++t){
+                sum += weight[t]*src[index[t]];
+            }
+            dst[x] = sum;
+        }
+        if(cols.outside){
+            for(x = 0; x < cols.n; ++x) dst[x] += p->value*cols.outside[x];
+        }
+    }
+
+    #pragma omp parallel for
+    for(y = 0; y < out.c*out.h; ++y){
+        int c = y / out.h;
+        const int *index = rows.index + (y % out.h)*rows.taps;
+        const float *weight = rows.weight + (y % out.h)*rows.taps;
+        float *dst = out.data + (size_t)y*out.w;
+        int x, t;
+        for(t = 0; t < rows.taps; ++t){
+            const float *src = tmp.data + ((size_t)c*tmp.h + index[t])*tmp.w;
+            const float wt = weight[t];
+            #pragma omp simd
+            for(x = 0; x < out.w; ++x){
+                dst[x] += wt*src[x];
+            }
+        }
+        // Whole rows past the edge, every one of their samples is value.
+        if(rows.outside){
+            const float v = p->value*rows.outside[y % out.h];
+            for(x = 0; x < out.w; ++x) dst[x] += v;
+        }
+    }
+    free_image(tmp);
+    return out;
+}
+
+// Plans are kept around for the geometries used most recently, so batches
+// resized to a fixed size only build their tables once.
+static resample_plan *plan_cache[RESAMPLE_CACHE_SIZE];
+static int plan_refs[RESAMPLE_CACHE_SIZE];
+static unsigned long plan_used[RESAMPLE_CACHE_SIZE];
+static unsigned long plan_clock = 0;
+static pthread_mutex_t plan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Fetch a plan from the cache, building it if needed. The plan stays valid
+// until it is handed back with release_resample_plan.
+resample_plan *get_resample_plan(int src_h, int src_w, int h, int w, RESAMPLE mode, BORDER border, float value)
+{
+    int i;
+    pthread_mutex_lock(&plan_lock);
+    for(i = 0; i < RESAMPLE_CACHE_SIZE; ++i){
+        resample_plan *p = plan_cache[i];
+        if(p && p->src_h == src_h && p->src_w == src_w && p->h == h && p->w == w && p->mode == mode &&
+                p->border == border && (border != BORDER_CONSTANT || p->value == value)){
+            ++plan_refs[i];
+            plan_used[i] = ++plan_clock;
+            pthread_mutex_unlock(&plan_lock);
+            return p;
+        }
+    }
+    pthread_mutex_unlock(&plan_lock);
+
+    resample_plan *p = make_resample_plan(src_h, src_w, h, w, mode, border, value);
+
+    pthread_mutex_lock(&plan_lock);
+    int slot = -1;
+    for(i = 0; i < RESAMPLE_CACHE_SIZE; ++i){
+        if(plan_refs[i]) continue;
+        if(slot < 0 || !plan_cache[i] || (plan_cache[slot] && plan_used[i] < plan_used[slot])) slot = i;
+    }
+    if(slot >= 0){
+        free_resample_plan(plan_cache[slot]);
+        plan_cache[slot] = p;
+        plan_refs[slot] = 1;
+        plan_used[slot] = ++plan_clock;
+    }
+    pthread_mutex_unlock(&plan_lock);
+    return p;
+}
+
+void release_resample_plan(resample_plan *p)
+{
+    int i;
+    pthread_mutex_lock(&plan_lock);
+    for(i = 0; i < RESAMPLE_CACHE_SIZE; ++i){
+        if(plan_cache[i] == p){
+            --plan_refs[i];
+            pthread_mutex_unlock(&plan_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&plan_lock);
+    // Every slot was busy, the plan was never cached.
+    free_resample_plan(p);
+}
+
+// Resize an image, reusing tables for geometries seen recently.
+// image im: image to resize, any number of channels.
+// int h, w: output size.
+// RESAMPLE mode: interpolation to use.
+// returns: resized image.
+image resize_image(image im, int h, int w, RESAMPLE mode)
+{
+    return resize_image_border(im, h, w, mode, BORDER_CLAMP, 0);
+}
+
+// Resize an image, reading pixels past the edges by a border mode.
+// image im: image to resize, any number of channels.
+// int h, w: output size.
+// RESAMPLE mode: interpolation to use.
+// BORDER border: how source pixels past the edges are read.
+// float value: outside value for BORDER_CONSTANT.
+// returns: resized image.
+image resize_image_border(image im, int h, int w, RESAMPLE mode, BORDER border, float value)
+{
+    resample_plan *p = get_resample_plan(im.h, im.w, h, w, mode, border, value);
+    image out = resample_image(im, p);
+    release_resample_plan(p);
+    return out;
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
 #include "image.h"
 #define TWOPI 6.2831853
@@ -38,50 +39,51 @@ image make_box_filter(int w)
 }
 
 image convolve_image(image im, image filter, int preserve)
+{
+    return convolve_image_border(im, filter, preserve, BORDER_CLAMP, 0);
+}
+
+// Convolve an image with a filter, reading outside pixels by a border mode.
+// image im: image to filter.
+// image filter: 1 channel or one per image channel.
+// int preserve: keep channels separate (1) or sum them into one (0).
+// BORDER border: how pixels outside the image are filled.
+// float value: outside value for BORDER_CONSTANT.
+// returns: filtered image.
+image convolve_image_border(image im, image filter, int preserve, BORDER border, float value)
 {
     assert(im.c == filter.c || (im.c != filter.c && filter.c == 1));
-    image res;
-    if (preserve == 1)
-    {
-        res = make_image(im.c, im.h, im.w);
-        for (int c = 0; c < im.c; c++)
-        for (int i = 0; i < im.h; i++)
-            for (int j = 0; j < im.w; j++)
-            {
-                float sum = 0;
-                for (int x = -filter.h / 2; x <= filter.h / 2; x++)
-                    for (int y = -filter.w/2; y <= filter.w / 2; y++)
-                    {
-                        int filter_c = c;
-                        if (filter.c == 1)
-                            filter_c = 0;
-                        sum += (get_pixel(im, c, i + x, j + y) * get_pixel(filter, filter_c, x + filter.h / 2, y + filter.w / 2));
-                    }
-                set_pixel(res, c, i, j, sum);
-            }
-    }
-    else
-    {
-        res = make_image(1, im.h, im.w);
-        for (int i = 0; i < im.h; i++)
-            for (int j = 0; j < im.w; j++)
-            {
-                float sum = 0;
-                for (int c = 0; c < im.c; c++)
-                {
-                    for (int x = -filter.h / 2; x <= filter.h / 2; x++)
-                        for (int y = -filter.w/2; y <= filter.w / 2; y++)
-                        {
-                            int filter_c = c;
-                            if (filter.c == 1)
-                                filter_c = 0;
-                            sum += (get_pixel(im, c, i + x, j + y) * get_pixel(filter, filter_c, x + filter.h / 2, y + filter.w / 2));
-                        }
+    // Big filters are cheaper through the FFT, same borders and result.
+    if(use_fft_convolution(im, filter)) return convolve_image_fft_border(im, filter, preserve, border, value);
+    // Even sizes span filter.h/2 on both sides and read their last row and
+    // column twice, as they did through a clamped get_pixel.
+    int rh = filter.h/2, rw = filter.w/2;
+    padded_image p = make_padded_image(im, rh, rw, border, value);
+    image res = make_image(preserve ? im.c : 1, im.h, im.w);
+    int y;
+    // Taps are added in the same order as a per pixel loop over channels,
+    // rows and columns, each one across a whole output row.
+    #pragma omp parallel for
+    for(y = 0; y < res.c*im.h; ++y){
+        int c0 = preserve ? y/im.h : 0, c1 = preserve ? c0 + 1 : im.c;
+        int row = y%im.h;
+        float *out = res.data + (size_t)y*im.w;
+        int c, i, j, x;
+        for(c = c0; c < c1; ++c){
+            const float *k = filter.data + (size_t)(filter.c == 1 ? 0 : c)*filter.h*filter.w;
+            for(i = 0; i <= 2*rh; ++i){
+                const float *src = padded_pixel(p, c, row + i - rh, -rw);
+                const float *kr = k + MIN(i, filter.h - 1)*filter.w;
+                for(j = 0; j <= 2*rw; ++j){
+                    const float kv = kr[MIN(j, filter.w - 1)];
+                    const float *s = src + j;
+                    #pragma omp simd
+                    for(x = 0; x < im.w; ++x) out[x] += s[x]*kv;
                 }
-                set_pixel(res, 0, i, j, sum);
-            }    
+            }
+        }
     }
-
+    free_padded_image(p);
     return res;
 }
 
@@ -251,43 +253,195 @@ void feature_normalize(image im)
             }
 }
 
+// Rows per parallel band of the fused Sobel kernel.
+#define SOBEL_BAND 64
+
+// atan2 with a degree 9 odd polynomial for atan on [0,1] (Abramowitz and
+// Stegun 4.4.47), within 1e-5 radians. Branch free so it vectorizes,
+// atan2(0,0) is 0.
+static inline float fast_atan2f(float y, float x)
+{
+    float ax = fabsf(x), ay = fabsf(y);
+    float lo = fminf(ax, ay), hi = fmaxf(ax, ay);
+    float a = hi > 0 ? lo/hi : 0;
+    float s = a*a;
+    float r = ((((0.0208351f*s - 0.0851330f)*s + 0.1801410f)*s - 0.3302995f)*s + 0.9998660f)*a;
+    r = ay > ax ? 1.57079637f - r : r;
+    r = x < 0 ? 3.14159274f - r : r;
+    return y < 0 ? -r : r;
+}
+
+// Affine map applied to Sobel outputs as they are written, out = (v - lo)*scale,
+// clamped to [0,1] if clamp is set.
+typedef struct{
+    float mag_lo, mag_scale;
+    float theta_lo, theta_scale;
+    int clamp;
+} sobel_map;
+
+// Channel sum of clamped row y, padded by one clamped pixel on each side.
+static void sobel_load_row(image im, int y, float *row)
+{
+    int c, x;
+    y = MIN(MAX(y, 0), im.h - 1);
+    for(x = 0; x < im.w; ++x) row[x+1] = 0;
+    for(c = 0; c < im.c; ++c){
+        const float *src = im.data + ((size_t)c*im.h + y)*im.w;
+        for(x = 0; x < im.w; ++x) row[x+1] += src[x];
+    }
+    row[0] = row[1];
+    row[im.w+1] = row[im.w];
+}
+
+// Fused Sobel over rows y0 to y1: a rolling window of three channel summed
+// rows, the 3x3 filters split into [1 2 1] and [-1 0 1] passes, then
+// magnitude and orientation. Same as convolve_image with make_gx_filter and
+// make_gy_filter, preserve = 0. Outputs go through map, mag2 gets a second
+// copy of the magnitude if not 0.
+// float *range: min and max magnitude written, before the map.
+// float *buf: scratch of 5*(im.w + 2) floats.
+static void sobel_band(image im, int y0, int y1, float *mag, float *mag2, float *theta,
+        sobel_map map, float *range, float *buf)
+{
+    int n = im.w + 2;
+    float *a = buf, *b = buf + n, *c = buf + 2*n, *v = buf + 3*n, *d = buf + 4*n;
+    float lo = FLT_MAX, hi = -FLT_MAX;
+    int y, x;
+    sobel_load_row(im, y0 - 1, a);
+    sobel_load_row(im, y0, b);
+    for(y = y0; y < y1; ++y){
+        sobel_load_row(im, y + 1, c);
+        for(x = 0; x < n; ++x){
+            v[x] = a[x] + 2*b[x] + c[x];
+            d[x] = c[x] - a[x];
+        }
+        float *m = mag + (size_t)y*im.w, *t = theta + (size_t)y*im.w;
+        for(x = 0; x < im.w; ++x){
+            float gx = v[x+2] - v[x];
+            float gy = d[x] + 2*d[x+1] + d[x+2];
+            float g = sqrtf(gx*gx + gy*gy);
+            lo = fminf(lo, g);
+            hi = fmaxf(hi, g);
+            float mo = (g - map.mag_lo)*map.mag_scale;
+            float to = (fast_atan2f(gy, gx) - map.theta_lo)*map.theta_scale;
+            if(map.clamp){
+                mo = fminf(fmaxf(mo, 0), 1);
+                to = fminf(fmaxf(to, 0), 1);
+            }
+            m[x] = mo;
+            t[x] = to;
+        }
+        if(mag2) memcpy(mag2 + (size_t)y*im.w, m, im.w*sizeof(float));
+        float *tmp = a; a = b; b = c; c = tmp;
+    }
+    range[0] = lo;
+    range[1] = hi;
+}
+
+// Run sobel_band over the whole image in parallel bands.
+// float *range: filled in with min and max magnitude.
+static void sobel_fused(image im, float *mag, float *mag2, float *theta, sobel_map map, float *range)
+{
+    int bands = (im.h + SOBEL_BAND - 1)/SOBEL_BAND;
+    float *ranges = calloc(2*bands, sizeof(float));
+    int i;
+    #pragma omp parallel
+    {
+        float *buf = malloc(5*(im.w + 2)*sizeof(float));
+        #pragma omp for schedule(dynamic)
+        for(i = 0; i < bands; ++i){
+            int y0 = i*SOBEL_BAND;
+            sobel_band(im, y0, MIN(y0 + SOBEL_BAND, im.h), mag, mag2, theta, map, ranges + 2*i, buf);
+        }
+        free(buf);
+    }
+    range[0] = FLT_MAX;
+    range[1] = -FLT_MAX;
+    for(i = 0; i < bands; ++i){
+        range[0] = MIN(range[0], ranges[2*i]);
+        range[1] = MAX(range[1], ranges[2*i+1]);
+    }
+    free(ranges);
+}
+
+// Gradient magnitude and orientation with the Sobel filters, summed over
+// channels.
+// image im: image to differentiate.
+// returns: array of two images, magnitude and orientation in radians.
 image *sobel_image(image im)
 {
     image* res = calloc(2, sizeof(image));
-
-    image gx = make_gx_filter();
-    image gy = make_gy_filter();
-    image Gx = convolve_image(im, gx, 0);
-    image Gy = convolve_image(im, gy, 0);
     res[0] = make_image(1, im.h, im.w);
     res[1] = make_image(1, im.h, im.w);
-
-    for (int i = 0; i < im.h; i++)
-        for (int j = 0; j < im.w; j++)
-        {
-            float x = get_pixel(Gx, 0, i, j);
-            float y = get_pixel(Gy, 0, i, j);
-            set_pixel(res[0], 0, i, j, sqrt(x * x + y * y));
-            set_pixel(res[1], 0, i, j, atan2(y, x));
-        }
-    
+    sobel_map identity = {0, 1, 0, 1, 0};
+    float range[2];
+    sobel_fused(im, res[0].data, 0, res[1].data, identity, range);
     return res;
 }
 
+// Map values from [lo, hi] to [0,1], all 0 if the range is empty, as
+// feature_normalize.
+static void normalize_range(float *x, int n, float lo, float hi)
+{
+    float scale = hi > lo ? 1/(hi - lo) : 0;
+    int i;
+    #pragma omp parallel for simd
+    for(i = 0; i < n; ++i) x[i] = (x[i] - lo)*scale;
+}
+
+// Sobel orientation as hue and magnitude as saturation and value, each
+// normalized to [0,1] by its min and max.
+// image im: image to differentiate.
+// returns: RGB image.
 image colorize_sobel(image im)
 {
+    int n = im.h*im.w, i;
     image res = make_image(3, im.h, im.w);
-    image* sobel = sobel_image(im);
-    feature_normalize(sobel[0]);
-    feature_normalize(sobel[1]);
-    for (int i = 0; i < im.h; i++)
-        for (int j = 0; j < im.w; j++)
-        {
-            set_pixel(res, 0, i, j, get_pixel(sobel[1], 0, i, j));
-            set_pixel(res, 1, i, j, get_pixel(sobel[0], 0, i, j));
-            set_pixel(res, 2, i, j, get_pixel(sobel[0], 0, i, j));
-        }
+    sobel_map identity = {0, 1, 0, 1, 0};
+    float range[2];
+    sobel_fused(im, res.data + n, res.data + 2*n, res.data, identity, range);
+    float tlo = FLT_MAX, thi = -FLT_MAX;
+    for(i = 0; i < n; ++i){
+        tlo = MIN(tlo, res.data[i]);
+        thi = MAX(thi, res.data[i]);
+    }
+    normalize_range(res.data, n, tlo, thi);
+    normalize_range(res.data + n, 2*n, range[0], range[1]);
     hsv_to_rgb(res);
+    return res;
+}
+
+// Make a context for colorizing Sobel over a stream of frames.
+// returns: context to pass each frame to colorize_sobel_next.
+sobel_context make_sobel_context()
+{
+    sobel_context s = {0};
+    return s;
+}
 
+// Colorize Sobel for the next frame of a stream in one pass over the frame.
+// Magnitude is normalized with the range of the previous frame, orientation
+// with the full [-pi, pi], and both are clamped to [0,1].
+// sobel_context *s: context, updated with this frame's magnitude range.
+// image frame: next frame.
+// returns: RGB image, as colorize_sobel once the range is known. The first
+//          frame is normalized by its own range.
+image colorize_sobel_next(sobel_context *s, image frame)
+{
+    int n = frame.h*frame.w;
+    image res = make_image(3, frame.h, frame.w);
+    float range[2];
+    if(!s->frames){
+        sobel_map identity = {0, 1, -M_PI, 1/(2*M_PI), 0};
+        sobel_fused(frame, res.data + n, res.data + 2*n, res.data, identity, range);
+        normalize_range(res.data + n, 2*n, range[0], range[1]);
+    } else {
+        sobel_map map = {s->lo, s->hi > s->lo ? 1/(s->hi - s->lo) : 0, -M_PI, 1/(2*M_PI), 1};
+        sobel_fused(frame, res.data + n, res.data + 2*n, res.data, map, range);
+    }
+    hsv_to_rgb(res);
+    s->lo = range[0];
+    s->hi = range[1];
+    ++s->frames;
     return res;
 }
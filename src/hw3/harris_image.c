@@ -2,8 +2,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
 #include "image.h"
+#include "instrument.h"
 #include "matrix.h"
 #include <time.h>
 
@@ -15,6 +17,7 @@ void free_descriptors(descriptor *d, int n)
     int i;
     for(i = 0; i < n; ++i){
         free(d[i].data);
+        free(d[i].bits);
     }
     free(d);
 }
@@ -31,6 +34,7 @@ descriptor describe_index(image im, int i)
     d.p.y = i/im.w;
     d.data = calloc(w*w*im.c, sizeof(float));
     d.n = w*w*im.c;
+    d.bits = 0;
     int c, dx, dy;
     int count = 0;
     // If you want you can experiment with other descriptors
@@ -85,27 +89,157 @@ image make_1d_gaussian(float sigma)
 {
     int w = ((int)(6*sigma))|1;
     image f = make_image(1, 1, w);
-    // TODO: optional, make separable 1d Gaussian.
+    int i;
+    for(i = 0; i < w; ++i){
+        int x = i - w/2;
+        f.data[i] = exp(-(x*x)/(2*sigma*sigma));
+    }
+    // The outer product of this with itself is make_gaussian_filter(sigma).
+    l1_normalize(f);
+    return f;
+}
+
+// Young-van Vliet recursive Gaussian: a causal and an anticausal third
+// order recursion whose cascade approximates a Gaussian of any sigma with
+// the same seven multiply-adds per sample. Borders are clamped, the forward
+// pass starts from the steady state of the first sample and the backward
+// pass from the exact Triggs-Sdika initial values for the last one.
+typedef struct{
+    double B, a1, a2, a3;
+    double M[9];            // Backward initial values from forward residuals
+} yvv_filter;
 
+// Columns per vertical strip, each strip keeps its own line buffer.
+#define YVV_STRIP 64
+
+static yvv_filter make_yvv_filter(float sigma)
+{
+    yvv_filter f;
+    double q = sigma >= 2.5 ? 0.98711*sigma - 0.96330 : 3.97156 - 4.14554*sqrt(1 - 0.26891*sigma);
+    double b0 = 1.57825 + 2.44413*q + 1.4281*q*q + 0.422205*q*q*q;
+    f.a1 = (2.44413*q + 2.85619*q*q + 1.26661*q*q*q)/b0;
+    f.a2 = -(1.4281*q*q + 1.26661*q*q*q)/b0;
+    f.a3 = 0.422205*q*q*q/b0;
+    f.B = 1 - (f.a1 + f.a2 + f.a3);
+
+    double a1 = f.a1, a2 = f.a2, a3 = f.a3;
+    double s = f.B/((1 + a1 - a2 + a3)*(1 - a1 - a2 - a3)*(1 + a2 + (a1 - a3)*a3));
+    f.M[0] = s*(-a3*a1 + 1 - a3*a3 - a2);
+    f.M[1] = s*(a3 + a1)*(a2 + a3*a1);
+    f.M[2] = s*a3*(a1 + a3*a2);
+    f.M[3] = s*(a1 + a3*a2);
+    f.M[4] = -s*(a2 - 1)*(a2 + a3*a1);
+    f.M[5] = -s*a3*(a3*a1 + a3*a3 + a2 - 1);
+    f.M[6] = s*(a3*a1 + a2 + a1*a1 - a2*a2);
+    f.M[7] = s*(a1*a2 + a3*a2*a2 - a1*a3*a3 - a3*a3*a3 - a3*a2 + a3);
+    f.M[8] = s*a3*(a1 + a3*a2);
     return f;
 }
 
+// Filter one row in place. w: scratch of n + 6 values.
+static void yvv_row(const yvv_filter *f, float *x, int n, double *w)
+{
+    double *v = w + 3;
+    int i;
+    v[-1] = v[-2] = v[-3] = x[0];
+    for(i = 0; i < n; ++i) v[i] = f->B*x[i] + f->a1*v[i-1] + f->a2*v[i-2] + f->a3*v[i-3];
+    double u = x[n-1];
+    double d0 = v[n-1] - u, d1 = v[n-2] - u, d2 = v[n-3] - u;
+    v[n-1] = f->M[0]*d0 + f->M[1]*d1 + f->M[2]*d2 + u;
+    v[n]   = f->M[3]*d0 + f->M[4]*d1 + f->M[5]*d2 + u;
+    v[n+1] = f->M[6]*d0 + f->M[7]*d1 + f->M[8]*d2 + u;
+    x[n-1] = v[n-1];
+    for(i = n-2; i >= 0; --i){
+        v[i] = f->B*v[i] + f->a1*v[i+1] + f->a2*v[i+2] + f->a3*v[i+3];
+        x[i] = v[i];
+    }
+}
+
+// Filter columns x0 to x0 + cols of an h x w plane in place, one row of the
+// strip at a time so the inner loops run across columns. w: scratch of
+// (h + 6)*cols values.
+static void yvv_columns(const yvv_filter *f, float *x, int h, int stride, int cols, double *w)
+{
+    double *v = w + 3*cols;
+    int i, j;
+    for(j = 0; j < cols; ++j) v[j - cols] = v[j - 2*cols] = v[j - 3*cols] = x[j];
+    for(i = 0; i < h; ++i){
+        const float *xi = x + (size_t)i*stride;
+        double *vi = v + (size_t)i*cols;
+        for(j = 0; j < cols; ++j) vi[j] = f->B*xi[j] + f->a1*vi[j - cols] + f->a2*vi[j - 2*cols] + f->a3*vi[j - 3*cols];
+    }
+    const float *last = x + (size_t)(h-1)*stride;
+    double *vn = v + (size_t)(h-1)*cols;
+    for(j = 0; j < cols; ++j){
+        double u = last[j];
+        double d0 = vn[j] - u, d1 = vn[j - cols] - u, d2 = vn[j - 2*cols] - u;
+        vn[j]          = f->M[0]*d0 + f->M[1]*d1 + f->M[2]*d2 + u;
+        vn[j + cols]   = f->M[3]*d0 + f->M[4]*d1 + f->M[5]*d2 + u;
+        vn[j + 2*cols] = f->M[6]*d0 + f->M[7]*d1 + f->M[8]*d2 + u;
+    }
+    for(i = h-2; i >= 0; --i){
+        double *vi = v + (size_t)i*cols;
+        for(j = 0; j < cols; ++j) vi[j] = f->B*vi[j] + f->a1*vi[j + cols] + f->a2*vi[j + 2*cols] + f->a3*vi[j + 3*cols];
+    }
+    for(i = 0; i < h; ++i){
+        float *xi = x + (size_t)i*stride;
+        const double *vi = v + (size_t)i*cols;
+        for(j = 0; j < cols; ++j) xi[j] = vi[j];
+    }
+}
+
+// Smooths an image with a recursive approximation of a Gaussian, the cost
+// per pixel doesn't depend on sigma.
+// image im: image to smooth.
+// float sigma: std dev. for Gaussian, at least .5.
+// returns: smoothed image.
+image recursive_gaussian(image im, float sigma)
+{
+    PROFILE_SCOPE("recursive_gaussian");
+    assert(sigma >= .5);
+    yvv_filter f = make_yvv_filter(sigma);
+    image out = copy_image(im);
+    int strips = (im.w + YVV_STRIP - 1)/YVV_STRIP;
+    int i;
+    #pragma omp parallel
+    {
+        double *w = malloc((MAX(im.w, im.h*YVV_STRIP) + 6*YVV_STRIP)*sizeof(double));
+        #pragma omp for
+        for(i = 0; i < im.c*im.h; ++i) yvv_row(&f, out.data + (size_t)i*im.w, im.w, w);
+        #pragma omp for
+        for(i = 0; i < im.c*strips; ++i){
+            int c = i/strips, x0 = i%strips*YVV_STRIP;
+            float *x = out.data + (size_t)c*im.h*im.w + x0;
+            yvv_columns(&f, x, im.h, im.w, MIN(YVV_STRIP, im.w - x0), w);
+        }
+        free(w);
+    }
+    return out;
+}
+
 // Smooths an image using separable Gaussian filter.
 // image im: image to smooth.
 // float sigma: std dev. for Gaussian.
 // returns: smoothed image.
 image smooth_image(image im, float sigma)
 {
-    if(1){
-        image g = make_gaussian_filter(sigma);
-        image s = convolve_image(im, g, 1);
-        free_image(g);
-        return s;
-    } else {
-        // TODO: optional, use two convolutions with 1d gaussian filter.
-        // If you implement, disable the above if check.
-        return copy_image(im);
-    }
+    return smooth_image_mode(im, sigma, SMOOTH_DIRECT);
+}
+
+// Smooths an image with a Gaussian.
+// image im: image to smooth.
+// float sigma: std dev. for Gaussian.
+// SMOOTH_MODE mode: SMOOTH_DIRECT filters with make_gaussian_filter,
+//                   SMOOTH_RECURSIVE with recursive_gaussian when sigma >= .5.
+// returns: smoothed image.
+image smooth_image_mode(image im, float sigma, SMOOTH_MODE mode)
+{
+    PROFILE_SCOPE("smooth_image");
+    if(mode == SMOOTH_RECURSIVE && sigma >= .5) return recursive_gaussian(im, sigma);
+    image g = make_gaussian_filter(sigma);
+    image s = convolve_image(im, g, 1);
+    free_image(g);
+    return s;
 }
 
 // Calculate the structure matrix of an image.
@@ -115,6 +249,17 @@ image smooth_image(image im, float sigma)
 //          third channel is IxIy.
 image structure_matrix(image im, float sigma)
 {
+    return structure_matrix_mode(im, sigma, SMOOTH_DIRECT);
+}
+
+// Calculate the structure matrix of an image.
+// image im: the input image.
+// float sigma: std dev. to use for weighted sum.
+// SMOOTH_MODE mode: how to smooth, as smooth_image_mode.
+// returns: structure matrix as structure_matrix.
+image structure_matrix_mode(image im, float sigma, SMOOTH_MODE mode)
+{
+    PROFILE_SCOPE("structure_matrix");
     image Gx = make_gx_filter();
     image Gy = make_gy_filter();
 
@@ -130,9 +275,15 @@ image structure_matrix(image im, float sigma)
             set_pixel(Iy, 0, i, j, get_pixel(Iy, 0, i, j) * get_pixel(Iy, 0, i, j));
         }
     
-    IxIy = smooth_image(IxIy, sigma);
-    Ix = smooth_image(Ix, sigma);
-    Iy = smooth_image(Iy, sigma);
+    image sIxIy = smooth_image_mode(IxIy, sigma, mode);
+    image sIx = smooth_image_mode(Ix, sigma, mode);
+    image sIy = smooth_image_mode(Iy, sigma, mode);
+    free_image(IxIy);
+    free_image(Ix);
+    free_image(Iy);
+    IxIy = sIxIy;
+    Ix = sIx;
+    Iy = sIy;
 
     image S = make_image(3, im.h, im.w);
     for (int i = 0; i < im.h; i++)
@@ -147,6 +298,7 @@ image structure_matrix(image im, float sigma)
     free_image(Gy);
     free_image(Ix);
     free_image(Iy);
+    free_image(IxIy);
 
     return S;
 }
@@ -156,6 +308,7 @@ image structure_matrix(image im, float sigma)
 // returns: a response map of cornerness calculations.
 image cornerness_response(image S)
 {
+    PROFILE_SCOPE("cornerness_response");
     image R = make_image(1, S.h, S.w);
     // TODO: fill in R, "cornerness" for each pixel using the structure matrix.
     // We'll use formulation det(S) - alpha * trace(S)^2, alpha = .06.
@@ -170,36 +323,282 @@ image cornerness_response(image S)
     return R;
 }
 
+#define NMS_STRIP 256
+
+// Running max of windows of 2w+1 values, truncated at both ends, over n
+// vectors of len floats spaced stride apart (van Herk/Gil-Werman). The
+// sequence is cut into blocks of 2w+1, g holds maxima from the start of each
+// block and h maxima to its end, so every window is max(h[i], g[i+2w]):
+// three comparisons per value whatever w is.
+// const float *in: first vector of the input.
+// float *out: first vector of the output, same stride as in, may alias it.
+// float *g, float *h: scratch of (n + 2w)*len floats each.
+static void running_max(const float *in, float *out, int n, int len, int stride, int w, float *g, float *h)
+{
+    int k = 2*w + 1;
+    int m = n + 2*w;
+    int i, x;
+    for(i = 0; i < m; ++i){
+        const float *v = (i >= w && i < n + w) ? in + (size_t)(i - w)*stride : 0;
+        float *gi = g + (size_t)i*len;
+        if(i % k == 0){
+            for(x = 0; x < len; ++x) gi[x] = v ? v[x] : -FLT_MAX;
+        } else if(v){
+            for(x = 0; x < len; ++x) gi[x] = MAX(gi[x - len], v[x]);
+        } else {
+            memcpy(gi, gi - len, len*sizeof(float));
+        }
+    }
+    for(i = m - 1; i >= 0; --i){
+        const float *v = (i >= w && i < n + w) ? in + (size_t)(i - w)*stride : 0;
+        float *hi = h + (size_t)i*len;
+        if(i % k == k - 1 || i == m - 1){
+            for(x = 0; x < len; ++x) hi[x] = v ? v[x] : -FLT_MAX;
+        } else if(v){
+            for(x = 0; x < len; ++x) hi[x] = MAX(hi[x + len], v[x]);
+        } else {
+            memcpy(hi, hi + len, len*sizeof(float));
+        }
+    }
+    for(i = 0; i < n; ++i){
+        float *o = out + (size_t)i*stride;
+        const float *hi = h + (size_t)i*len;
+        const float *gi = g + (size_t)(i + 2*w)*len;
+        for(x = 0; x < len; ++x) o[x] = MAX(hi[x], gi[x]);
+    }
+}
+
+// Max over the (2w+1)x(2w+1) window around every pixel, truncated at the
+// borders, which is the neighborhood a clamped get_pixel scan sees.
+// image im: image to filter.
+// int w: distance to look for larger values.
+// returns: image of window maxima.
+static image window_max(image im, int w)
+{
+    image m = make_image(im.c, im.h, im.w);
+    int c, x0, i;
+    // Columns, a strip of whole rows at a time so the inner loops vectorize.
+    #pragma omp parallel for collapse(2) schedule(dynamic)
+    for(c = 0; c < im.c; ++c){
+        for(x0 = 0; x0 < im.w; x0 += NMS_STRIP){
+            int len = MIN(NMS_STRIP, im.w - x0);
+            size_t scratch = (size_t)(im.h + 2*w)*len;
+            float *g = malloc(scratch*sizeof(float));
+            float *h = malloc(scratch*sizeof(float));
+            size_t off = (size_t)c*im.h*im.w + x0;
+            running_max(im.data + off, m.data + off, im.h, len, im.w, w, g, h);
+            free(g);
+            free(h);
+        }
+    }
+    // Then rows, in place.
+    #pragma omp parallel
+    {
+        float *g = malloc((im.w + 2*w)*sizeof(float));
+        float *h = malloc((im.w + 2*w)*sizeof(float));
+        #pragma omp for
+        for(i = 0; i < im.c*im.h; ++i){
+            float *row = m.data + (size_t)i*im.w;
+            running_max(row, row, im.w, 1, 1, w, g, h);
+        }
+        free(g);
+        free(h);
+    }
+    return m;
+}
+
+#define HARRIS_BAND 128
+
+typedef struct{
+    int w, r;               // Image width, Gaussian radius
+    const float *g;         // 1d Gaussian, 2r+1 taps
+    float *s, *d;           // Vertical Sobel sums and differences, w+2
+    float *p;               // Products of one row with clamped ends, 3 x (w+2r)
+    float *ring;            // 2r+1 rows of 3 x w horizontally smoothed products
+    float *sum;             // 3 x w vertically smoothed products of the output row
+} harris_rows;
+
+// Gradients, their products and horizontal smoothing for one row, written
+// into its slot of the ring. Borders clamp like get_pixel.
+static void harris_row(harris_rows *b, image im, int y)
+{
+    int w = b->w, r = b->r;
+    int y0 = MAX(y - 1, 0), y2 = MIN(y + 1, im.h - 1);
+    int c, x, k;
+    float *s = b->s + 1, *d = b->d + 1;
+    memset(b->s, 0, (w + 2)*sizeof(float));
+    memset(b->d, 0, (w + 2)*sizeof(float));
+    for(c = 0; c < im.c; ++c){
+        const float *a = im.data + ((size_t)c*im.h + y0)*w;
+        const float *m = im.data + ((size_t)c*im.h + y)*w;
+        const float *z = im.data + ((size_t)c*im.h + y2)*w;
+        for(x = 0; x < w; ++x){
+            s[x] += a[x] + 2*m[x] + z[x];
+            d[x] += z[x] - a[x];
+        }
+    }
+    s[-1] = s[0]; s[w] = s[w-1];
+    d[-1] = d[0]; d[w] = d[w-1];
+
+    float *pxx = b->p + r, *pyy = pxx + w + 2*r, *pxy = pyy + w + 2*r;
+    for(x = 0; x < w; ++x){
+        float ix = s[x+1] - s[x-1];
+        float iy = d[x-1] + 2*d[x] + d[x+1];
+        pxx[x] = ix*ix;
+        pyy[x] = iy*iy;
+        pxy[x] = ix*iy;
+    }
+    float *rows[] = {pxx, pyy, pxy};
+    float *out = b->ring + (size_t)(y % (2*r + 1))*3*w;
+    for(c = 0; c < 3; ++c){
+        float *p = rows[c];
+        for(k = 1; k <= r; ++k){
+            p[-k] = p[0];
+            p[w-1+k] = p[w-1];
+        }
+        float *o = out + c*w;
+        for(x = 0; x < w; ++x) o[x] = 0;
+        for(k = -r; k <= r; ++k){
+            float g = b->g[k + r];
+            const float *pk = p + k;
+            for(x = 0; x < w; ++x) o[x] += g*pk[x];
+        }
+    }
+}
+
+// Compute the Harris response of an image in one streaming pass. Rows of
+// gradient products are smoothed horizontally into a ring of 2r+1 rows, and
+// each output row is a vertical Gaussian over the ring followed by
+// det - alpha * trace^2, so only O(r) rows are ever live. Matches
+// cornerness_response(structure_matrix(im, sigma)) up to rounding.
+// image im: the input image.
+// float sigma: std dev. of the window used to sum the structure matrix.
+// returns: 1-channel response map.
+image harris_response(image im, float sigma)
+{
+    PROFILE_SCOPE("harris_response");
+    image g1 = make_1d_gaussian(sigma);
+    int r = g1.w/2;
+    int w = im.w;
+    image R = make_image(1, im.h, im.w);
+    int band;
+    #pragma omp parallel for schedule(dynamic)
+    for(band = 0; band < im.h; band += HARRIS_BAND){
+        harris_rows b = {w, r, g1.data};
+        b.s = malloc((w + 2)*sizeof(float));
+        b.d = malloc((w + 2)*sizeof(float));
+        b.p = malloc(3*(w + 2*r)*sizeof(float));
+        b.ring = malloc((size_t)(2*r + 1)*3*w*sizeof(float));
+        b.sum = malloc(3*w*sizeof(float));
+        int end = MIN(band + HARRIS_BAND, im.h);
+        int next = MAX(band - r, 0);
+        int y, k, x;
+        for(y = band; y < end; ++y){
+            for(; next <= MIN(y + r, im.h - 1); ++next) harris_row(&b, im, next);
+            float *out = R.data + (size_t)y*w;
+            float *sxx = b.sum, *syy = sxx + w, *sxy = syy + w;
+            for(x = 0; x < w; ++x) sxx[x] = syy[x] = sxy[x] = 0;
+            for(k = -r; k <= r; ++k){
+                int row = MIN(MAX(y + k, 0), im.h - 1);
+                const float *src = b.ring + (size_t)(row % (2*r + 1))*3*w;
+                float gk = g1.data[k + r];
+                for(x = 0; x < w; ++x){
+                    sxx[x] += gk*src[x];
+                    syy[x] += gk*src[w + x];
+                    sxy[x] += gk*src[2*w + x];
+                }
+            }
+            for(x = 0; x < w; ++x){
+                float det = sxx[x]*syy[x] - sxy[x]*sxy[x];
+                float trace = sxx[x] + syy[x];
+                out[x] = det - .06*trace*trace;
+            }
+        }
+        free(b.s);
+        free(b.d);
+        free(b.p);
+        free(b.ring);
+        free(b.sum);
+    }
+    free_image(g1);
+    return R;
+}
+
 // Perform non-max supression on an image of feature responses.
 // image im: 1-channel image of feature responses.
 // int w: distance to look for larger responses.
-// returns: image with only local-maxima responses within w pixels.
+// returns: image with only local-maxima responses within w pixels, other
+//          pixels set very low (-999999).
 image nms_image(image im, int w)
 {
-    // TODO: perform NMS on the response map.
-    // for every pixel in the image:
-    //     for neighbors within w:
-    //         if neighbor response greater than pixel response:
-    //             set response to be very low (I use -999999 [why not 0??])
-    image r = make_image(im.c, im.h, im.w);
-    for (int c = 0; c < im.c; c++)
-        for (int i = 0; i < im.h; i++)
-            for (int j = 0; j < im.w; j++)
-            {
-                float curr = get_pixel(im, c, i, j);
-                set_pixel(r, c, i, j, curr);
-                for (int x = -w; x <= w; x++)
-                    for (int y = -w; y <= w; y++)
-                    {
-                        if (get_pixel(im, c, i + x, j + y) > curr)
-                        {
-                            set_pixel(r, c, i, j, -999999);
-                        }
-                    }
-            }
+    return nms_image_border(im, w, BORDER_CLAMP, 0);
+}
+
+// Perform non-max supression with windows that read past the edges by a
+// border mode. Clamped and reflected borders only repeat pixels already in
+// the window, so both give nms_image.
+// image im: 1-channel image of feature responses.
+// int w: distance to look for larger responses.
+// BORDER border: how pixels past the edges are read.
+// float value: outside value for BORDER_CONSTANT.
+// returns: image as nms_image.
+image nms_image_border(image im, int w, BORDER border, float value)
+{
+    PROFILE_SCOPE("nms_image");
+    w = MAX(w, 0);
+    image r;
+    if(border == BORDER_CLAMP || border == BORDER_REFLECT){
+        r = window_max(im, w);
+    } else {
+        padded_image p = make_padded_image(im, w, w, border, value);
+        image m = window_max(p.im, w);
+        r = make_image(im.c, im.h, im.w);
+        int y;
+        for(y = 0; y < im.c*im.h; ++y){
+            size_t off = padded_pixel(p, y/im.h, y%im.h, 0) - p.im.data;
+            memcpy(r.data + (size_t)y*im.w, m.data + off, im.w*sizeof(float));
+        }
+        free_padded_image(p);
+        free_image(m);
+    }
+    int i;
+    #pragma omp parallel for simd
+    for(i = 0; i < im.c*im.h*im.w; ++i){
+        r.data[i] = im.data[i] >= r.data[i] ? im.data[i] : -999999;
+    }
     return r;
 }
 
+// Find local maxima of a response map as a sparse list, without building a
+// suppressed image.
+// image im: 1-channel image of feature responses.
+// int w: distance to look for larger responses.
+// float thresh: only keep maxima with response above this.
+// int *n: pointer to number of maxima, should fill in.
+// returns: indices (y*im.w + x) of the maxima in raster order.
+int *nms_maxima(image im, int w, float thresh, int *n)
+{
+    PROFILE_SCOPE("nms_maxima");
+    assert(im.c == 1);
+    image m = window_max(im, MAX(w, 0));
+    int *idx = 0;
+    int count = 0, size = 0;
+    int i;
+    for(i = 0; i < im.h*im.w; ++i){
+        float r = im.data[i];
+        if(r > thresh && r >= m.data[i]){
+            if(count == size){
+                size = size ? 2*size : 256;
+                idx = realloc(idx, size*sizeof(int));
+            }
+            idx[count++] = i;
+        }
+    }
+    free_image(m);
+    *n = count;
+    return idx;
+}
+
 // Perform harris corner detection and extract features from the corners.
 // image im: input image.
 // float sigma: std. dev for harris.
@@ -209,40 +608,118 @@ image nms_image(image im, int w)
 // returns: array of descriptors of the corners in the image.
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
 {
-    // Calculate structure matrix
-    image S = structure_matrix(im, sigma);
+    PROFILE_SCOPE("harris_corner_detector");
+    // Structure matrix and cornerness in one pass
+    image R = harris_response(im, sigma);
 
-    // Estimate cornerness
-    image R = cornerness_response(S);
+    // Run NMS on the responses, keeping those over threshold
+    int count = 0;
+    int *idx = nms_maxima(R, nms, thresh, &count);
+    *n = count;
+    PROFILE_COUNT("harris_corner_detector", count);
 
-    // Run NMS on the responses
-    image Rnms = nms_image(R, nms);
+    descriptor *d = calloc(count, sizeof(descriptor));
+    int i;
+    for(i = 0; i < count; ++i) d[i] = describe_index(im, idx[i]);
 
+    free(idx);
+    free_image(R);
+    return d;
+}
 
-    //TODO: count number of responses over threshold
-    int count = 0; // change this
-    for (int i = 0; i < Rnms.h; i++)
-        for (int j = 0; j < Rnms.w; j++)
-        {
-            if (get_pixel(Rnms, 0, i, j) > thresh)
-                count++;
+typedef struct{
+    float r;
+    int i;
+} corner;
+
+// Whether a is a weaker corner than b. Ties go to the earlier pixel so the
+// result doesn't depend on the order corners are offered in.
+static int weaker_corner(corner a, corner b)
+{
+    return a.r < b.r || (a.r == b.r && a.i > b.i);
+}
+
+static int stronger_first(const void *a, const void *b)
+{
+    corner x = *(const corner *)a, y = *(const corner *)b;
+    return weaker_corner(x, y) - weaker_corner(y, x);
+}
+
+// Offer a corner to a min-heap that keeps the cap strongest corners seen.
+// corner *h: heap, weakest corner at the root.
+// int *n: number of corners in the heap, updated.
+// int cap: most corners to keep.
+// corner c: corner to offer.
+static void offer_corner(corner *h, int *n, int cap, corner c)
+{
+    int i, j;
+    if(*n < cap){
+        for(i = (*n)++; i && weaker_corner(c, h[(i - 1)/2]); i = (i - 1)/2){
+            h[i] = h[(i - 1)/2];
         }
-    
-    *n = count; // <- set *n equal to number of corners in image.
+        h[i] = c;
+    } else if(cap && weaker_corner(h[0], c)){
+        for(i = 0; (j = 2*i + 1) < cap; i = j){
+            if(j + 1 < cap && weaker_corner(h[j + 1], h[j])) ++j;
+            if(!weaker_corner(h[j], c)) break;
+            h[i] = h[j];
+        }
+        h[i] = c;
+    }
+}
+
+// Perform harris corner detection keeping only the k strongest corners, so
+// the cost of matching downstream is bounded.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int k: most corners to return.
+// int cells: split the image into a cells x cells grid and keep at most
+//            ceil(k/cells^2) corners per cell, spreading corners over the
+//            image. 0 or 1 for no grid.
+// int *n: pointer to number of corners returned, should fill in.
+// returns: array of descriptors of the corners, strongest first.
+descriptor *harris_corner_detector_topk(image im, float sigma, float thresh, int nms, int k, int cells, int *n)
+{
+    PROFILE_SCOPE("harris_corner_detector_topk");
+    *n = 0;
+    if(k <= 0) return 0;
+    if(cells < 1) cells = 1;
+    image R = harris_response(im, sigma);
+    int nmax = 0;
+    int *idx = nms_maxima(R, nms, thresh, &nmax);
+
+    int ncells = cells*cells;
+    int quota = (k + ncells - 1)/ncells;
+    corner *heaps = calloc((size_t)ncells*quota, sizeof(corner));
+    int *sizes = calloc(ncells, sizeof(int));
+    int i, j;
+    for(i = 0; i < nmax; ++i){
+        int y = idx[i]/R.w, x = idx[i]%R.w;
+        int cell = y*cells/R.h*cells + x*cells/R.w;
+        corner c = {R.data[idx[i]], idx[i]};
+        offer_corner(heaps + cell*quota, sizes + cell, quota, c);
+    }
+
+    // Cell quotas can add up to a little more than k.
+    corner *best = calloc(k, sizeof(corner));
+    int count = 0;
+    for(i = 0; i < ncells; ++i){
+        for(j = 0; j < sizes[i]; ++j) offer_corner(best, &count, k, heaps[i*quota + j]);
+    }
+    qsort(best, count, sizeof(corner), stronger_first);
 
     descriptor *d = calloc(count, sizeof(descriptor));
-    //TODO: fill in array *d with descriptors of corners, use describe_index.
-    int c = 0;
-    for (int i = 0; i < Rnms.h; i++)
-        for (int j = 0; j < Rnms.w; j++)
-        {
-            if (get_pixel(Rnms, 0, i, j) > thresh)
-                d[c++] = describe_index(im, i * im.w + j);
-        }
+    for(i = 0; i < count; ++i) d[i] = describe_index(im, best[i].i);
+    *n = count;
+    PROFILE_COUNT("harris_corner_detector_topk", count);
 
-    free_image(S);
+    free(idx);
+    free(heaps);
+    free(sizes);
+    free(best);
     free_image(R);
-    free_image(Rnms);
     return d;
 }
 
@@ -4,8 +4,12 @@
 #include <math.h>
 #include <assert.h>
 #include "image.h"
+#include "instrument.h"
 #include "matrix.h"
 
+// Most ORB features kept per image.
+#define ORB_FEATURES 1000
+
 // Comparator for matches
 // const void *a, *b: pointers to the matches to compare.
 // returns: result of comparison, 0 if same, 1 if a > b, -1 if a < b.
@@ -125,6 +129,39 @@ float l1_distance(float *a, float *b, int n)
     return sum;
 }
 
+// Counts the bits that differ between two binary descriptors.
+// const unsigned long long *a, *b: descriptors to compare.
+// int n: number of bits in each descriptor, a multiple of 64.
+// returns: hamming distance between the descriptors.
+int hamming_distance(const unsigned long long *a, const unsigned long long *b, int n)
+{
+    int i;
+    int sum = 0;
+    for(i = 0; i < n/64; ++i) sum += __builtin_popcountll(a[i] ^ b[i]);
+    return sum;
+}
+
+// Makes matches one-to-one: sorts them by distance and drops every match to
+// a descriptor in b that a closer match already uses.
+// match *m: matches to filter, good ones are moved to the front.
+// int n: number of matches.
+// int bn: number of descriptors in b.
+// returns: number of matches kept.
+static int dedupe_matches(match *m, int n, int bn)
+{
+    int i;
+    int count = 0;
+    int *seen = calloc(bn, sizeof(int));
+    qsort(m, n, sizeof(match), match_compare);
+    for(i = 0; i < n; ++i){
+        if(seen[m[i].bi]) continue;
+        seen[m[i].bi] = 1;
+        m[count++] = m[i];
+    }
+    free(seen);
+    return count;
+}
+
 // Finds best matches between descriptors of two images.
 // descriptor *a, *b: array of descriptors for pixels in two images.
 // int an, bn: number of descriptors in arrays a and b.
@@ -133,17 +170,22 @@ float l1_distance(float *a, float *b, int n)
 //          one other descriptor in b.
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
 {
+    PROFILE_SCOPE("match_descriptors");
     // We will have at most an matches.
-    *mn = an;
+    *mn = 0;
     match *m = calloc(an, sizeof(match));
+    if(!bn) return m;
+    int binary = an && a[0].bits;
+    #pragma omp parallel for if(an*bn > 4096)
     for(int j = 0; j < an; ++j){
-        // TODO: for every descriptor in a, find best match in b.
-        // record ai as the index in *a and bi as the index in *b.
-        int bind = 0; // <- find the best match
+        // For every descriptor in a, find best match in b, by hamming
+        // distance for binary descriptors and L1 distance otherwise.
+        int bind = 0;
         float distance = INFINITY;
         for (int l = 0; l < bn; l++)
         {
-            float curr_distance = l1_distance(a[j].data, b[l].data, b[l].n);
+            float curr_distance = binary ? hamming_distance(a[j].bits, b[l].bits, b[l].n)
+                                         : l1_distance(a[j].data, b[l].data, b[l].n);
             if (curr_distance < distance)
             {
                 bind = l;
@@ -152,41 +194,15 @@ match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
         }
 
         m[j].ai = j;
-        m[j].bi = bind; // <- should be index in b.
+        m[j].bi = bind;
         m[j].p = a[j].p;
         m[j].q = b[bind].p;
-        m[j].distance = distance; // <- should be the smallest L1 distance!
-    }
-
-    int count = 0;
-    int *seen = calloc(bn, sizeof(int));
-    // TODO: we want matches to be injective (one-to-one).
-    // Sort matches based on distance using match_compare and qsort.
-    // Then throw out matches to the same element in b. Use seen to keep track.
-    // Each point should only be a part of one match.
-    // Some points will not be in a match.
-    // In practice just bring good matches to front of list, set *mn.
-    qsort(m, an, sizeof(match), match_compare);
-    for (int i = 0; i < an; i++)
-    {
-        if (seen[m[i].bi] != 0)
-        {
-            for (int j = i + 1; j < an; j++)
-            {
-                m[j - 1] = m[j];
-            }
-            i--;
-            an--;
-        }
-        else
-        {
-            seen[m[i].bi] = 1;
-            count++;
-        }
+        m[j].distance = distance;
     }
 
+    int count = dedupe_matches(m, an, bn);
     *mn = count;
-    free(seen);
+    PROFILE_COUNT("match_descriptors", count);
     return m;
 }
 
@@ -328,6 +344,7 @@ matrix compute_homography(match *matches, int n)
 // returns: matrix representing most common homography between matches.
 matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
 {
+    PROFILE_SCOPE("RANSAC");
     int best = 0;
     matrix Hb = make_translation_homography(256, 0);
     // TODO: fill in RANSAC algorithm.
@@ -344,6 +361,7 @@ matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
     for (int i = 0; i < k; i++)
     {
         randomize_matches(m, n);
+        PROFILE_COUNT("RANSAC", 1);
        
         matrix H = compute_homography(m, 8);
         if (H.cols == 0 && H.rows == 0)
@@ -378,6 +396,7 @@ matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
 // returns: combined image stitched together.
 image combine_images(image a, image b, matrix H)
 {
+    PROFILE_SCOPE("combine_images");
     matrix Hinv = matrix_invert(H);
 
     // Project the corners of image b into image a coordinates.
@@ -447,20 +466,53 @@ image combine_images(image a, image b, matrix H)
 // int cutoff: RANSAC inlier cutoff. Typical: 10-100
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff)
 {
+    return panorama_image_features(a, b, HARRIS, BLEND_NONE, sigma, thresh, nms, inlier_thresh, iters, cutoff);
+}
+
+// Detect corners and describe them.
+// image im: image to find features in.
+// FEATURES mode: HARRIS or ORB.
+// float sigma: gaussian for harris corner detector, unused for ORB.
+// float thresh: cornerness threshold for HARRIS (typical: 1-5), intensity
+//               difference for the FAST test of ORB (typical: .05-.1).
+// int nms: window to perform nms on.
+// int *n: pointer to number of features found, should fill in.
+// returns: array of descriptors.
+descriptor *detect_features(image im, FEATURES mode, float sigma, float thresh, int nms, int *n)
+{
+    if(mode == ORB) return orb_detector(im, thresh, nms, ORB_FEATURES, n);
+    return harris_corner_detector(im, sigma, thresh, nms, n);
+}
+
+// Create a panorama between two images with a choice of features and of
+// how the overlap is blended.
+// FEATURES mode: HARRIS or ORB, ORB is much faster to detect and match.
+// BLEND blend: as combine_images_blend, BLEND_NONE stitches with
+//              combine_images.
+// Other arguments as panorama_image, thresh as detect_features.
+image panorama_image_features(image a, image b, FEATURES mode, BLEND blend, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff)
+{
+    PROFILE_SCOPE("panorama_image");
     srand(10);
     int an = 0;
     int bn = 0;
     int mn = 0;
 
     // Calculate corners and descriptors
-    descriptor *ad = harris_corner_detector(a, sigma, thresh, nms, &an);
-    descriptor *bd = harris_corner_detector(b, sigma, thresh, nms, &bn);
+    descriptor *ad = detect_features(a, mode, sigma, thresh, nms, &an);
+    descriptor *bd = detect_features(b, mode, sigma, thresh, nms, &bn);
 
     // Find matches
     match *m = match_descriptors(ad, an, bd, bn, &mn);
 
-    // Run RANSAC to find the homography
-    matrix H = RANSAC(m, mn, inlier_thresh, iters, cutoff);
+    // Run RANSAC to find the homography, it needs 4 matches to fit one
+    matrix H;
+    if(mn < 4){
+        fprintf(stderr, "Only %d matches, too few for a homography\n", mn);
+        H = make_identity_homography();
+    } else {
+        H = RANSAC(m, mn, inlier_thresh, iters, cutoff);
+    }
 
     if(0){
         // Mark corners and matches between images, turn this off!!
@@ -475,7 +527,8 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
     free(m);
 
     // Stitch the images together with the homography
-    image comb = combine_images(a, b, H);
+    image comb = blend == BLEND_NONE ? combine_images(a, b, H)
+                                     : combine_images_blend(a, b, H, blend, 5);
     return comb;
 }
 
@@ -485,6 +538,14 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
 // returns: image projected onto cylinder, then flattened.
 image cylindrical_project(image im, float f)
 {
-    //TODO: project image onto a cylinder
-    image c = copy_image(im);
+    return project_image(im, f, PROJECT_CYLINDRICAL, 0);
+}
+
+// Project an image onto a sphere.
+// image im: image to project.
+// float f: focal length used to take image (in pixels).
+// returns: image projected onto sphere, then flattened.
+image spherical_project(image im, float f)
+{
+    return project_image(im, f, PROJECT_SPHERICAL, 0);
 }
@@ -4,6 +4,7 @@
 #include <math.h>
 #include <assert.h>
 #include "image.h"
+#include "instrument.h"
 #include "matrix.h"
 
 // Draws a line on an image with color corresponding to the direction of line
@@ -116,6 +117,56 @@ image box_filter_image(image im, int s)
     return S;
 }
 
+// Sobel gradients of a 1-channel image, the same sums in the same order as
+// convolve_image with make_gx_filter and make_gy_filter.
+// image im: grayscale image.
+// image Ix, Iy: filled in with the x and y gradients.
+static void sobel_gradients(image im, image Ix, image Iy)
+{
+    static const float gx[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
+    static const float gy[3][3] = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
+    int i, j, dy, dx;
+    #pragma omp parallel for private(j, dy, dx)
+    for(i = 0; i < im.h; ++i){
+        for(j = 0; j < im.w; ++j){
+            float sx = 0, sy = 0;
+            for(dy = -1; dy <= 1; ++dy){
+                const float *row = im.data + MIN(MAX(i + dy, 0), im.h - 1)*im.w;
+                for(dx = -1; dx <= 1; ++dx){
+                    float v = row[MIN(MAX(j + dx, 0), im.w - 1)];
+                    sx += v*gx[dy+1][dx+1];
+                    sy += v*gy[dy+1][dx+1];
+                }
+            }
+            Ix.data[i*im.w + j] = sx;
+            Iy.data[i*im.w + j] = sy;
+        }
+    }
+}
+
+// Time-structure matrix from grayscale frames and the current frame's
+// gradients, all five channels box filtered together.
+static image structure_from_gradients(image im, image prev, image Ix, image Iy, int s)
+{
+    int n = im.h*im.w;
+    image S = make_image(5, im.h, im.w);
+    float *xx = S.data, *yy = xx + n, *xy = yy + n, *xt = xy + n, *yt = xt + n;
+    int i;
+    #pragma omp parallel for simd
+    for(i = 0; i < n; ++i){
+        float x = Ix.data[i], y = Iy.data[i];
+        float t = im.data[i] - prev.data[i];
+        xx[i] = x*x;
+        yy[i] = y*y;
+        xy[i] = x*y;
+        xt[i] = x*t;
+        yt[i] = y*t;
+    }
+    image B = box_filter_image(S, s);
+    free_image(S);
+    return B;
+}
+
 // Calculate the time-structure matrix of an image pair.
 // image im: the input image.
 // image prev: the previous image in sequence.
@@ -124,59 +175,22 @@ image box_filter_image(image im, int s)
 //          3rd channel is IxIy, 4th channel is IxIt, 5th channel is IyIt.
 image time_structure_matrix(image im, image prev, int s)
 {
-    int i;
+    PROFILE_SCOPE("time_structure_matrix");
     int converted = 0;
     if(im.c == 3){
         converted = 1;
         im = rgb_to_grayscale(im);
         prev = rgb_to_grayscale(prev);
     }
+    assert(im.c == 1 && prev.c == 1 && im.w == prev.w && im.h == prev.h);
 
-    // TODO: calculate gradients, structure components, and smooth them
-    image Gx = make_gx_filter();
-    image Gy = make_gy_filter();
+    image Ix = make_image(1, im.h, im.w);
+    image Iy = make_image(1, im.h, im.w);
+    sobel_gradients(im, Ix, Iy);
+    image S = structure_from_gradients(im, prev, Ix, Iy, s);
 
-    image Ix = convolve_image(im, Gx, 0);
-    image Iy = convolve_image(im, Gy, 0);
-    image IxIy = make_image(1, im.h, im.w);
-    image Ixt = make_image(1, im.h, im.w);
-    image Iyt = make_image(1, im.h, im.w);
-    
-    for (int i = 0; i < im.h; i++)
-        for (int j = 0; j < im.w; j++)
-        {
-            set_pixel(IxIy, 0, i, j, get_pixel(Ix, 0, i, j) * get_pixel(Iy, 0, i, j));
-            set_pixel(Ixt, 0, i, j, get_pixel(Ix, 0, i, j) * (get_pixel(im, 0, i, j) - get_pixel(prev, 0, i, j)));
-            set_pixel(Iyt, 0, i, j, get_pixel(Iy, 0, i, j) * (get_pixel(im, 0, i, j) - get_pixel(prev, 0, i, j)));
-            set_pixel(Ix, 0, i, j, get_pixel(Ix, 0, i, j) * get_pixel(Ix, 0, i, j));
-            set_pixel(Iy, 0, i, j, get_pixel(Iy, 0, i, j) * get_pixel(Iy, 0, i, j));
-        }
-    
-    IxIy = box_filter_image(IxIy, s);
-    Ix = box_filter_image(Ix, s);
-    Iy = box_filter_image(Iy, s);
-    Ixt = box_filter_image(Ixt, s);
-    Iyt = box_filter_image(Iyt, s);
-
-    image S = make_image(5, im.h, im.w);
-    for (int i = 0; i < im.h; i++)
-        for (int j = 0; j < im.w; j++)
-        {
-            set_pixel(S, 0, i, j, get_pixel(Ix, 0, i, j));
-            set_pixel(S, 1, i, j, get_pixel(Iy, 0, i, j));
-            set_pixel(S, 2, i, j, get_pixel(IxIy, 0, i, j));
-            set_pixel(S, 3, i, j, get_pixel(Ixt, 0, i, j));
-            set_pixel(S, 4, i, j, get_pixel(Iyt, 0, i, j));
-        }
-
-    free_image(Gx);
-    free_image(Gy);
     free_image(Ix);
     free_image(Iy);
-    free_image(IxIy);
-    free_image(Ixt);
-    free_image(Iyt);
-
     if(converted){
         free_image(im); free_image(prev);
     }
@@ -188,6 +202,7 @@ image time_structure_matrix(image im, image prev, int s)
 // int stride: 
 image velocity_image(image S, int stride)
 {
+    PROFILE_SCOPE("velocity_image");
     image v = make_image(3, S.h/stride, S.w/stride);
     int i, j;
     matrix M = make_matrix(2,2);
@@ -253,6 +268,16 @@ void constrain_image(image im, float v)
     }
 }
 
+// Velocity from a time-structure matrix, clamped and smoothed for display.
+static image flow_from_structure(image S, int stride, SMOOTH_MODE mode)
+{
+    image v = velocity_image(S, stride);
+    constrain_image(v, 6);
+    image vs = smooth_image_mode(v, 2, mode);
+    free_image(v);
+    return vs;
+}
+
 // Calculate the optical flow between two images
 // image im: current image
 // image prev: previous image
@@ -261,15 +286,74 @@ void constrain_image(image im, float v)
 // returns: velocity matrix
 image optical_flow_images(image im, image prev, int smooth, int stride)
 {
+    return optical_flow_images_mode(im, prev, smooth, stride, SMOOTH_DIRECT);
+}
+
+// Calculate the optical flow between two images
+// image im: current image
+// image prev: previous image
+// int smooth: amount to smooth structure matrix by
+// int stride: downsampling for velocity matrix
+// SMOOTH_MODE mode: how to smooth the velocity, as smooth_image_mode.
+// returns: velocity matrix
+image optical_flow_images_mode(image im, image prev, int smooth, int stride, SMOOTH_MODE mode)
+{
+    PROFILE_SCOPE("optical_flow_images");
     image S = time_structure_matrix(im, prev, smooth);   
-    image v = velocity_image(S, stride);
-    constrain_image(v, 6);
-    image vs = smooth_image(v, 2);
-    free_image(v);
+    image vs = flow_from_structure(S, stride, mode);
     free_image(S);
     return vs;
 }
 
+// Make a context for optical flow over a stream of frames.
+// int smooth: amount to smooth structure matrix by
+// int stride: downsampling for velocity matrix
+// returns: context to pass each frame to optical_flow_next, smoothing
+//          with SMOOTH_DIRECT until mode is changed.
+flow_context make_flow_context(int smooth, int stride)
+{
+    flow_context f = {0};
+    f.smooth = smooth;
+    f.stride = stride;
+    f.mode = SMOOTH_DIRECT;
+    return f;
+}
+
+void free_flow_context(flow_context f)
+{
+    free_image(f.prev);
+}
+
+// Calculate the optical flow from the previous frame to this one. The
+// grayscale frame is kept for the next call, so every frame is converted
+// and differentiated once instead of being converted again as prev.
+// flow_context *f: context, updated with this frame.
+// image frame: next frame, the same size as the others.
+// returns: velocity matrix as optical_flow_images, all zero for the first
+//          frame or after the frame size changes.
+image optical_flow_next(flow_context *f, image frame)
+{
+    PROFILE_SCOPE("optical_flow_images");
+    image gray = frame.c == 3 ? rgb_to_grayscale(frame) : copy_image(frame);
+    assert(gray.c == 1);
+    image v;
+    if(!f->prev.data || f->prev.w != gray.w || f->prev.h != gray.h){
+        v = make_image(3, gray.h/f->stride, gray.w/f->stride);
+    } else {
+        image Ix = make_image(1, gray.h, gray.w);
+        image Iy = make_image(1, gray.h, gray.w);
+        sobel_gradients(gray, Ix, Iy);
+        image S = structure_from_gradients(gray, f->prev, Ix, Iy, f->smooth);
+        v = flow_from_structure(S, f->stride, f->mode);
+        free_image(Ix);
+        free_image(Iy);
+        free_image(S);
+    }
+    free_image(f->prev);
+    f->prev = gray;
+    return v;
+}
+
 // Run optical flow demo on webcam
 // int smooth: amount to smooth structure matrix by
 // int stride: downsampling for velocity matrix
@@ -285,30 +369,25 @@ void optical_flow_webcam(int smooth, int stride, int div)
         fprintf(stderr, "couldn't open\n");
         exit(0);
     }
-    image prev = get_image_from_stream(cap);
-    printf("%d %d\n", prev.w, prev.h);
-    image prev_c = nn_resize(prev, prev.h/div, prev.w/div);
+    flow_context f = make_flow_context(smooth, stride);
     image im = get_image_from_stream(cap);
-    image im_c = nn_resize(im, im.h/div, im.w/div);
+    printf("%d %d\n", im.w, im.h);
     while(im.data){
-        image copy = copy_image(im);
-        image v = optical_flow_images(im_c, prev_c, smooth, stride);
-        draw_flow(copy, v, smooth*div*2);
-        int key = show_image(copy, "flow", 5);
+        image im_c = nn_resize(im, im.h/div, im.w/div);
+        image v = optical_flow_next(&f, im_c);
+        draw_flow(im, v, smooth*div*2);
+        int key = show_image(im, "flow", 5);
         free_image(v);
-        free_image(copy);
-        free_image(prev);
-        free_image(prev_c);
-        prev = im;
-        prev_c = im_c;
+        free_image(im_c);
+        free_image(im);
         if(key != -1) {
             key = key % 256;
             printf("%d\n", key);
             if (key == 27) break;
         }
         im = get_image_from_stream(cap);
-        im_c = nn_resize(im, im.h/div, im.w/div);
     }
+    free_flow_context(f);
 #else
     fprintf(stderr, "Must compile with OpenCV\n");
 #endif
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "matrix.h"
+
+// Model checkpoint layout, all values in native byte order:
+//
+//   checkpoint_header
+//   checkpoint_layer[n]
+//   padding to 64 bytes
+//   weights of layer 0, rows*cols doubles, row-major, 64 byte aligned
+//   weights of layer 1, ...
+//
+// Weights are stored exactly as a layer uses them, so loading maps the file
+// and points the rows of every weight matrix into the mapping.
+
+#define CHECKPOINT_MAGIC "UWMODEL"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_ALIGN 64
+
+typedef struct{
+    char magic[8];
+    int32_t version;
+    int32_t n;
+    int64_t size;           // Total file size in bytes
+} checkpoint_header;
+
+typedef struct{
+    int32_t rows, cols;
+    int32_t activation;
+    int32_t pad;
+    int64_t offset;         // Byte offset of the weights from file start
+} checkpoint_layer;
+
+// Mappings owned by loaded models, so free_model can release them.
+typedef struct mapping{
+    layer *layers;
+    void *base;
+    size_t size;
+    struct mapping *next;
+} mapping;
+
+static mapping *mappings = 0;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t align_offset(int64_t offset)
+{
+    return (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+// Save all layer weights and activations of a model to a single file
+// model m: model to save
+// const char *fname: file to write
+// returns: 1 on success, 0 on failure
+int save_model(model m, const char *fname)
+{
+    FILE *fp = fopen(fname, "wb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return 0;
+    }
+    checkpoint_layer *table = calloc(m.n, sizeof(checkpoint_layer));
+    int64_t offset = align_offset(sizeof(checkpoint_header) + m.n*sizeof(checkpoint_layer));
+    int i, j;
+    for(i = 0; i < m.n; ++i){
+        table[i].rows = m.layers[i].w.rows;
+        table[i].cols = m.layers[i].w.cols;
+        table[i].activation = m.layers[i].activation;
+        table[i].offset = offset;
+        offset = align_offset(offset + (int64_t)table[i].rows*table[i].cols*sizeof(double));
+    }
+
+    checkpoint_header header = {{0}};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.version = CHECKPOINT_VERSION;
+    header.n = m.n;
+    header.size = offset;
+
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok &= fwrite(table, sizeof(checkpoint_layer), m.n, fp) == (size_t)m.n;
+    for(i = 0; i < m.n && ok; ++i){
+        ok &= fseek(fp, table[i].offset, SEEK_SET) == 0;
+        for(j = 0; j < table[i].rows; ++j){
+            ok &= fwrite(m.layers[i].w.data[j], sizeof(double), table[i].cols, fp) == (size_t)table[i].cols;
+        }
+    }
+    // Pad the tail so the recorded size matches the file.
+    if(ok && ftell(fp) < header.size){
+        ok &= fseek(fp, header.size - 1, SEEK_SET) == 0;
+        ok &= fputc(0, fp) != EOF;
+    }
+    ok &= fclose(fp) == 0;
+    free(table);
+    if(!ok) fprintf(stderr, "Failed to write model %s\n", fname);
+    return ok;
+}
+
+// Load a model saved with save_model. The file is memory mapped and the
+// weight matrices point straight into the mapping, so processes loading the
+// same checkpoint share its pages. Writes to the weights are copy-on-write
+// and never reach the file. Only w is loaded, dw and v are empty, so the
+// model is ready for inference.
+// const char *fname: file to read
+// returns: the model, n = 0 if the file couldn't be read
+model load_model(const char *fname)
+{
+    model m = {0};
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return m;
+    }
+    struct stat st;
+    if(fstat(fd, &st) || st.st_size < (off_t)sizeof(checkpoint_header)){
+        fprintf(stderr, "Not a model checkpoint: %s\n", fname);
+        close(fd);
+        return m;
+    }
+    size_t size = st.st_size;
+    char *base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED){
+        fprintf(stderr, "Couldn't map file %s\n", fname);
+        return m;
+    }
+
+    checkpoint_header *header = (checkpoint_header *)base;
+    checkpoint_layer *table = (checkpoint_layer *)(base + sizeof(checkpoint_header));
+    int valid = !memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC))
+        && header->version == CHECKPOINT_VERSION && header->n >= 0
+        && header->size <= (int64_t)size
+        && (int64_t)sizeof(checkpoint_header) + (int64_t)header->n*(int64_t)sizeof(checkpoint_layer) <= (int64_t)size;
+    // Weights start after the table and end inside the file. All in signed
+    // 64-bit, and rows*cols is compared by division so it can't overflow.
+    int64_t first = valid ? align_offset(sizeof(checkpoint_header) + (int64_t)header->n*sizeof(checkpoint_layer)) : 0;
+    int i, j;
+    for(i = 0; valid && i < header->n; ++i){
+        int64_t offset = table[i].offset;
+        int64_t count = (int64_t)table[i].rows*table[i].cols;
+        valid = table[i].rows >= 0 && table[i].cols >= 0
+            && offset >= first && offset % CHECKPOINT_ALIGN == 0
+            && offset <= (int64_t)size
+            && count <= ((int64_t)size - offset)/(int64_t)sizeof(double);
+    }
+    if(!valid){
+        fprintf(stderr, "Not a model checkpoint: %s\n", fname);
+        munmap(base, size);
+        return m;
+    }
+
+    m.n = header->n;
+    m.layers = calloc(m.n, sizeof(layer));
+    for(i = 0; i < m.n; ++i){
+        layer *l = m.layers + i;
+        double *w = (double *)(base + table[i].offset);
+        l->w.rows = table[i].rows;
+        l->w.cols = table[i].cols;
+        l->w.shallow = 1;
+        l->w.data = calloc(l->w.rows, sizeof(double *));
+        for(j = 0; j < l->w.rows; ++j){
+            l->w.data[j] = w + (size_t)j*l->w.cols;
+        }
+        l->out = make_matrix(1,1);
+        l->activation = table[i].activation;
+    }
+
+    mapping *map = calloc(1, sizeof(mapping));
+    map->layers = m.layers;
+    map->base = base;
+    map->size = size;
+    pthread_mutex_lock(&mappings_lock);
+    map->next = mappings;
+    mappings = map;
+    pthread_mutex_unlock(&mappings_lock);
+    return m;
+}
+
+// Free a model along with its layer array. Works for models built with
+// make_layer as well as for models returned by load_model.
+// model m: model to free
+void free_model(model m)
+{
+    int i;
+    // Layer inputs belong to the caller or to the layer before, not freed.
+    for(i = 0; i < m.n; ++i){
+        free_matrix(m.layers[i].out);
+        free_matrix(m.layers[i].w);
+        free_matrix(m.layers[i].dw);
+        free_matrix(m.layers[i].v);
+    }
+
+    pthread_mutex_lock(&mappings_lock);
+    mapping **p = &mappings;
+    while(*p && (*p)->layers != m.layers) p = &(*p)->next;
+    mapping *map = *p;
+    if(map) *p = map->next;
+    pthread_mutex_unlock(&mappings_lock);
+
+    if(map){
+        munmap(map->base, map->size);
+        free(map);
+    }
+    free(m.layers);
+}
@@ -1,6 +1,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include "image.h"
+#include "instrument.h"
 #include "matrix.h"
 
 // Run an activation function on each element in a matrix,
@@ -146,8 +147,7 @@ void update_layer(layer *l, double rate, double momentum, double decay)
 // ACTIVATION activation: the activation function to use
 layer make_layer(int input, int output, ACTIVATION activation)
 {
-    layer l;
-    l.in  = make_matrix(1,1);
+    layer l = {0};          // in is borrowed, forward_layer points it at its input
     l.out = make_matrix(1,1);
     l.w   = random_matrix(input, output, sqrt(2./input));
     l.v   = make_matrix(input, output);
@@ -162,6 +162,7 @@ layer make_layer(int input, int output, ACTIVATION activation)
 // returns: result matrix
 matrix forward_model(model m, matrix X)
 {
+    PROFILE_SCOPE("forward_model");
     int i;
     for(i = 0; i < m.n; ++i){
         X = forward_layer(m.layers + i, X);
@@ -174,6 +175,7 @@ matrix forward_model(model m, matrix X)
 // matrix dL: partial derivative of loss w.r.t. model output dL/dy
 void backward_model(model m, matrix dL)
 {
+    PROFILE_SCOPE("backward_model");
     matrix d = copy_matrix(dL);
     int i;
     for(i = m.n-1; i >= 0; --i){
@@ -191,6 +193,7 @@ void backward_model(model m, matrix dL)
 // double decay: value for weight decay
 void update_model(model m, double rate, double momentum, double decay)
 {
+    PROFILE_SCOPE("update_model");
     int i;
     for(i = 0; i < m.n; ++i){
         update_layer(m.layers + i, rate, momentum, decay);
@@ -216,19 +219,104 @@ int max_index(double *a, int n)
     return max_i;
 }
 
-// Calculate the accuracy of a model on some data d
+// Run a layer for inference only, nothing is saved for backpropagation
+// layer l: the layer to run
+// matrix in: input to layer
+// matrix out: preallocated output, in.rows x l.w.cols, overwritten
+void forward_layer_inference(layer l, matrix in, matrix out)
+{
+    matrix_mult_matrix_into(in, l.w, out);
+    activate_matrix(out, l.activation);
+}
+
+// Evaluate a model on some data d, streaming it through in chunks
 // model m: model to run
 // data d: data to run on
-// returns: accuracy, number correct / total
-double accuracy_model(model m, data d)
+// int batch: number of rows to run at once, bounds memory use
+// returns: accuracy and confusion matrix, confusion.data[truth][predicted]
+evaluation evaluate_model(model m, data d, int batch)
 {
-    matrix p = forward_model(m, d.X);
+    evaluation e;
+    e.confusion = make_matrix(d.y.cols, d.y.cols);
+    e.accuracy = 0;
+    if(m.n <= 0 || d.X.rows <= 0) return e;
+    if(batch <= 0) batch = d.X.rows;
+
     int i;
+    int width = 0;
+    for(i = 0; i < m.n; ++i){
+        if(m.layers[i].w.cols > width) width = m.layers[i].w.cols;
+    }
+    int chunks = (d.X.rows + batch - 1) / batch;
     int correct = 0;
-    for(i = 0; i < d.y.rows; ++i){
-        if(max_index(d.y.data[i], d.y.cols) == max_index(p.data[i], p.cols)) ++correct;
+
+    #pragma omp parallel
+    {
+        // Every thread ping-pongs between two buffers sized for one chunk,
+        // so memory use does not depend on the size of the dataset.
+        matrix buf[2] = {make_matrix(batch, width), make_matrix(batch, width)};
+        matrix confusion = make_matrix(d.y.cols, d.y.cols);
+        int local_correct = 0;
+        int c;
+        #pragma omp for schedule(dynamic)
+        for(c = 0; c < chunks; ++c){
+            int start = c*batch;
+            int n = MIN(batch, d.X.rows - start);
+            matrix in = d.X;
+            in.rows = n;
+            in.data = d.X.data + start;
+            in.shallow = 1;
+            int l;
+            for(l = 0; l < m.n; ++l){
+                matrix out = buf[l&1];
+                out.rows = n;
+                out.cols = m.layers[l].w.cols;
+                forward_layer_inference(m.layers[l], in, out);
+                in = out;
+            }
+            int j;
+            for(j = 0; j < n; ++j){
+                int truth = max_index(d.y.data[start+j], d.y.cols);
+                int guess = max_index(in.data[j], in.cols);
+                if(truth == guess) ++local_correct;
+                if(guess >= 0 && guess < d.y.cols) confusion.data[truth][guess] += 1;
+            }
+        }
+        #pragma omp critical
+        {
+            int j, k;
+            correct += local_correct;
+            for(j = 0; j < confusion.rows; ++j){
+                for(k = 0; k < confusion.cols; ++k){
+                    e.confusion.data[j][k] += confusion.data[j][k];
+                }
+            }
+        }
+        free_matrix(confusion);
+        free_matrix(buf[0]);
+        free_matrix(buf[1]);
     }
-    return (double)correct / d.y.rows;
+    e.accuracy = (double)correct / d.X.rows;
+    return e;
+}
+
+// Free the confusion matrix of an evaluation
+// evaluation e: evaluation to free
+void free_evaluation(evaluation e)
+{
+    free_matrix(e.confusion);
+}
+
+// Calculate the accuracy of a model on some data d
+// model m: model to run
+// data d: data to run on
+// returns: accuracy, number correct / total
+double accuracy_model(model m, data d)
+{
+    evaluation e = evaluate_model(m, d, 256);
+    double accuracy = e.accuracy;
+    free_evaluation(e);
+    return accuracy;
 }
 
 // Calculate the cross-entropy loss for a set of predictions
@@ -258,9 +346,11 @@ double cross_entropy_loss(matrix y, matrix p)
 // double decay: weight decay
 void train_model(model m, data d, int batch, int iters, double rate, double momentum, double decay)
 {
+    PROFILE_SCOPE("train_model");
     int e;
     for(e = 0; e < iters; ++e){
         data b = random_batch(d, batch);
+        PROFILE_COUNT("train_model", 1);
         matrix p = forward_model(m, b.X);
         fprintf(stderr, "%06d: Loss: %f\n", e, cross_entropy_loss(b.y, p));
         matrix dL = axpy_matrix(-1, p, b.y); // partial derivative of loss dL/dy
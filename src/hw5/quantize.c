@@ -0,0 +1,296 @@
+#include <math.h>
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "image.h"
+#include "matrix.h"
+
+#define QUANTIZED_MAGIC "UWQ8"
+#define QUANTIZED_VERSION 1
+
+int max_index(double *a, int n);
+
+// Quantize a layer's weights to int8 with one scale per output column
+// layer l: trained layer
+// returns: quantized copy of the layer, weights stored column-major so
+//          every output is a contiguous dot product
+quantized_layer quantize_layer(layer l)
+{
+    quantized_layer q;
+    q.inputs = l.w.rows;
+    q.outputs = l.w.cols;
+    q.activation = l.activation;
+    q.w = calloc((size_t)q.inputs*q.outputs, sizeof(signed char));
+    q.scale = calloc(q.outputs, sizeof(float));
+    int i, j;
+    for(j = 0; j < q.outputs; ++j){
+        double max = 0;
+        for(i = 0; i < q.inputs; ++i){
+            if(fabs(l.w.data[i][j]) > max) max = fabs(l.w.data[i][j]);
+        }
+        float scale = max > 0 ? max / 127. : 1;
+        signed char *col = q.w + (size_t)j*q.inputs;
+        for(i = 0; i < q.inputs; ++i){
+            col[i] = (signed char) lrint(l.w.data[i][j] / scale);
+        }
+        q.scale[j] = scale;
+    }
+    return q;
+}
+
+// Quantize every layer of a model
+// model m: trained model
+// returns: quantized model, free with free_quantized_model
+quantized_model quantize_model(model m)
+{
+    quantized_model q;
+    q.n = m.n;
+    q.layers = calloc(m.n, sizeof(quantized_layer));
+    int i;
+    for(i = 0; i < m.n; ++i){
+        q.layers[i] = quantize_layer(m.layers[i]);
+    }
+    return q;
+}
+
+void free_quantized_model(quantized_model m)
+{
+    int i;
+    for(i = 0; i < m.n; ++i){
+        free(m.layers[i].w);
+        free(m.layers[i].scale);
+    }
+    free(m.layers);
+}
+
+// Integer dot product of two int8 vectors
+// const signed char *a, *b: vectors
+// int n: length of vectors
+// returns: exact int32 sum of products
+static int dot_int8(const signed char *a, const signed char *b, int n)
+{
+    int k = 0;
+    int sum = 0;
+#ifdef __AVX2__
+    __m256i acc = _mm256_setzero_si256();
+    for(; k + 16 <= n; k += 16){
+        __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + k)));
+        __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + k)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_hadd_epi32(s, s);
+    s = _mm_hadd_epi32(s, s);
+    sum = _mm_cvtsi128_si32(s);
+#endif
+    for(; k < n; ++k){
+        sum += (int)a[k]*b[k];
+    }
+    return sum;
+}
+
+// Quantize a row of activations to int8 with a single scale
+// const float *x: activations
+// int n: number of activations
+// signed char *q: output
+// returns: scale such that x ~= q * scale
+static float quantize_row(const float *x, int n, signed char *q)
+{
+    int i;
+    float max = 0;
+    for(i = 0; i < n; ++i){
+        float v = fabsf(x[i]);
+        if(v > max) max = v;
+    }
+    float scale = max > 0 ? max / 127.f : 1;
+    float inv = 1.f / scale;
+    for(i = 0; i < n; ++i){
+        q[i] = (signed char) lrintf(x[i]*inv);
+    }
+    return scale;
+}
+
+// Run one quantized layer on a single quantized row, then fuse the
+// requantize step with the activation function
+// quantized_layer l: layer to run
+// const signed char *in: quantized input row, l.inputs long
+// float in_scale: scale of the input row
+// float *out: float output row, l.outputs long
+static void forward_quantized_row(quantized_layer l, const signed char *in, float in_scale, float *out)
+{
+    int j;
+    float max = -FLT_MAX;
+    for(j = 0; j < l.outputs; ++j){
+        int acc = dot_int8(in, l.w + (size_t)j*l.inputs, l.inputs);
+        float x = acc * in_scale * l.scale[j];
+        if(l.activation == LOGISTIC){
+            x = 1 / (1 + expf(-x));
+        } else if (l.activation == RELU){
+            x = x > 0 ? x : 0;
+        } else if (l.activation == LRELU){
+            x = x > 0 ? x : .1f*x;
+        } else if (l.activation == SOFTMAX){
+            max = MAX(max, x);
+        }
+        out[j] = x;
+    }
+    if(l.activation == SOFTMAX){
+        // Shifted by the largest logit so expf can't overflow.
+        double sum = 0;
+        for(j = 0; j < l.outputs; ++j){
+            out[j] = expf(out[j] - max);
+            sum += out[j];
+        }
+        for(j = 0; j < l.outputs; ++j) out[j] /= sum;
+    }
+}
+
+// Run a quantized model on input X
+// quantized_model m: model to run
+// matrix X: input to model
+// returns: result matrix
+matrix forward_quantized_model(quantized_model m, matrix X)
+{
+    assert(m.n == 0 || X.cols == m.layers[0].inputs);
+    int i;
+    int width = X.cols;
+    for(i = 0; i < m.n; ++i){
+        if(m.layers[i].outputs > width) width = m.layers[i].outputs;
+    }
+    matrix p = make_matrix(X.rows, m.n ? m.layers[m.n-1].outputs : X.cols);
+
+    #pragma omp parallel
+    {
+        float *f = calloc(width, sizeof(float));
+        signed char *q = calloc(width, sizeof(signed char));
+        int r;
+        #pragma omp for
+        for(r = 0; r < X.rows; ++r){
+            int k, l;
+            for(k = 0; k < X.cols; ++k) f[k] = X.data[r][k];
+            int n = X.cols;
+            for(l = 0; l < m.n; ++l){
+                assert(m.layers[l].inputs == n);
+                float scale = quantize_row(f, n, q);
+                forward_quantized_row(m.layers[l], q, scale, f);
+                n = m.layers[l].outputs;
+            }
+            for(k = 0; k < p.cols; ++k) p.data[r][k] = f[k];
+        }
+        free(f);
+        free(q);
+    }
+    return p;
+}
+
+// Calculate the accuracy of a quantized model on some data d
+// quantized_model m: model to run
+// data d: data to run on
+// returns: accuracy, number correct / total
+double accuracy_quantized_model(quantized_model m, data d)
+{
+    matrix p = forward_quantized_model(m, d.X);
+    int i;
+    int correct = 0;
+    for(i = 0; i < d.y.rows; ++i){
+        if(max_index(d.y.data[i], d.y.cols) == max_index(p.data[i], p.cols)) ++correct;
+    }
+    free_matrix(p);
+    return (double)correct / d.y.rows;
+}
+
+// Save a quantized model.
+// Layout: "UWQ8", int version, int n, then for every layer
+//         int inputs, int outputs, int activation,
+//         float scale[outputs], int8 w[outputs][inputs].
+// quantized_model m: model to save
+// const char *fname: file to write
+void save_quantized_model(quantized_model m, const char *fname)
+{
+    FILE *fp = fopen(fname, "wb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return;
+    }
+    int version = QUANTIZED_VERSION;
+    fwrite(QUANTIZED_MAGIC, 1, 4, fp);
+    fwrite(&version, sizeof(int), 1, fp);
+    fwrite(&m.n, sizeof(int), 1, fp);
+    int i;
+    for(i = 0; i < m.n; ++i){
+        quantized_layer l = m.layers[i];
+        int activation = l.activation;
+        fwrite(&l.inputs, sizeof(int), 1, fp);
+        fwrite(&l.outputs, sizeof(int), 1, fp);
+        fwrite(&activation, sizeof(int), 1, fp);
+        fwrite(l.scale, sizeof(float), l.outputs, fp);
+        fwrite(l.w, sizeof(signed char), (size_t)l.inputs*l.outputs, fp);
+    }
+    fclose(fp);
+}
+
+// Load a quantized model written by save_quantized_model
+// const char *fname: file to read
+// returns: the model, n = 0 if the file couldn't be read, is cut short, or
+//          has layers whose sizes don't chain or don't fit in the file
+quantized_model load_quantized_model(const char *fname)
+{
+    quantized_model m = {0};
+    FILE *fp = fopen(fname, "rb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return m;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    char magic[4];
+    int version = 0;
+    int n = 0;
+    // Every layer takes at least its three int fields.
+    if(fread(magic, 1, 4, fp) != 4 || memcmp(magic, QUANTIZED_MAGIC, 4) ||
+       fread(&version, sizeof(int), 1, fp) != 1 || version != QUANTIZED_VERSION ||
+       fread(&n, sizeof(int), 1, fp) != 1 || n < 0 || n > size/(long)(3*sizeof(int)) ||
+       !(m.layers = calloc(n ? n : 1, sizeof(quantized_layer)))){
+        fprintf(stderr, "Not a quantized model: %s\n", fname);
+        fclose(fp);
+        return m;
+    }
+    int i;
+    for(i = 0; i < n; ++i){
+        quantized_layer *l = m.layers + i;
+        int activation = 0;
+        if(fread(&l->inputs, sizeof(int), 1, fp) != 1 ||
+           fread(&l->outputs, sizeof(int), 1, fp) != 1 ||
+           fread(&activation, sizeof(int), 1, fp) != 1 ||
+           l->inputs < 0 || l->outputs < 0 ||
+           activation < LINEAR || activation > SOFTMAX ||
+           (i > 0 && l->inputs != m.layers[i-1].outputs)) break;
+        // Sizes are checked against what is left of the file before
+        // anything is allocated for them.
+        size_t weights = (size_t)l->inputs*l->outputs;
+        long left = size - ftell(fp);
+        if(left < 0 || (size_t)l->outputs > (size_t)left/sizeof(float) ||
+           weights > (size_t)left - l->outputs*sizeof(float)) break;
+        l->activation = activation;
+        l->scale = calloc(l->outputs ? l->outputs : 1, sizeof(float));
+        l->w = calloc(weights ? weights : 1, sizeof(signed char));
+        m.n = i + 1;
+        if(!l->scale || !l->w ||
+           fread(l->scale, sizeof(float), l->outputs, fp) != (size_t)l->outputs ||
+           fread(l->w, sizeof(signed char), weights, fp) != weights) break;
+    }
+    if(i != n){
+        fprintf(stderr, "Corrupt or truncated quantized model: %s\n", fname);
+        free_quantized_model(m);
+        m.layers = 0;
+        m.n = 0;
+    }
+    fclose(fp);
+    return m;
+}
@@ -27,12 +27,15 @@ typedef struct{
 
 // A descriptor for a point in an image.
 // point p: x,y coordinates of the image pixel.
-// int n: the number of floating point values in the descriptor.
-// float *data: the descriptor for the pixel.
+// int n: the number of floating point values in the descriptor, or of bits
+//        for a binary descriptor.
+// float *data: the descriptor for the pixel, 0 for binary descriptors.
+// unsigned long long *bits: binary descriptor, 0 for float descriptors.
 typedef struct{
     point p;
     int n;
     float *data;
+    unsigned long long *bits;
 } descriptor;
 
 // A match between two points in an image.
@@ -45,6 +48,124 @@ typedef struct{
     float distance;
 } match;
 
+typedef enum{NEAREST, BILINEAR, AREA, LANCZOS3} RESAMPLE;
+
+// How pixels outside an image are filled in.
+// BORDER_CLAMP: nearest edge pixel, like get_pixel.
+// BORDER_REFLECT: mirrored about the edge pixel, dcb|abcd|cba.
+// BORDER_WRAP: the image repeats.
+// BORDER_CONSTANT: a given value.
+typedef enum{BORDER_CLAMP, BORDER_REFLECT, BORDER_WRAP, BORDER_CONSTANT} BORDER;
+
+// An image copied into a buffer with a halo, see make_padded_image.
+// image im: the buffer, (h + 2*pad_h) x (w + 2*pad_w) per channel.
+// int pad_h, pad_w: halo size on each side.
+typedef struct{
+    image im;
+    int pad_h, pad_w;
+} padded_image;
+
+// Corner detector and descriptor used for stitching.
+// HARRIS: harris_corner_detector with float patch descriptors.
+// ORB: FAST corners with oriented binary descriptors.
+typedef enum{HARRIS, ORB} FEATURES;
+
+// How combine_images_blend joins two images where they overlap.
+// BLEND_NONE: b is pasted over a, as combine_images.
+// BLEND_FEATHER: each image weighted by its distance to its own edge.
+// BLEND_MULTIBAND: Laplacian pyramid bands blended with a smoothed seam.
+typedef enum{BLEND_NONE, BLEND_FEATHER, BLEND_MULTIBAND} BLEND;
+
+// Surface project_image unrolls an image onto.
+// PROJECT_CYLINDRICAL: columns are angles around a vertical axis.
+// PROJECT_SPHERICAL: columns and rows are longitude and latitude.
+typedef enum{PROJECT_CYLINDRICAL, PROJECT_SPHERICAL} PROJECTION;
+
+// Inverse warp table, output pixel i blends the 2x2 source block whose top
+// left is offset[i] by fractions fx, fy, or is 0 if offset[i] < 0. Fixed
+// point tables keep the fractions in qx, qy in 1/128 pixel steps instead.
+typedef struct{
+    int h, w;
+    float f;
+    PROJECTION projection;
+    int fixed;
+    int *offset;
+    float *fx, *fy;
+    unsigned char *qx, *qy;
+} remap_plan;
+
+// Magnitude range kept between frames, see colorize_sobel_next.
+// float lo, hi: Sobel magnitude range of the last frame.
+// int frames: frames seen so far.
+typedef struct{
+    float lo, hi;
+    int frames;
+} sobel_context;
+
+// How smooth_image_mode applies a Gaussian.
+// SMOOTH_DIRECT: 2d kernel from make_gaussian_filter, cost grows with sigma.
+// SMOOTH_RECURSIVE: recursive_gaussian, constant cost per pixel.
+typedef enum{SMOOTH_DIRECT, SMOOTH_RECURSIVE} SMOOTH_MODE;
+
+// Per-axis resampling table, output sample i reads
+// index[i*taps + t] weighted by weight[i*taps + t]. With BORDER_CONSTANT,
+// outside[i] is the weight of taps that fell outside the source, 0 otherwise.
+typedef struct{
+    int n, taps;
+    int *index;
+    float *weight;
+    float *outside;
+} resample_axis;
+
+typedef struct{
+    int src_h, src_w, h, w;
+    RESAMPLE mode;
+    BORDER border;
+    float value;
+    resample_axis rows, cols;
+} resample_plan;
+
+// Channel order in memory. PLANAR is CHW like image, INTERLEAVED is HWC
+// like the files stb decodes. ANY_LAYOUT only appears in requests, an
+// operation that accepts either layout or a pipeline that keeps whichever
+// it ends with.
+typedef enum{PLANAR, INTERLEAVED, ANY_LAYOUT} LAYOUT;
+
+// 8-bit image, 0..255 maps to 0..1. Planar like image unless layout says
+// otherwise.
+typedef struct{
+    int c,h,w;
+    unsigned char *data;
+    LAYOUT layout;
+} image_u8;
+
+// Half precision image, raw IEEE 754 binary16 bits. Planar like image.
+typedef struct{
+    int c,h,w;
+    unsigned short *data;
+} image_f16;
+
+typedef enum{TILE_RAW, TILE_DEFLATE} TILE_COMPRESSION;
+
+// Image kept on disk in tile x tile squares, paged in and out through a
+// bounded LRU cache. See tiled_image.c for the file layout.
+typedef struct{
+    int c,h,w;
+    int tile;
+    struct tile_store *store;
+} tiled_image;
+
+// One stage of an 8-bit pipeline. apply may modify im in place and return
+// it, or return a new image, in which case the pipeline frees im.
+typedef struct{
+    const char *name;
+    LAYOUT layout;
+    image_u8 (*apply)(image_u8 im, const float *args);
+    float args[4];
+    int channels;           // Bit c set if apply takes c channels, 0 for any
+    int out_c;              // Channels of the result, 0 for same as input
+} image_op;
+
 // Basic operations
 float get_pixel(image im, int c, int h, int w);
 void set_pixel(image im, int c, int h, int w, float v);
@@ -56,6 +177,7 @@ void hsv_to_rgb(image im);
 void shift_image(image im, int c, float v);
 void scale_image(image im, int c, float v);
 void clamp_image(image im);
+void adjust_hsv(image im, float hue, float saturation, float value);
 image get_channel(image im, int c);
 int same_image(image a, image b, float eps);
 image sub_image(image a, image b);
@@ -71,14 +193,88 @@ image load_image_binary(const char *fname);
 void save_png(image im, const char *name);
 void free_image(image im);
 
+// Borders
+int border_index(int i, int n, BORDER border);
+padded_image make_padded_image(image im, int pad_h, int pad_w, BORDER border, float value);
+float *padded_pixel(padded_image p, int c, int y, int x);
+void free_padded_image(padded_image p);
+
 // Resizing
 float nn_interpolate(image im, int c, float h, float w);
 image nn_resize(image im, int h, int w);
 float bilinear_interpolate(image im, int c, float h, float w);
 image bilinear_resize(image im, int h, int w);
+resample_axis make_resample_axis(int src, int dst, RESAMPLE mode, BORDER border);
+void free_resample_axis(resample_axis a);
+resample_plan *make_resample_plan(int src_h, int src_w, int h, int w, RESAMPLE mode, BORDER border, float value);
+void free_resample_plan(resample_plan *p);
+image resample_image(image im, resample_plan *p);
+image resize_image(image im, int h, int w, RESAMPLE mode);
+image resize_image_border(image im, int h, int w, RESAMPLE mode, BORDER border, float value);
+resample_plan *get_resample_plan(int src_h, int src_w, int h, int w, RESAMPLE mode, BORDER border, float value);
+void release_resample_plan(resample_plan *p);
+
+// Compact images
+image_u8 make_image_u8(int c, int h, int w);
+void free_image_u8(image_u8 im);
+image_f16 make_image_f16(int c, int h, int w);
+void free_image_f16(image_f16 im);
+unsigned short float_to_half(float f);
+float half_to_float(unsigned short h);
+image_u8 image_to_u8(image im);
+image u8_to_image(image_u8 im);
+image_f16 image_to_f16(image im);
+image f16_to_image(image_f16 im);
+image_u8 load_image_u8(char *filename);
+image_u8 load_image_u8_interleaved(char *filename);
+image_u8 try_load_image_u8_interleaved(char *filename);
+image_u8 u8_to_layout(image_u8 im, LAYOUT layout);
+int save_image_u8(image_u8 im, const char *name);
+int save_png_u8(image_u8 im, const char *name);
+image_u8 rgb_to_grayscale_u8(image_u8 im);
+image_f16 rgb_to_grayscale_f16(image_f16 im);
+void adjust_hsv_u8(image_u8 im, float hue, float saturation, float value);
+void adjust_hsv_f16(image_f16 im, float hue, float saturation, float value);
+void rgb_to_hsv_f16(image_f16 im);
+void hsv_to_rgb_f16(image_f16 im);
+image_u8 convolve_image_u8(image_u8 im, image filter, int preserve);
+image_f16 convolve_image_f16(image_f16 im, image filter, int preserve);
+image_u8 resize_image_u8(image_u8 im, int h, int w, RESAMPLE mode);
+image_f16 resize_image_f16(image_f16 im, int h, int w, RESAMPLE mode);
+
+// Tiled images
+tiled_image make_tiled_image(const char *fname, int c, int h, int w, int tile,
+        TILE_COMPRESSION compression, size_t cache_bytes);
+tiled_image open_tiled_image(const char *fname, size_t cache_bytes);
+void flush_tiled_image(tiled_image t);
+void close_tiled_image(tiled_image t);
+image load_tiled_region(tiled_image t, int y, int x, int h, int w);
+void store_tiled_region(tiled_image t, image im, int y, int x);
+tiled_image image_to_tiled(image im, const char *fname, int tile,
+        TILE_COMPRESSION compression, size_t cache_bytes);
+image tiled_to_image(tiled_image t);
+tiled_image convolve_tiled_image(tiled_image t, image filter, int preserve,
+        const char *fname, size_t cache_bytes);
+void warp_tiled_image(tiled_image dst, tiled_image src, matrix H, int dy, int dx);
+tiled_image combine_tiled_images(tiled_image a, tiled_image b, matrix H,
+        const char *fname, size_t cache_bytes);
+
+// Pipelines
+image_op hsv_op(float hue, float saturation, float value);
+image_op grayscale_op();
+image_op resize_op(int h, int w, RESAMPLE mode);
+image_op blur_op(float sigma);
+image_op sobel_op();
+int image_op_accepts(image_op op, int c);
+image_u8 run_pipeline(image_u8 im, const image_op *ops, int n, LAYOUT layout);
+int run_batch(int argc, char **argv);
 
 // Filtering
 image convolve_image(image im, image filter, int preserve);
+image convolve_image_border(image im, image filter, int preserve, BORDER border, float value);
+image convolve_image_fft(image im, image filter, int preserve);
+image convolve_image_fft_border(image im, image filter, int preserve, BORDER border, float value);
+int use_fft_convolution(image im, image filter);
 image make_box_filter(int w);
 image make_highpass_filter();
 image make_sharpen_filter();
@@ -91,31 +287,69 @@ void l1_normalize(image im);
 void threshold_image(image im, float thresh);
 image *sobel_image(image im);
 image colorize_sobel(image im);
+sobel_context make_sobel_context();
+image colorize_sobel_next(sobel_context *s, image frame);
 image smooth_image(image im, float sigma);
+image smooth_image_mode(image im, float sigma, SMOOTH_MODE mode);
+image recursive_gaussian(image im, float sigma);
 
 // Harris and Stitching
 point make_point(float x, float y);
 point project_point(matrix H, point p);
 matrix compute_homography(match *matches, int n);
 image structure_matrix(image im, float sigma);
+image structure_matrix_mode(image im, float sigma, SMOOTH_MODE mode);
 image cornerness_response(image S);
+image harris_response(image im, float sigma);
+image nms_image(image im, int w);
+image nms_image_border(image im, int w, BORDER border, float value);
+int *nms_maxima(image im, int w, float thresh, int *n);
 void free_descriptors(descriptor *d, int n);
 image cylindrical_project(image im, float f);
+image spherical_project(image im, float f);
+image project_image(image im, float f, PROJECTION projection, int fixed);
+remap_plan *make_remap_plan(int h, int w, float f, PROJECTION projection, int fixed);
+void free_remap_plan(remap_plan *p);
+image remap_image(image im, remap_plan *p);
+remap_plan *get_remap_plan(int h, int w, float f, PROJECTION projection, int fixed);
+void release_remap_plan(remap_plan *p);
 void mark_corners(image im, descriptor *d, int n);
 image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms);
 void detect_and_draw_corners(image im, float sigma, float thresh, int nms);
 int model_inliers(matrix H, match *m, int n, float thresh);
+matrix RANSAC(match *m, int n, float thresh, int k, int cutoff);
 image combine_images(image a, image b, matrix H);
+image combine_images_blend(image a, image b, matrix H, BLEND mode, int bands);
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn);
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n);
+descriptor *harris_corner_detector_topk(image im, float sigma, float thresh, int nms, int k, int cells, int *n);
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
+image panorama_image_features(image a, image b, FEATURES mode, BLEND blend, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
+descriptor *detect_features(image im, FEATURES mode, float sigma, float thresh, int nms, int *n);
+descriptor *orb_detector(image im, float thresh, int nms, int k, int *n);
+int hamming_distance(const unsigned long long *a, const unsigned long long *b, int n);
 
 // Optical Flow
+
+// State kept between frames of a stream, see optical_flow_next.
+// int smooth, stride: as optical_flow_images.
+// SMOOTH_MODE mode: how to smooth the flow, as optical_flow_images_mode.
+// image prev: grayscale of the last frame, empty before the first.
+typedef struct{
+    int smooth, stride;
+    SMOOTH_MODE mode;
+    image prev;
+} flow_context;
+
 image make_integral_image(image im);
 image box_filter_image(image im, int s);
 image time_structure_matrix(image im, image prev, int s);
 image velocity_image(image S, int stride);
 image optical_flow_images(image im, image prev, int smooth, int stride);
+image optical_flow_images_mode(image im, image prev, int smooth, int stride, SMOOTH_MODE mode);
+flow_context make_flow_context(int smooth, int stride);
+image optical_flow_next(flow_context *f, image frame);
+void free_flow_context(flow_context f);
 void optical_flow_webcam(int smooth, int stride, int div);
 void draw_flow(image im, image v, float scale);
 
@@ -149,6 +383,23 @@ typedef struct {
     int n;
 } model;
 
+typedef struct {
+    int inputs, outputs;    // Shape of the original weight matrix
+    signed char *w;         // int8 weights, one contiguous column per output
+    float *scale;           // Per-output scale, w = int8 * scale
+    ACTIVATION activation;  // Activation the layer uses
+} quantized_layer;
+
+typedef struct {
+    quantized_layer *layers;
+    int n;
+} quantized_model;
+
+typedef struct {
+    double accuracy;        // Number correct / total
+    matrix confusion;       // Counts indexed [truth][predicted]
+} evaluation;
+
 data load_classification_data(char *images, char *label_file, int bias);
 void free_data(data d);
 data random_batch(data d, int n);
@@ -158,7 +409,23 @@ void gradient_matrix(matrix m, ACTIVATION a, matrix d);
 matrix forward_layer(layer *l, matrix in);
 matrix backward_layer(layer *l, matrix delta);
 void update_layer(layer *l, double rate, double momentum, double decay);
+matrix forward_model(model m, matrix X);
+void forward_layer_inference(layer l, matrix in, matrix out);
+evaluation evaluate_model(model m, data d, int batch);
+void free_evaluation(evaluation e);
+double accuracy_model(model m, data d);
+void train_model(model m, data d, int batch, int iters, double rate, double momentum, double decay);
 layer make_layer(int input, int output, ACTIVATION activation);
+int save_model(model m, const char *fname);
+model load_model(const char *fname);
+void free_model(model m);
+quantized_layer quantize_layer(layer l);
+quantized_model quantize_model(model m);
+void free_quantized_model(quantized_model m);
+matrix forward_quantized_model(quantized_model m, matrix X);
+double accuracy_quantized_model(quantized_model m, data d);
+void save_quantized_model(quantized_model m, const char *fname);
+quantized_model load_quantized_model(const char *fname);
 matrix load_matrix(const char *fname);
 void save_matrix(matrix m, const char *fname);
 
@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "instrument.h"
+
+// Every thread collects into its own profile, so timers never contend.
+// Profiles are linked into a global list on first use and stay there after
+// the thread exits, reports merge them by stage name.
+
+#define MIN_STAGES 64
+#define MAX_DEPTH 64
+#define MAX_EVENTS (1 << 20)
+
+typedef struct{
+    const char *name;
+    long long calls;
+    long long total, min, max;  // Nanoseconds
+    long long count;            // Sum of PROFILE_COUNT
+    long long bytes;            // Bytes allocated while innermost
+} stage_stats;
+
+typedef struct{
+    const char *name;
+    long long start, dur;
+} trace_event;
+
+typedef struct thread_profile{
+    int tid;
+    int n, cap;
+    stage_stats *stages;
+    const char *stack[MAX_DEPTH];
+    int depth;
+    trace_event *events;
+    int n_events, cap_events;
+    long long dropped;
+    struct thread_profile *next;
+} thread_profile;
+
+static __thread thread_profile *local = 0;
+static thread_profile *profiles = 0;
+static int n_profiles = 0;
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int enabled = 0;
+static int want_summary = 0;
+static char *trace_file = 0;
+static long long epoch = 0;
+
+static long long now_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000LL + t.tv_nsec;
+}
+
+static void report_at_exit()
+{
+    if(want_summary) instrument_report(stderr);
+    if(trace_file) instrument_write_trace(trace_file);
+}
+
+static void init()
+{
+    const char *env = getenv("UWIMG_PROFILE");
+    if(!env || !*env) return;
+    char *opts = strdup(env);
+    char *save = 0;
+    char *tok;
+    for(tok = strtok_r(opts, ",", &save); tok; tok = strtok_r(0, ",", &save)){
+        if(0 == strncmp(tok, "trace:", 6)) trace_file = strdup(tok + 6);
+        else want_summary = 1;
+    }
+    free(opts);
+    enabled = 1;
+    epoch = now_ns();
+    atexit(report_at_exit);
+}
+
+int instrument_enabled()
+{
+    pthread_once(&init_once, init);
+    return enabled;
+}
+
+// Turn collection on or off regardless of UWIMG_PROFILE, for tests and
+// tools that read results with instrument_query.
+// int on: 1 to collect, 0 to stop.
+void instrument_set_enabled(int on)
+{
+    pthread_once(&init_once, init);
+    enabled = on;
+}
+
+static thread_profile *get_profile()
+{
+    if(!local){
+        local = calloc(1, sizeof(thread_profile));
+        pthread_mutex_lock(&profiles_lock);
+        local->tid = n_profiles++;
+        local->next = profiles;
+        profiles = local;
+        pthread_mutex_unlock(&profiles_lock);
+    }
+    return local;
+}
+
+static stage_stats *get_stage(thread_profile *p, const char *name)
+{
+    int i;
+    for(i = 0; i < p->n; ++i){
+        if(p->stages[i].name == name || 0 == strcmp(p->stages[i].name, name)) return p->stages + i;
+    }
+    if(p->n == p->cap){
+        // Only this thread touches its table outside of reports, which
+        // must not run alongside instrumented work.
+        int cap = p->cap ? 2*p->cap : MIN_STAGES;
+        p->stages = realloc(p->stages, cap*sizeof(stage_stats));
+        memset(p->stages + p->cap, 0, (cap - p->cap)*sizeof(stage_stats));
+        p->cap = cap;
+    }
+    stage_stats *s = p->stages + p->n++;
+    s->name = name;
+    return s;
+}
+
+// Start timing a stage, use PROFILE_SCOPE rather than calling this.
+instrument_span instrument_begin(const char *name)
+{
+    instrument_span s = {0};
+    if(!instrument_enabled()) return s;
+    thread_profile *p = get_profile();
+    if(p->depth < MAX_DEPTH) p->stack[p->depth] = name;
+    ++p->depth;
+    s.name = name;
+    s.start = now_ns();
+    return s;
+}
+
+void instrument_end(instrument_span *s)
+{
+    if(!s->name) return;
+    long long end = now_ns();
+    long long dur = end - s->start;
+    thread_profile *p = get_profile();
+    --p->depth;
+    stage_stats *st = get_stage(p, s->name);
+    if(!st->calls || dur < st->min) st->min = dur;
+    if(dur > st->max) st->max = dur;
+    st->total += dur;
+    ++st->calls;
+    if(trace_file){
+        if(p->n_events == p->cap_events && p->cap_events < MAX_EVENTS){
+            p->cap_events = p->cap_events ? 2*p->cap_events : 1024;
+            p->events = realloc(p->events, p->cap_events*sizeof(trace_event));
+        }
+        if(p->n_events < p->cap_events){
+            trace_event e = {s->name, s->start - epoch, dur};
+            p->events[p->n_events++] = e;
+        } else {
+            ++p->dropped;
+        }
+    }
+}
+
+// Add n to a named counter.
+void instrument_count(const char *name, long long n)
+{
+    if(!instrument_enabled()) return;
+    get_stage(get_profile(), name)->count += n;
+}
+
+// Charge an allocation to the innermost open stage of this thread.
+void instrument_alloc(size_t bytes)
+{
+    if(!instrument_enabled()) return;
+    thread_profile *p = get_profile();
+    int top = p->depth < MAX_DEPTH ? p->depth : MAX_DEPTH;
+    const char *name = top ? p->stack[top - 1] : "(untracked)";
+    get_stage(p, name)->bytes += bytes;
+}
+
+static int by_total(const void *a, const void *b)
+{
+    const stage_stats *x = a, *y = b;
+    return (y->total > x->total) - (y->total < x->total);
+}
+
+// Stages of every thread merged by name, caller frees. Takes profiles_lock.
+// int *n: set to the number of stages.
+// int *threads: set to the number of threads seen, may be 0.
+static stage_stats *merge_stages(int *n_stages, int *threads)
+{
+    stage_stats *all = 0;
+    int n = 0;
+    int i, j;
+    pthread_mutex_lock(&profiles_lock);
+    thread_profile *p;
+    for(p = profiles; p; p = p->next){
+        for(i = 0; i < p->n; ++i){
+            stage_stats *s = p->stages + i;
+            for(j = 0; j < n && strcmp(all[j].name, s->name); ++j);
+            if(j == n){
+                all = realloc(all, (n + 1)*sizeof(stage_stats));
+                all[n++] = *s;
+                continue;
+            }
+            stage_stats *m = all + j;
+            if(s->calls && (!m->calls || s->min < m->min)) m->min = s->min;
+            if(s->max > m->max) m->max = s->max;
+            m->calls += s->calls;
+            m->total += s->total;
+            m->count += s->count;
+            m->bytes += s->bytes;
+        }
+    }
+    if(threads) *threads = n_profiles;
+    pthread_mutex_unlock(&profiles_lock);
+    *n_stages = n;
+    return all;
+}
+
+// Totals of one stage merged over threads, all zero if it never ran.
+// const char *name: stage or counter name.
+// returns: calls, times in nanoseconds, count and bytes.
+instrument_stats instrument_query(const char *name)
+{
+    instrument_stats r = {0};
+    int n, i;
+    stage_stats *all = merge_stages(&n, 0);
+    for(i = 0; i < n; ++i){
+        if(strcmp(all[i].name, name)) continue;
+        r.calls = all[i].calls;
+        r.total = all[i].total;
+        r.min = all[i].min;
+        r.max = all[i].max;
+        r.count = all[i].count;
+        r.bytes = all[i].bytes;
+    }
+    free(all);
+    return r;
+}
+
+// Print all stages merged over threads, slowest first. Call while no
+// instrumented work is running.
+// FILE *fp: where to print.
+void instrument_report(FILE *fp)
+{
+    int n, threads, i;
+    stage_stats *all = merge_stages(&n, &threads);
+    qsort(all, n, sizeof(stage_stats), by_total);
+    fprintf(fp, "%-32s %8s %12s %12s %12s %12s %12s %14s\n",
+        "stage", "calls", "total ms", "mean us", "min us", "max us", "count", "bytes");
+    for(i = 0; i < n; ++i){
+        stage_stats s = all[i];
+        double mean = s.calls ? s.total / 1e3 / s.calls : 0;
+        fprintf(fp, "%-32s %8lld %12.3f %12.3f %12.3f %12.3f %12lld %14lld\n",
+            s.name, s.calls, s.total / 1e6, mean, s.min / 1e3, s.max / 1e3, s.count, s.bytes);
+    }
+    fprintf(fp, "%d thread(s)\n", threads);
+    free(all);
+}
+
+// Write every timed span as a Chrome trace, load it in chrome://tracing
+// or ui.perfetto.dev. Spans are only kept when tracing was requested.
+// const char *fname: file to write.
+// returns: 1 on success, 0 on failure.
+int instrument_write_trace(const char *fname)
+{
+    FILE *fp = fopen(fname, "w");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return 0;
+    }
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    int first = 1;
+    int i;
+    pthread_mutex_lock(&profiles_lock);
+    thread_profile *p;
+    for(p = profiles; p; p = p->next){
+        for(i = 0; i < p->n_events; ++i){
+            trace_event e = p->events[i];
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                first ? "" : ",", e.name, p->tid, e.start / 1e3, e.dur / 1e3);
+            first = 0;
+        }
+        if(p->dropped) fprintf(stderr, "Trace dropped %lld spans of thread %d\n", p->dropped, p->tid);
+    }
+    pthread_mutex_unlock(&profiles_lock);
+    fprintf(fp, "\n]}\n");
+    return fclose(fp) == 0;
+}
+
+// Clear all collected stages, counters and spans.
+void instrument_reset()
+{
+    pthread_mutex_lock(&profiles_lock);
+    thread_profile *p;
+    for(p = profiles; p; p = p->next){
+        p->n = 0;
+        p->n_events = 0;
+        p->dropped = 0;
+        memset(p->stages, 0, p->cap*sizeof(stage_stats));
+    }
+    pthread_mutex_unlock(&profiles_lock);
+}
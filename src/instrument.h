@@ -0,0 +1,60 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Per-stage timers, counters and allocation tallies.
+//
+// Build with make INSTRUMENT=1 to compile them in, otherwise every macro
+// below expands to nothing. At run time the UWIMG_PROFILE environment
+// variable turns collection on:
+//
+//   UWIMG_PROFILE=summary          table of all stages on stderr at exit
+//   UWIMG_PROFILE=trace:out.json   Chrome trace (chrome://tracing) at exit
+//   UWIMG_PROFILE=summary,trace:out.json   both
+//
+// PROFILE_SCOPE("name") times the rest of the enclosing block. Stage names
+// must be string literals or otherwise outlive the program's last report.
+// PROFILE_COUNT adds to a named counter, give it a stage's name to report
+// it on that stage's row. PROFILE_ALLOC charges bytes to the innermost open
+// scope of the calling thread.
+
+typedef struct{
+    const char *name;
+    long long start;
+} instrument_span;
+
+typedef struct{
+    long long calls;
+    long long total, min, max;  // Nanoseconds
+    long long count;
+    long long bytes;
+} instrument_stats;
+
+int instrument_enabled();
+void instrument_set_enabled(int on);
+instrument_span instrument_begin(const char *name);
+void instrument_end(instrument_span *s);
+void instrument_count(const char *name, long long n);
+void instrument_alloc(size_t bytes);
+instrument_stats instrument_query(const char *name);
+void instrument_report(FILE *fp);
+int instrument_write_trace(const char *fname);
+void instrument_reset();
+
+#ifdef INSTRUMENT
+#define INSTRUMENT_CAT_(a, b) a##b
+#define INSTRUMENT_CAT(a, b) INSTRUMENT_CAT_(a, b)
+#define PROFILE_SCOPE(name) \
+    instrument_span INSTRUMENT_CAT(instrument_span_, __LINE__) \
+    __attribute__((cleanup(instrument_end))) = instrument_begin(name)
+#define PROFILE_COUNT(name, n) instrument_count(name, n)
+#define PROFILE_ALLOC(bytes) instrument_alloc(bytes)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_COUNT(name, n)
+#define PROFILE_ALLOC(bytes)
+#endif
+
+#endif
@@ -1,8 +1,14 @@
 // You probably don't want to edit this file
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "image.h"
+#include "instrument.h"
 
 image make_empty_image(int c, int h, int w)
 {
@@ -18,6 +24,7 @@ image make_image(int c, int h, int w)
 {
     image out = make_empty_image(c,h,w);
     out.data = calloc(h*w*c, sizeof(float));
+    PROFILE_ALLOC((size_t)h*w*c*sizeof(float));
     return out;
 }
 
@@ -96,32 +103,167 @@ image load_image(char *filename)
     return out;
 }
 
+// Binary image layout, all values in native byte order:
+//
+//   binary_header
+//   padding to BINARY_ALIGN
+//   payload, c*h*w elements
+//
+// The payload starts on a page boundary, so load_image_binary maps the file
+// and hands out an image that points straight into the mapping. Files
+// without the magic are read as the old format, int w, h, c then floats.
+
+#define BINARY_MAGIC "UWIMAGE"
+#define BINARY_VERSION 1
+#define BINARY_ALIGN 4096
+
+typedef enum{ELEMENT_F32, ELEMENT_U8, ELEMENT_F16} ELEMENT;
+
+typedef struct{
+    char magic[8];
+    int32_t version;
+    int32_t element;        // ELEMENT of the payload
+    int32_t layout;         // LAYOUT of the payload
+    int32_t c, h, w;
+    int64_t offset;         // Byte offset of the payload from file start
+    int64_t size;           // Payload size in bytes
+} binary_header;
+
+// Mappings owned by images from load_image_binary, so free_image can
+// release them. Mapped data always starts on a BINARY_ALIGN boundary and
+// mapped_count is read atomically, so free_image only takes the lock for
+// page aligned data while a mapping is alive.
+typedef struct mapped_image{
+    float *data;
+    void *base;
+    size_t size;
+    struct mapped_image *next;
+} mapped_image;
+
+static mapped_image *mapped_images = 0;
+static int mapped_count = 0;
+static pthread_mutex_t mapped_images_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void save_image_binary(image im, const char *fname)
 {
     FILE *fp = fopen(fname, "wb");
-    fwrite(&im.w, sizeof(int), 1, fp);
-    fwrite(&im.h, sizeof(int), 1, fp);
-    fwrite(&im.c, sizeof(int), 1, fp);
-    fwrite(im.data, sizeof(float), im.w*im.h*im.c, fp);
-    fclose(fp);
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return;
+    }
+    binary_header header = {{0}};
+    memcpy(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    header.version = BINARY_VERSION;
+    header.element = ELEMENT_F32;
+    header.layout = PLANAR;
+    header.c = im.c;
+    header.h = im.h;
+    header.w = im.w;
+    header.offset = BINARY_ALIGN;
+    header.size = (int64_t)im.c*im.h*im.w*sizeof(float);
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok &= fseek(fp, header.offset, SEEK_SET) == 0;
+    ok &= fwrite(im.data, sizeof(float), (size_t)im.c*im.h*im.w, fp) == (size_t)im.c*im.h*im.w;
+    ok &= fclose(fp) == 0;
+    if(!ok) fprintf(stderr, "Failed to write image %s\n", fname);
 }
 
-image load_image_binary(const char *fname)
+static image load_image_binary_legacy(FILE *fp)
 {
     int w = 0;
     int h = 0;
     int c = 0;
-    FILE *fp = fopen(fname, "rb");
-    fread(&w, sizeof(int), 1, fp);
-    fread(&h, sizeof(int), 1, fp);
-    fread(&c, sizeof(int), 1, fp);
+    rewind(fp);
+    if(fread(&w, sizeof(int), 1, fp) != 1 || fread(&h, sizeof(int), 1, fp) != 1 ||
+       fread(&c, sizeof(int), 1, fp) != 1 || w < 0 || h < 0 || c < 0){
+        return make_empty_image(0,0,0);
+    }
     image im = make_image(c,h,w);
-    fread(im.data, sizeof(float), im.w*im.h*im.c, fp);
+    if(fread(im.data, sizeof(float), (size_t)im.w*im.h*im.c, fp) != (size_t)im.w*im.h*im.c){
+        fprintf(stderr, "Truncated image file\n");
+    }
+    return im;
+}
+
+// Load an image written by save_image_binary. The file is memory mapped
+// and the image data points into the mapping, so nothing is copied until a
+// page is written to. Writes are copy-on-write and never reach the file.
+// Free the image with free_image as usual.
+// const char *fname: file to read.
+// returns: the image, 0 x 0 x 0 if the file couldn't be read.
+image load_image_binary(const char *fname)
+{
+    FILE *fp = fopen(fname, "rb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return make_empty_image(0,0,0);
+    }
+    binary_header header;
+    if(fread(&header, sizeof(header), 1, fp) != 1 ||
+       memcmp(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC))){
+        image im = load_image_binary_legacy(fp);
+        fclose(fp);
+        return im;
+    }
+    struct stat st;
+    int valid = !fstat(fileno(fp), &st) && header.version == BINARY_VERSION
+        && header.c >= 0 && header.h >= 0 && header.w >= 0
+        && header.offset % BINARY_ALIGN == 0
+        && header.size == (int64_t)header.c*header.h*header.w*sizeof(float)
+        && header.offset + header.size <= (int64_t)st.st_size;
+    if(valid && (header.element != ELEMENT_F32 || header.layout != PLANAR)){
+        fprintf(stderr, "Unsupported element type or layout in %s\n", fname);
+        fclose(fp);
+        return make_empty_image(0,0,0);
+    }
+    if(!valid){
+        fprintf(stderr, "Not an image file: %s\n", fname);
+        fclose(fp);
+        return make_empty_image(0,0,0);
+    }
+    size_t size = st.st_size;
+    char *base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+    fclose(fp);
+    if(base == MAP_FAILED){
+        fprintf(stderr, "Couldn't map file %s\n", fname);
+        return make_empty_image(0,0,0);
+    }
+    image im = make_empty_image(header.c, header.h, header.w);
+    im.data = (float *)(base + header.offset);
+
+    mapped_image *map = calloc(1, sizeof(mapped_image));
+    map->data = im.data;
+    map->base = base;
+    map->size = size;
+    pthread_mutex_lock(&mapped_images_lock);
+    map->next = mapped_images;
+    mapped_images = map;
+    __atomic_add_fetch(&mapped_count, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mapped_images_lock);
     return im;
 }
 
 void free_image(image im)
 {
+    if(!__atomic_load_n(&mapped_count, __ATOMIC_ACQUIRE) || ((size_t)im.data & (BINARY_ALIGN - 1))){
+        free(im.data);
+        return;
+    }
+    mapped_image *map = 0;
+    pthread_mutex_lock(&mapped_images_lock);
+    mapped_image **p = &mapped_images;
+    while(*p && (*p)->data != im.data) p = &(*p)->next;
+    map = *p;
+    if(map){
+        *p = map->next;
+        __atomic_sub_fetch(&mapped_count, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&mapped_images_lock);
+    if(map){
+        munmap(map->base, map->size);
+        free(map);
+        return;
+    }
     free(im.data);
 }
 
@@ -2,12 +2,20 @@
 #include <string.h>
 #include "image.h"
 #include "test.h"
+#include "bench.h"
 #include "args.h"
 
 int main(int argc, char **argv)
 {
-    if(argc < 3){
-        printf("usage: %s test <hw0 | hw1...>\n", argv[0]);  
+    if(argc >= 2 && 0 == strcmp(argv[1], "bench")){
+        return run_bench(argc, argv) ? 1 : 0;
+    } else if(argc < 3){
+        printf("usage: %s test <hw0 | hw1... | tools>\n", argv[0]);  
+        printf("       %s batch <manifest> [-threads n] [-mem MB]\n", argv[0]);
+        printf("       %s bench [-size n,...] [-kernel k,...] [-threads t,...] [-reps r] [-only name]\n"
+               "             [-json out.json] [-baseline base.json] [-tolerance .1]\n", argv[0]);
+    } else if (0 == strcmp(argv[1], "batch")){
+        return run_batch(argc, argv) ? 1 : 0;
     } else if (0 == strcmp(argv[1], "test")){
         if (0 == strcmp(argv[2], "hw0")) test_hw0();
         if (0 == strcmp(argv[2], "hw1")) test_hw1();
@@ -15,6 +23,7 @@ int main(int argc, char **argv)
         if (0 == strcmp(argv[2], "hw3")) test_hw3();
         if (0 == strcmp(argv[2], "hw4")) test_hw4();
         if (0 == strcmp(argv[2], "hw5")) test_hw5();
+        if (0 == strcmp(argv[2], "tools")) test_tools();
     }
     return 0;
 }
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include "instrument.h"
 
 matrix make_identity_homography()
 {
@@ -25,12 +26,23 @@ matrix make_translation_homography(float dx, float dy)
 void free_matrix(matrix m)
 {
     if (m.data) {
-        int i;
-        if (!m.shallow) for(i = 0; i < m.rows; ++i) free(m.data[i]);
+        if (!m.shallow && m.rows) free(m.data[0]);
         free(m.data);
     }
 }
 
+// Swap the contents of two rows. Rows share one allocation, so the row
+// pointers themselves have to stay in order.
+static void swap_rows(matrix m, int a, int b)
+{
+    int j;
+    for(j = 0; j < m.cols; ++j){
+        double swap = m.data[a][j];
+        m.data[a][j] = m.data[b][j];
+        m.data[b][j] = swap;
+    }
+}
+
 matrix make_matrix(int rows, int cols)
 {
     matrix m;
@@ -38,8 +50,11 @@ matrix make_matrix(int rows, int cols)
     m.cols = cols;
     m.shallow = 0;
     m.data = calloc(m.rows, sizeof(double *));
+    // One block for all rows, so the matrix is a plain row-major array.
+    double *block = calloc((size_t)m.rows*m.cols, sizeof(double));
+    PROFILE_ALLOC((size_t)m.rows*m.cols*sizeof(double));
     int i;
-    for(i = 0; i < m.rows; ++i) m.data[i] = calloc(m.cols, sizeof(double));
+    for(i = 0; i < m.rows; ++i) m.data[i] = block + (size_t)i*m.cols;
     return m;
 }
 
@@ -95,6 +110,27 @@ matrix matrix_mult_matrix(matrix a, matrix b)
     return p;
 }
 
+// Multiply two matrices into a preallocated result, p = a*b.
+// p must have a.rows rows and b.cols columns, its contents are overwritten.
+// Loops are ordered i-k-j so the inner loop streams rows of b and p.
+void matrix_mult_matrix_into(matrix a, matrix b, matrix p)
+{
+    assert(a.cols == b.rows);
+    assert(p.rows == a.rows && p.cols == b.cols);
+    int i, j, k;
+    for(i = 0; i < p.rows; ++i){
+        double *prow = p.data[i];
+        memset(prow, 0, p.cols*sizeof(double));
+        for(k = 0; k < a.cols; ++k){
+            double aik = a.data[i][k];
+            double *brow = b.data[k];
+            for(j = 0; j < p.cols; ++j){
+                prow[j] += aik*brow[j];
+            }
+        }
+    }
+}
+
 matrix matrix_elmult_matrix(matrix a, matrix b)
 {
     assert(a.cols == b.cols);
@@ -139,14 +175,9 @@ matrix axpy_matrix(double a, matrix x, matrix y)
 
 matrix transpose_matrix(matrix m)
 {
-    matrix t;
-    t.rows = m.cols;
-    t.cols = m.rows;
-    t.data = calloc(t.rows, sizeof(double *));
-    t.shallow = 0;
+    matrix t = make_matrix(m.cols, m.rows);
     int i, j;
     for(i = 0; i < t.rows; ++i){
-        t.data[i] = calloc(t.cols, sizeof(double));
         for(j = 0; j < t.cols; ++j){
             t.data[i][j] = m.data[j][i];
         }
@@ -247,9 +278,7 @@ matrix matrix_invert(matrix m)
             return none;
         }
 
-        double *swap = c.data[index];
-        c.data[index] = c.data[k];
-        c.data[k] = swap;
+        swap_rows(c, index, k);
 
         double val = c.data[k][k];
         c.data[k][k] = 1;
@@ -314,9 +343,7 @@ int* in_place_LUP(matrix m)
         pivot[k] = pivot[index];
         pivot[index] = swapi;
 
-        double *swap = m.data[index];
-        m.data[index] = m.data[k];
-        m.data[k] = swap;
+        swap_rows(m, index, k);
 
         for(i = k+1; i < m.rows; ++i){
             m.data[i][k] = m.data[i][k]/m.data[k][k];
@@ -22,6 +22,7 @@ matrix make_matrix(int rows, int cols);
 matrix copy_matrix(matrix m);
 double *sle_solve(matrix A, double *b);
 matrix matrix_mult_matrix(matrix a, matrix b);
+void matrix_mult_matrix_into(matrix a, matrix b, matrix p);
 matrix matrix_elmult_matrix(matrix a, matrix b);
 void print_matrix(matrix m);
 double **n_principal_components(matrix m, int n);
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+
+// Map a coordinate outside [0, n) back into the image.
+// int i: coordinate along an axis.
+// int n: image size along that axis.
+// BORDER border: how the outside is filled.
+// returns: index in [0, n), or -1 for BORDER_CONSTANT.
+int border_index(int i, int n, BORDER border)
+{
+    if(i >= 0 && i < n) return i;
+    if(border == BORDER_CONSTANT) return -1;
+    if(border == BORDER_CLAMP || n == 1) return i < 0 ? 0 : n - 1;
+    if(border == BORDER_WRAP) return ((i % n) + n) % n;
+    // Mirror without repeating the edge pixel, period 2n-2.
+    int period = 2*n - 2;
+    i = ((i % period) + period) % period;
+    return i < n ? i : period - i;
+}
+
+// Copy an image into a buffer with a halo filled by a border mode, so
+// kernels can read past the edges with plain pointer arithmetic.
+// image im: image to pad.
+// int pad_h, pad_w: halo rows above and below, columns left and right.
+// BORDER border: how the halo is filled.
+// float value: halo value for BORDER_CONSTANT.
+// returns: padded copy, free with free_padded_image.
+padded_image make_padded_image(image im, int pad_h, int pad_w, BORDER border, float value)
+{
+    assert(pad_h >= 0 && pad_w >= 0);
+    padded_image p;
+    p.pad_h = pad_h;
+    p.pad_w = pad_w;
+    p.im = make_image(im.c, im.h + 2*pad_h, im.w + 2*pad_w);
+    int pw = p.im.w;
+    int *cols = malloc(pw*sizeof(int));
+    int x, y;
+    for(x = 0; x < pw; ++x) cols[x] = border_index(x - pad_w, im.w, border);
+    #pragma omp parallel for private(x)
+    for(y = 0; y < im.c*p.im.h; ++y){
+        int c = y/p.im.h;
+        int sy = border_index(y%p.im.h - pad_h, im.h, border);
+        float *dst = p.im.data + (size_t)y*pw;
+        if(sy < 0){
+            for(x = 0; x < pw; ++x) dst[x] = value;
+            continue;
+        }
+        const float *src = im.data + ((size_t)c*im.h + sy)*im.w;
+        memcpy(dst + pad_w, src, im.w*sizeof(float));
+        for(x = 0; x < pad_w; ++x){
+            dst[x] = cols[x] < 0 ? value : src[cols[x]];
+            dst[pw - 1 - x] = cols[pw - 1 - x] < 0 ? value : src[cols[pw - 1 - x]];
+        }
+    }
+    free(cols);
+    return p;
+}
+
+// Pointer to a pixel of a padded image in the original's coordinates, valid
+// for y in [-pad_h, h + pad_h) and x in [-pad_w, w + pad_w).
+float *padded_pixel(padded_image p, int c, int y, int x)
+{
+    return p.im.data + ((size_t)c*p.im.h + y + p.pad_h)*p.im.w + x + p.pad_w;
+}
+
+void free_padded_image(padded_image p)
+{
+    free_image(p.im);
+}
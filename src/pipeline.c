@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "image.h"
+
+// Stages of an 8-bit pipeline. Every stage names the layout it wants, and
+// run_pipeline converts between stages only when that layout differs from
+// the one the previous stage produced.
+
+static image_u8 hsv_apply(image_u8 im, const float *args)
+{
+    adjust_hsv_u8(im, args[0], args[1], args[2]);
+    return im;
+}
+
+static image_u8 grayscale_apply(image_u8 im, const float *args)
+{
+    (void)args;
+    if(im.c == 1) return im;
+    return rgb_to_grayscale_u8(im);
+}
+
+static image_u8 resize_apply(image_u8 im, const float *args)
+{
+    return resize_image_u8(im, (int)args[0], (int)args[1], (RESAMPLE)args[2]);
+}
+
+static image_u8 blur_apply(image_u8 im, const float *args)
+{
+    image f = make_gaussian_filter(args[0]);
+    image_u8 out = convolve_image_u8(im, f, 1);
+    free_image(f);
+    return out;
+}
+
+static image_u8 sobel_apply(image_u8 im, const float *args)
+{
+    (void)args;
+    image f = u8_to_image(im);
+    image *sobel = sobel_image(f);
+    feature_normalize(sobel[0]);
+    image_u8 out = image_to_u8(sobel[0]);
+    free_image(f);
+    free_image(sobel[0]);
+    free_image(sobel[1]);
+    free(sobel);
+    return out;
+}
+
+// Adjust hue, saturation and value in place, see adjust_hsv.
+image_op hsv_op(float hue, float saturation, float value)
+{
+    image_op op = {"hsv", INTERLEAVED, hsv_apply, {hue, saturation, value}, 1 << 3, 0};
+    return op;
+}
+
+// Convert RGB to a single luma channel, gray images pass through.
+image_op grayscale_op()
+{
+    image_op op = {"grayscale", ANY_LAYOUT, grayscale_apply, {0}, 1 << 1 | 1 << 3, 1};
+    return op;
+}
+
+// Resize to h x w with the given resampling mode.
+image_op resize_op(int h, int w, RESAMPLE mode)
+{
+    image_op op = {"resize", PLANAR, resize_apply, {h, w, mode}};
+    return op;
+}
+
+// Gaussian blur with the filter from make_gaussian_filter(sigma).
+image_op blur_op(float sigma)
+{
+    image_op op = {"blur", PLANAR, blur_apply, {sigma}};
+    return op;
+}
+
+// Gradient magnitude from sobel_image, normalized to 0..1.
+image_op sobel_op()
+{
+    image_op op = {"sobel", PLANAR, sobel_apply, {0}, 0, 1};
+    return op;
+}
+
+// returns: 1 if op can run on an image with c channels.
+int image_op_accepts(image_op op, int c)
+{
+    return !op.channels || (c < 31 && (op.channels >> c & 1));
+}
+
+static image_u8 ensure_layout(image_u8 im, LAYOUT layout)
+{
+    if(layout == ANY_LAYOUT || im.layout == layout) return im;
+    if(im.c == 1){
+        im.layout = layout;
+        return im;
+    }
+    image_u8 out = u8_to_layout(im, layout);
+    free_image_u8(im);
+    return out;
+}
+
+// Run a sequence of operations on an 8-bit image.
+// image_u8 im: input, owned by the pipeline from here on.
+// const image_op *ops: operations to apply in order.
+// int n: number of operations.
+// LAYOUT layout: layout of the result, ANY_LAYOUT keeps whatever the last
+//                operation produced.
+// returns: the processed image, 0 x 0 x 0 with no data if an operation
+//          can't take the channels it is given.
+image_u8 run_pipeline(image_u8 im, const image_op *ops, int n, LAYOUT layout)
+{
+    int i;
+    for(i = 0; i < n; ++i){
+        if(!image_op_accepts(ops[i], im.c)){
+            fprintf(stderr, "Can't run %s on an image with %d channels\n", ops[i].name, im.c);
+            free_image_u8(im);
+            image_u8 none = {0};
+            return none;
+        }
+        im = ensure_layout(im, ops[i].layout);
+        image_u8 next = ops[i].apply(im, ops[i].args);
+        if(next.data != im.data) free_image_u8(im);
+        im = next;
+    }
+    return ensure_layout(im, layout);
+}
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include "image.h"
+#include "instrument.h"
+
+// Projections as inverse warp tables. Each output pixel's source position
+// is worked out once per geometry and focal length and stored as the
+// offset of a 2x2 source block plus bilinear fractions, so projecting a
+// frame is a gather pass over the table with no trigonometry. Fixed point
+// tables keep the fractions in a byte each, half the size of float ones.
+
+#define REMAP_ONE 128
+#define REMAP_CACHE_SIZE 4
+
+// Position in the original image seen by output pixel (x, y), both with
+// the optical center in the middle of the image. The ray through a point at
+// angle theta around the axis and height y on the cylinder, or latitude phi
+// on the sphere, meets the image plane at f tan(theta) across and
+// y/cos(theta) or f tan(phi)/cos(theta) down.
+// returns: 0 if the ray points behind the camera.
+static int unproject(PROJECTION projection, double f, double x, double y, double *sx, double *sy)
+{
+    double theta = x/f, c = cos(theta);
+    if(c <= 0) return 0;
+    *sx = f*tan(theta);
+    if(projection == PROJECT_SPHERICAL){
+        double phi = y/f;
+        if(cos(phi) <= 0) return 0;
+        *sy = f*tan(phi)/c;
+    } else {
+        *sy = y/c;
+    }
+    return 1;
+}
+
+// Build the table projecting h x w images taken with focal length f.
+// int h, w: image size, at least 2 x 2.
+// float f: focal length in pixels.
+// PROJECTION projection: surface to unroll onto.
+// int fixed: store fractions in fixed point.
+// returns: plan to pass to remap_image, free with free_remap_plan.
+remap_plan *make_remap_plan(int h, int w, float f, PROJECTION projection, int fixed)
+{
+    assert(h > 1 && w > 1 && f > 0);
+    remap_plan *p = calloc(1, sizeof(remap_plan));
+    size_t n = (size_t)h*w;
+    p->h = h;
+    p->w = w;
+    p->f = f;
+    p->projection = projection;
+    p->fixed = fixed;
+    p->offset = calloc(n, sizeof(int));
+    if(fixed){
+        p->qx = calloc(n, sizeof(unsigned char));
+        p->qy = calloc(n, sizeof(unsigned char));
+    } else {
+        p->fx = calloc(n, sizeof(float));
+        p->fy = calloc(n, sizeof(float));
+    }
+    int xc = w/2, yc = h/2;
+    int y;
+    #pragma omp parallel for
+    for(y = 0; y < h; ++y){
+        int x;
+        for(x = 0; x < w; ++x){
+            size_t i = (size_t)y*w + x;
+            double sx, sy;
+            if(!unproject(projection, f, x - xc, y - yc, &sx, &sy)){
+                p->offset[i] = -1;
+                continue;
+            }
+            sx += xc;
+            sy += yc;
+            if(sx < 0 || sy < 0 || sx > w - 1 || sy > h - 1){
+                p->offset[i] = -1;
+                continue;
+            }
+            // The last row and column use the block before them with a
+            // fraction of 1, so every block is inside the image.
+            int x0 = MIN((int)sx, w - 2), y0 = MIN((int)sy, h - 2);
+            p->offset[i] = y0*w + x0;
+            if(fixed){
+                p->qx[i] = lrint((sx - x0)*REMAP_ONE);
+                p->qy[i] = lrint((sy - y0)*REMAP_ONE);
+            } else {
+                p->fx[i] = sx - x0;
+                p->fy[i] = sy - y0;
+            }
+        }
+    }
+    return p;
+}
+
+void free_remap_plan(remap_plan *p)
+{
+    if(!p) return;
+    free(p->offset);
+    free(p->fx);
+    free(p->fy);
+    free(p->qx);
+    free(p->qy);
+    free(p);
+}
+
+static inline float blend_block(const float *s, int w, float a, float b)
+{
+    float top = s[0] + a*(s[1] - s[0]);
+    float bot = s[w] + a*(s[w + 1] - s[w]);
+    return top + b*(bot - top);
+}
+
+// Project an image with a precomputed table, one gather pass per channel.
+// image im: image to project, any number of channels.
+// remap_plan *p: plan made for im's size.
+// returns: projected image, 0 where no source pixel maps.
+image remap_image(image im, remap_plan *p)
+{
+    PROFILE_SCOPE("remap_image");
+    assert(im.h == p->h && im.w == p->w);
+    image out = make_image(im.c, im.h, im.w);
+    size_t plane = (size_t)im.h*im.w;
+    const float scale = 1.f/REMAP_ONE;
+    int y;
+    #pragma omp parallel for
+    for(y = 0; y < im.h; ++y){
+        size_t row = (size_t)y*im.w;
+        const int *offset = p->offset + row;
+        int k, x;
+        for(k = 0; k < im.c; ++k){
+            const float *src = im.data + k*plane;
+            float *dst = out.data + k*plane + row;
+            if(p->fixed){
+                const unsigned char *qx = p->qx + row, *qy = p->qy + row;
+                #pragma omp simd
+                for(x = 0; x < im.w; ++x){
+                    int o = offset[x];
+                    dst[x] = o < 0 ? 0 : blend_block(src + o, im.w, qx[x]*scale, qy[x]*scale);
+                }
+            } else {
+                const float *fx = p->fx + row, *fy = p->fy + row;
+                #pragma omp simd
+                for(x = 0; x < im.w; ++x){
+                    int o = offset[x];
+                    dst[x] = o < 0 ? 0 : blend_block(src + o, im.w, fx[x], fy[x]);
+                }
+            }
+        }
+    }
+    return out;
+}
+
+// Tables are kept for the geometries used most recently, so every frame of
+// a sequence with one size and focal length shares one table.
+static remap_plan *remap_cache[REMAP_CACHE_SIZE];
+static int remap_refs[REMAP_CACHE_SIZE];
+static unsigned long remap_used[REMAP_CACHE_SIZE];
+static unsigned long remap_clock = 0;
+static pthread_mutex_t remap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Fetch a table from the cache, building it if needed. The table stays
+// valid until it is handed back with release_remap_plan.
+remap_plan *get_remap_plan(int h, int w, float f, PROJECTION projection, int fixed)
+{
+    int i;
+    pthread_mutex_lock(&remap_lock);
+    for(i = 0; i < REMAP_CACHE_SIZE; ++i){
+        remap_plan *p = remap_cache[i];
+        if(p && p->h == h && p->w == w && p->f == f && p->projection == projection && p->fixed == fixed){
+            ++remap_refs[i];
+            remap_used[i] = ++remap_clock;
+            pthread_mutex_unlock(&remap_lock);
+            return p;
+        }
+    }
+    pthread_mutex_unlock(&remap_lock);
+
+    remap_plan *p = make_remap_plan(h, w, f, projection, fixed);
+
+    pthread_mutex_lock(&remap_lock);
+    int slot = -1;
+    for(i = 0; i < REMAP_CACHE_SIZE; ++i){
+        if(remap_refs[i]) continue;
+        if(slot < 0 || !remap_cache[i] || (remap_cache[slot] && remap_used[i] < remap_used[slot])) slot = i;
+    }
+    if(slot >= 0){
+        free_remap_plan(remap_cache[slot]);
+        remap_cache[slot] = p;
+        remap_refs[slot] = 1;
+        remap_used[slot] = ++remap_clock;
+    }
+    pthread_mutex_unlock(&remap_lock);
+    return p;
+}
+
+void release_remap_plan(remap_plan *p)
+{
+    int i;
+    pthread_mutex_lock(&remap_lock);
+    for(i = 0; i < REMAP_CACHE_SIZE; ++i){
+        if(remap_cache[i] == p){
+            --remap_refs[i];
+            pthread_mutex_unlock(&remap_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&remap_lock);
+    // Every slot was busy, the table was never cached.
+    free_remap_plan(p);
+}
+
+// Project an image onto a cylinder or sphere and unroll it, reusing the
+// table for sizes and focal lengths seen recently.
+// image im: image to project.
+// float f: focal length used to take image (in pixels).
+// PROJECTION projection: surface to unroll onto.
+// int fixed: use a fixed point table, 1/128 pixel precision.
+// returns: projected image, same size as im.
+image project_image(image im, float f, PROJECTION projection, int fixed)
+{
+    remap_plan *p = get_remap_plan(im.h, im.w, f, projection, fixed);
+    image out = remap_image(im, p);
+    release_remap_plan(p);
+    return out;
+}
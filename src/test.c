@@ -5,7 +5,9 @@
 #include "matrix.h"
 #include "image.h"
 #include "test.h"
+#include "bench.h"
 #include "args.h"
+#include "instrument.h"
 
 
 float avg_diff(image a, image b)
@@ -278,6 +280,296 @@ void test_hsv_to_rgb()
     TEST(same_image(im, c, EPS));
     free_image(im);
     free_image(c);
+
+    // Hue out of range gives gray at V - C rather than wrapping.
+    image odd = make_image(3, 1, 3);
+    float hues[3] = {-.25, 1, 1.25};
+    int i;
+    for(i = 0; i < 3; ++i){
+        set_pixel(odd, 0, 0, i, hues[i]);
+        set_pixel(odd, 1, 0, i, .5);
+        set_pixel(odd, 2, 0, i, .8);
+    }
+    hsv_to_rgb(odd);
+    for(i = 0; i < 9; ++i) TEST(within_eps(odd.data[i], .4, EPS));
+    free_image(odd);
+}
+
+void test_adjust_hsv()
+{
+    image im = load_image("data/dog.jpg");
+    image c = copy_image(im);
+    rgb_to_hsv(c);
+    scale_image(c, 1, 1.5);
+    scale_image(c, 2, .8);
+    hsv_to_rgb(c);
+    clamp_image(c);
+    adjust_hsv(im, 0, 1.5, .8);
+    TEST(same_image(im, c, EPS));
+
+    image d = copy_image(im);
+    adjust_hsv(im, .25, 1, 1);
+    adjust_hsv(im, .75, 1, 1);
+    TEST(same_image(im, d, EPS));
+    free_image(im);
+    free_image(c);
+    free_image(d);
+}
+
+void test_compact_images()
+{
+    image im = load_image("data/dog.jpg");
+    image_u8 u8 = load_image_u8("data/dog.jpg");
+    image back = u8_to_image(u8);
+    TEST(same_image(back, im, EPS));
+
+    image_f16 f16 = image_to_f16(im);
+    image half = f16_to_image(f16);
+    TEST(same_image(half, im, EPS));
+    TEST(half_to_float(float_to_half(-2.5)) == -2.5f);
+    TEST(within_eps(half_to_float(float_to_half(1e-6)), 1e-6, 1e-7));
+
+    image gray = rgb_to_grayscale(im);
+    image_u8 gray_u8 = rgb_to_grayscale_u8(u8);
+    image gray_u8f = u8_to_image(gray_u8);
+    TEST(same_image(gray_u8f, gray, EPS));
+    image_f16 gray_f16 = rgb_to_grayscale_f16(f16);
+    image gray_f16f = f16_to_image(gray_f16);
+    TEST(same_image(gray_f16f, gray, EPS));
+
+    image f = make_gaussian_filter(2);
+    image blur = convolve_image(im, f, 1);
+    image_u8 blur_u8 = convolve_image_u8(u8, f, 1);
+    image blur_u8f = u8_to_image(blur_u8);
+    TEST(same_image(blur_u8f, blur, EPS));
+    image hp = make_highpass_filter();
+    image edges = convolve_image(im, hp, 0);
+    image_f16 edges_f16 = convolve_image_f16(f16, hp, 0);
+    image edges_f16f = f16_to_image(edges_f16);
+    TEST(same_image(edges_f16f, edges, EPS));
+    // Even sizes run 5 taps, scaled so the sum stays in u8 range.
+    image box = make_box_filter(4);
+    scale_image(box, 0, 16./25);
+    image boxed = convolve_image(im, box, 1);
+    image_u8 boxed_u8 = convolve_image_u8(u8, box, 1);
+    image boxed_u8f = u8_to_image(boxed_u8);
+    TEST(same_image(boxed_u8f, boxed, EPS));
+
+    image small = resize_image(im, 97, 131, BILINEAR);
+    image_f16 small_f16 = resize_image_f16(f16, 97, 131, BILINEAR);
+    image small_f16f = f16_to_image(small_f16);
+    TEST(same_image(small_f16f, small, EPS));
+
+    image sat = copy_image(im);
+    adjust_hsv(sat, .1, 1.3, .9);
+    adjust_hsv_u8(u8, .1, 1.3, .9);
+    image sat_u8f = u8_to_image(u8);
+    TEST(same_image(sat_u8f, sat, EPS));
+
+    free_image(im); free_image(back); free_image(half); free_image(gray);
+    free_image(gray_u8f); free_image(gray_f16f); free_image(f); free_image(blur);
+    free_image(blur_u8f); free_image(hp); free_image(edges); free_image(edges_f16f);
+    free_image(small); free_image(small_f16f); free_image(sat); free_image(sat_u8f);
+    free_image(box); free_image(boxed); free_image(boxed_u8f); free_image_u8(boxed_u8);
+    free_image_u8(u8); free_image_u8(gray_u8); free_image_u8(blur_u8);
+    free_image_f16(f16); free_image_f16(gray_f16); free_image_f16(edges_f16); free_image_f16(small_f16);
+}
+
+void test_batch()
+{
+    FILE *fp = fopen("data/test_batch.txt", "w");
+    fprintf(fp, "# input output operations\n\n");
+    fprintf(fp, "data/dog.jpg data/test_batch_a.png resize:97x131:area hsv:.1,1.3,.9\n");
+    fprintf(fp, "data/dog.jpg data/test_batch_b.png gray blur:1 sobel\n");
+    fprintf(fp, "data/missing.jpg data/test_batch_c.png gray\n");
+    fprintf(fp, "data/test_batch_cut.png data/test_batch_d.png gray\n");
+    fprintf(fp, "data/dog.jpg data/missing/test_batch_e.png gray\n");
+    fprintf(fp, "data/dog.jpg data/test_batch_f.png gray hsv:0,1,1\n");
+    fprintf(fp, "data/dogbw.png data/test_batch_g.png hsv:0,1.2,1\n");
+    fprintf(fp, "data/test_batch_alpha.png data/test_batch_h.png gray\n");
+    fclose(fp);
+    // Gray plus alpha loads as plain gray.
+    image_u8 alpha = make_image_u8(2, 16, 16);
+    alpha.layout = INTERLEAVED;
+    save_png_u8(alpha, "data/test_batch_alpha");
+    free_image_u8(alpha);
+    // A png cut short after its header passes stbi_info but doesn't decode.
+    FILE *src = fopen("data/dogbox.png", "rb");
+    FILE *cut = fopen("data/test_batch_cut.png", "wb");
+    char head[256];
+    fwrite(head, 1, fread(head, 1, sizeof(head), src), cut);
+    fclose(src);
+    fclose(cut);
+    char *argv[] = {"uwimg", "batch", "data/test_batch.txt", "-threads", "2", 0};
+    TEST(run_batch(5, argv) == 5);
+
+    image_u8 a = load_image_u8("data/test_batch_a.png");
+    image_op ops[] = {resize_op(97, 131, AREA), hsv_op(.1, 1.3, .9)};
+    image_u8 a_ref = run_pipeline(load_image_u8("data/dog.jpg"), ops, 2, PLANAR);
+    TEST(!memcmp(a.data, a_ref.data, (size_t)a.c*a.h*a.w));
+    image_u8 b = load_image_u8("data/test_batch_b.png");
+    TEST(b.c == 1 && b.w == 768 && b.h == 576);
+    image_u8 h = load_image_u8("data/test_batch_h.png");
+    TEST(h.c == 1 && h.w == 16 && h.h == 16);
+    image_op bad[] = {grayscale_op(), hsv_op(0, 1, 1)};
+    TEST(!run_pipeline(load_image_u8("data/dog.jpg"), bad, 2, ANY_LAYOUT).data);
+
+    remove("data/test_batch.txt");
+    remove("data/test_batch_cut.png");
+    remove("data/test_batch_a.png");
+    remove("data/test_batch_b.png");
+    remove("data/test_batch_alpha.png");
+    remove("data/test_batch_h.png");
+    free_image_u8(a); free_image_u8(a_ref); free_image_u8(b); free_image_u8(h);
+}
+
+void test_bench()
+{
+    char *argv[] = {"uwimg", "bench", "-only", "matrix_mult_matrix", "-size", "8,16", "-reps", "3",
+        "-json", "data/test_bench.json", 0};
+    TEST(run_bench(10, argv) == 0);
+    char *same[] = {"uwimg", "bench", "-only", "matrix_mult_matrix", "-size", "8,16", "-reps", "3",
+        "-baseline", "data/test_bench.json", "-tolerance", "1000", 0};
+    TEST(run_bench(12, same) == 0);
+
+    FILE *fp = fopen("data/test_bench.json", "w");
+    fprintf(fp, "{\"name\":\"matrix_mult_matrix\",\"params\":\"size=16 kernel=7 threads=0\",\"median_ms\":0.000001}\n");
+    fclose(fp);
+    char *slower[] = {"uwimg", "bench", "-only", "matrix_mult_matrix", "-size", "8,16", "-reps", "3",
+        "-baseline", "data/test_bench.json", 0};
+    TEST(run_bench(10, slower) == 1);
+    remove("data/test_bench.json");
+}
+
+static void instrumented_inner(int i)
+{
+    instrument_span s = instrument_begin("test_inner");
+    instrument_count("test_inner", i);
+    instrument_alloc(100);
+    instrument_end(&s);
+}
+
+void test_instrument()
+{
+    int was = instrument_enabled();
+    instrument_set_enabled(1);
+    instrument_reset();
+
+    instrument_span outer = instrument_begin("test_outer");
+    int i;
+    for(i = 1; i <= 3; ++i) instrumented_inner(i);
+    instrument_alloc(7);
+    instrument_end(&outer);
+    instrument_stats o = instrument_query("test_outer");
+    instrument_stats in = instrument_query("test_inner");
+    TEST(o.calls == 1 && in.calls == 3);
+    TEST(in.count == 6 && in.bytes == 300 && o.bytes == 7);
+    TEST(in.total <= o.total && in.min <= in.max && o.min == o.total);
+    TEST(instrument_query("test_missing").calls == 0);
+
+#ifdef INSTRUMENT
+    {
+        PROFILE_SCOPE("test_macro");
+        PROFILE_COUNT("test_macro", 5);
+        PROFILE_ALLOC(11);
+    }
+    instrument_stats m = instrument_query("test_macro");
+    TEST(m.calls == 1 && m.count == 5 && m.bytes == 11);
+#endif
+
+    // More stages than the first table holds each keep their own row.
+    static char names[300][16];
+    for(i = 0; i < 300; ++i){
+        sprintf(names[i], "test_stage_%d", i);
+        instrument_span s = instrument_begin(names[i]);
+        instrument_end(&s);
+        instrument_count(names[i], i);
+    }
+    int separate = 1;
+    for(i = 0; i < 300; ++i){
+        instrument_stats st = instrument_query(names[i]);
+        separate &= st.calls == 1 && st.count == i;
+    }
+    TEST(separate);
+
+    FILE *fp = tmpfile();
+    instrument_report(fp);
+    rewind(fp);
+    char line[256];
+    int seen_outer = 0, seen_inner = 0, seen_last = 0;
+    while(fgets(line, sizeof(line), fp)){
+        seen_outer |= !strncmp(line, "test_outer ", 11);
+        seen_inner |= !strncmp(line, "test_inner ", 11);
+        seen_last |= !strncmp(line, "test_stage_299 ", 15);
+    }
+    fclose(fp);
+    TEST(seen_outer && seen_inner && seen_last);
+
+    instrument_reset();
+    TEST(instrument_query("test_outer").calls == 0);
+    instrument_set_enabled(was);
+}
+
+void test_binary_image()
+{
+    image im = load_image("data/dog.jpg");
+    save_image_binary(im, "data/test_binary.bin");
+    image mapped = load_image_binary("data/test_binary.bin");
+    TEST(((size_t)mapped.data & 4095) == 0);
+    TEST(!memcmp(mapped.data, im.data, (size_t)im.c*im.h*im.w*sizeof(float)));
+    set_pixel(mapped, 0, 0, 0, 5);
+    image again = load_image_binary("data/test_binary.bin");
+    TEST(get_pixel(again, 0, 0, 0) == get_pixel(im, 0, 0, 0));
+    image legacy = load_image_binary("data/dotsintegral.bin");
+    TEST(legacy.c == 3 && legacy.h > 0 && legacy.w > 0);
+    remove("data/test_binary.bin");
+    free_image(im);
+    free_image(mapped);
+    free_image(again);
+    free_image(legacy);
+}
+
+void test_interleaved_pipeline()
+{
+    image_u8 planar = load_image_u8("data/dog.jpg");
+    image_u8 hwc = load_image_u8_interleaved("data/dog.jpg");
+    TEST(hwc.layout == INTERLEAVED && hwc.c == planar.c);
+    image_u8 chw = u8_to_layout(hwc, PLANAR);
+    TEST(!memcmp(chw.data, planar.data, (size_t)planar.c*planar.h*planar.w));
+
+    image_u8 gray = rgb_to_grayscale_u8(planar);
+    image_u8 gray_hwc = rgb_to_grayscale_u8(hwc);
+    TEST(!memcmp(gray.data, gray_hwc.data, (size_t)gray.h*gray.w));
+
+    // Reference: the same steps on a planar image, one call at a time.
+    adjust_hsv_u8(planar, .1, 1.3, .9);
+    image_u8 small = resize_image_u8(planar, 97, 131, BILINEAR);
+    image f = make_gaussian_filter(1);
+    image_u8 blur = convolve_image_u8(small, f, 1);
+
+    image_op ops[] = {hsv_op(.1, 1.3, .9), resize_op(97, 131, BILINEAR), blur_op(1)};
+    image_u8 out = run_pipeline(hwc, ops, 3, INTERLEAVED);
+    TEST(out.layout == INTERLEAVED);
+    image_u8 ref = u8_to_layout(blur, INTERLEAVED);
+    TEST(!memcmp(out.data, ref.data, (size_t)ref.c*ref.h*ref.w));
+
+    image_op gray_ops[] = {grayscale_op(), resize_op(97, 131, BILINEAR)};
+    image_u8 gray_out = run_pipeline(u8_to_layout(chw, INTERLEAVED), gray_ops, 2, ANY_LAYOUT);
+    image_u8 gray_ref = resize_image_u8(gray, 97, 131, BILINEAR);
+    TEST(gray_out.c == 1 && !memcmp(gray_out.data, gray_ref.data, (size_t)gray_ref.h*gray_ref.w));
+
+    // Alpha is dropped from RGBA files.
+    image rgba = load_image("data/Rainier1.png");
+    image_u8 rgba_hwc = load_image_u8_interleaved("data/Rainier1.png");
+    image_u8 rgba_chw = u8_to_layout(rgba_hwc, PLANAR);
+    image rgba_back = u8_to_image(rgba_chw);
+    TEST(rgba_hwc.c == 3 && same_image(rgba_back, rgba, EPS));
+
+    free_image(f); free_image(rgba); free_image(rgba_back);
+    free_image_u8(rgba_hwc); free_image_u8(rgba_chw);
+    free_image_u8(planar); free_image_u8(chw); free_image_u8(gray); free_image_u8(gray_hwc);
+    free_image_u8(small); free_image_u8(blur); free_image_u8(out); free_image_u8(ref);
+    free_image_u8(gray_out); free_image_u8(gray_ref);
 }
 
 void test_nn_interpolate()
@@ -340,6 +632,80 @@ void test_bl_resize()
     free_image(gt2);
 }
 
+void test_resize_any_channels()
+{
+    image im = load_image("data/dogbw.png");
+    TEST(im.c == 1);
+    image resized = resize_image(im, 97, 131, BILINEAR);
+    image again = resize_image(im, 97, 131, BILINEAR);
+    image gt = make_image(1, 97, 131);
+    int i, j;
+    for(i = 0; i < gt.h; ++i){
+        for(j = 0; j < gt.w; ++j){
+            float y = i*(1.0*im.h/gt.h) - .5 + .5*(1.0*im.h/gt.h);
+            float x = j*(1.0*im.w/gt.w) - .5 + .5*(1.0*im.w/gt.w);
+            set_pixel(gt, 0, i, j, bilinear_interpolate(im, 0, y, x));
+        }
+    }
+    TEST(same_image(resized, gt, EPS));
+    TEST(same_image(again, gt, EPS));
+    free_image(im);
+    free_image(resized);
+    free_image(again);
+    free_image(gt);
+}
+
+void test_downscale_modes()
+{
+    image im = load_image("data/dog.jpg");
+    image h = make_image(im.c, im.h - im.h%4, im.w - im.w%4);
+    int i, j, k;
+    for(k = 0; k < h.c; ++k){
+        for(i = 0; i < h.h; ++i){
+            for(j = 0; j < h.w; ++j){
+                set_pixel(h, k, i, j, get_pixel(im, k, i, j));
+            }
+        }
+    }
+    image area = resize_image(h, h.h/4, h.w/4, AREA);
+    image gt = make_image(h.c, h.h/4, h.w/4);
+    for(k = 0; k < gt.c; ++k){
+        for(i = 0; i < gt.h; ++i){
+            for(j = 0; j < gt.w; ++j){
+                float sum = 0;
+                int y, x;
+                for(y = 0; y < 4; ++y) for(x = 0; x < 4; ++x) sum += get_pixel(h, k, 4*i+y, 4*j+x);
+                set_pixel(gt, k, i, j, sum/16);
+            }
+        }
+    }
+    TEST(same_image(area, gt, EPS));
+
+    // Non-integer ratios go through the tables, weights still sum to one.
+    image flat = make_image(1, 101, 67);
+    for(i = 0; i < flat.w*flat.h; ++i) flat.data[i] = .5;
+    image flat_area = resize_image(flat, 13, 9, AREA);
+    image flat_lanczos = resize_image(flat, 13, 9, LANCZOS3);
+    image flat_gt = make_image(1, 13, 9);
+    for(i = 0; i < flat_gt.w*flat_gt.h; ++i) flat_gt.data[i] = .5;
+    TEST(same_image(flat_area, flat_gt, EPS));
+    TEST(same_image(flat_lanczos, flat_gt, EPS));
+
+    // Lanczos at the same size lands on source pixels exactly.
+    image same = resize_image(im, im.h, im.w, LANCZOS3);
+    TEST(same_image(same, im, EPS));
+
+    free_image(im);
+    free_image(h);
+    free_image(area);
+    free_image(gt);
+    free_image(flat);
+    free_image(flat_area);
+    free_image(flat_lanczos);
+    free_image(flat_gt);
+    free_image(same);
+}
+
 void test_multiple_resize()
 {
     image im = load_image("data/dog.jpg");
@@ -417,6 +783,161 @@ void test_convolution(){
     free_image(gt);
 }
 
+// Direct correlation reading outside pixels by a border mode, what
+// convolve_image_border computes.
+image reference_convolve_border(image im, image f, int preserve, BORDER border, float value)
+{
+    image out = make_image(preserve ? im.c : 1, im.h, im.w);
+    int c, y, x, i, j;
+    for(c = 0; c < im.c; ++c){
+        int fc = f.c == 1 ? 0 : c;
+        for(y = 0; y < im.h; ++y){
+            for(x = 0; x < im.w; ++x){
+                float sum = 0;
+                for(i = 0; i < f.h; ++i){
+                    for(j = 0; j < f.w; ++j){
+                        int sy = border_index(y + i - f.h/2, im.h, border);
+                        int sx = border_index(x + j - f.w/2, im.w, border);
+                        float v = sy < 0 || sx < 0 ? value : im.data[(c*im.h + sy)*im.w + sx];
+                        sum += v*get_pixel(f, fc, i, j);
+                    }
+                }
+                out.data[((preserve ? c : 0)*im.h + y)*im.w + x] += sum;
+            }
+        }
+    }
+    return out;
+}
+
+image reference_convolve(image im, image f, int preserve)
+{
+    return reference_convolve_border(im, f, preserve, BORDER_CLAMP, 0);
+}
+
+void test_fft_convolution(){
+    // Bigger than one FFT block in both directions, so tiles and halos count.
+    image im = make_image(3, 300, 520);
+    image f1 = make_image(1, 9, 7);
+    image f3 = make_image(3, 5, 11);
+    int i, preserve;
+    srand(7);
+    for(i = 0; i < im.c*im.h*im.w; ++i) im.data[i] = rand()/(float)RAND_MAX;
+    for(i = 0; i < f1.h*f1.w; ++i) f1.data[i] = rand()/(float)RAND_MAX - .5;
+    for(i = 0; i < f3.c*f3.h*f3.w; ++i) f3.data[i] = rand()/(float)RAND_MAX - .5;
+    for(preserve = 0; preserve < 2; ++preserve){
+        image a = convolve_image_fft(im, f1, preserve);
+        image b = reference_convolve(im, f1, preserve);
+        image c = convolve_image_fft(im, f3, preserve);
+        image d = reference_convolve(im, f3, preserve);
+        TEST(same_image(a, b, 1e-3) && same_image(c, d, 1e-3));
+        free_image(a); free_image(b); free_image(c); free_image(d);
+    }
+
+    image big = make_gaussian_filter(10);
+    image small = make_box_filter(3);
+    TEST(use_fft_convolution(im, big) && !use_fft_convolution(im, small));
+    free_image(im);
+    free_image(f1);
+    free_image(f3);
+    free_image(big);
+    free_image(small);
+}
+
+// Copies of an image in a 3x3 grid, the neighbors of the middle one are
+// what a wrapped border reads.
+image tile_image3(image im)
+{
+    image t = make_image(im.c, 3*im.h, 3*im.w);
+    int c, y, x;
+    for(c = 0; c < t.c; ++c){
+        for(y = 0; y < t.h; ++y){
+            for(x = 0; x < t.w; ++x){
+                t.data[(c*t.h + y)*t.w + x] = im.data[(c*im.h + y%im.h)*im.w + x%im.w];
+            }
+        }
+    }
+    return t;
+}
+
+// Whether a is the middle ninth of a 3x3 tiled result, within eps.
+int same_middle(image a, image big, float eps)
+{
+    int c, y, x;
+    for(c = 0; c < a.c; ++c){
+        for(y = 0; y < a.h; ++y){
+            for(x = 0; x < a.w; ++x){
+                float v = big.data[(c*big.h + y + a.h)*big.w + x + a.w];
+                if(fabs(a.data[(c*a.h + y)*a.w + x] - v) > eps) return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+void test_border_modes(){
+    int coords[] = {-3, -1, 0, 4, 5, 7, 12};
+    int expect[4][7] = {{0, 0, 0, 4, 4, 4, 4},
+                        {3, 1, 0, 4, 3, 1, 4},
+                        {2, 4, 0, 4, 0, 2, 2},
+                        {-1, -1, 0, 4, -1, -1, -1}};
+    int b, i, same = 1;
+    for(b = 0; b < 4; ++b){
+        for(i = 0; i < 7; ++i) same &= border_index(coords[i], 5, (BORDER)b) == expect[b][i];
+    }
+    TEST(same);
+
+    image im = make_image(3, 23, 37);
+    image f = make_image(1, 5, 3);
+    image big = make_gaussian_filter(3);
+    srand(11);
+    for(i = 0; i < im.c*im.h*im.w; ++i) im.data[i] = rand()/(float)RAND_MAX;
+    for(i = 0; i < f.h*f.w; ++i) f.data[i] = rand()/(float)RAND_MAX - .5;
+    int direct = 1, fft = 1;
+    for(b = 0; b < 4; ++b){
+        image a = convolve_image_border(im, f, 1, (BORDER)b, .3);
+        image e = reference_convolve_border(im, f, 1, (BORDER)b, .3);
+        image c = convolve_image_fft_border(im, big, 0, (BORDER)b, .3);
+        image d = reference_convolve_border(im, big, 0, (BORDER)b, .3);
+        direct &= same_image(a, e, 1e-4);
+        fft &= same_image(c, d, 1e-3);
+        free_image(a); free_image(e); free_image(c); free_image(d);
+    }
+    TEST(direct && fft);
+
+    image tiled = tile_image3(im);
+    image wrapped = resize_image_border(im, 31, 50, LANCZOS3, BORDER_WRAP, 0);
+    image expect_wrap = resize_image(tiled, 93, 150, LANCZOS3);
+    TEST(same_middle(wrapped, expect_wrap, 1e-4));
+
+    image flat = make_image(1, 10, 10);
+    for(i = 0; i < flat.h*flat.w; ++i) flat.data[i] = .5;
+    image up = resize_image_border(flat, 25, 17, BILINEAR, BORDER_CONSTANT, .5);
+    image dark = resize_image_border(flat, 25, 17, BILINEAR, BORDER_CONSTANT, 0);
+    int flat_same = 1;
+    for(i = 0; i < up.h*up.w; ++i) flat_same &= within_eps(up.data[i], .5, 1e-5);
+    TEST(flat_same && dark.data[0] < .4 && within_eps(dark.data[12*dark.w + 8], .5, 1e-5));
+
+    image r = make_image(1, im.h, im.w);
+    memcpy(r.data, im.data, im.h*im.w*sizeof(float));
+    image rt = tile_image3(r);
+    image nw = nms_image_border(r, 3, BORDER_WRAP, 0);
+    image nt = nms_image(rt, 3);
+    image nr = nms_image_border(r, 3, BORDER_REFLECT, 0);
+    image nc = nms_image(r, 3);
+    image nk = nms_image_border(r, 3, BORDER_CONSTANT, 2);
+    int edge = 1;
+    for(i = 0; i < r.h*r.w; ++i){
+        int y = i/r.w, x = i%r.w;
+        if(y < 3 || x < 3 || y >= r.h - 3 || x >= r.w - 3) edge &= nk.data[i] == -999999;
+    }
+    TEST(same_middle(nw, nt, 0) && same_image(nr, nc, 1e-6) && edge);
+
+    free_image(im); free_image(f); free_image(big); free_image(tiled);
+    free_image(wrapped); free_image(expect_wrap); free_image(flat);
+    free_image(up); free_image(dark); free_image(r); free_image(rt);
+    free_image(nw); free_image(nt); free_image(nr); free_image(nc); free_image(nk);
+}
+
 void test_gaussian_filter(){
     image f = make_gaussian_filter(7);
     int i;
@@ -528,6 +1049,37 @@ void test_sobel(){
     free(res);
 }
 
+void test_sobel_fused(){
+    image im = load_image("data/dog.jpg");
+    image gx = make_gx_filter();
+    image gy = make_gy_filter();
+    image Gx = convolve_image(im, gx, 0);
+    image Gy = convolve_image(im, gy, 0);
+    image *res = sobel_image(im);
+    int i, close = 1;
+    for(i = 0; i < im.h*im.w; ++i){
+        float x = Gx.data[i], y = Gy.data[i];
+        float m = sqrtf(x*x + y*y);
+        close &= within_eps(res[0].data[i], m, 1e-4*MAX(m, 1));
+        // Orientation of tiny gradients is mostly rounding, and it wraps at pi.
+        if(m > .1 && fabs(fabs(atan2f(y, x)) - M_PI) > 1e-3){
+            close &= within_eps(res[1].data[i], atan2f(y, x), 1e-4);
+        }
+    }
+    TEST(close);
+
+    sobel_context s = make_sobel_context();
+    image color = colorize_sobel(im);
+    image first = colorize_sobel_next(&s, im);
+    image second = colorize_sobel_next(&s, im);
+    TEST(s.frames == 2 && same_image(first, second, 1e-4));
+    TEST(same_image(color, first, 1e-3));
+
+    free_image(im); free_image(gx); free_image(gy); free_image(Gx); free_image(Gy);
+    free_image(res[0]); free_image(res[1]); free(res);
+    free_image(color); free_image(first); free_image(second);
+}
+
 void test_structure()
 {
     image im = load_image("data/dogbw.png");
@@ -555,6 +1107,318 @@ void test_cornerness()
 }
 
 
+void test_harris_response()
+{
+    image im = load_image("data/dog.jpg");
+    float sigmas[] = {1, 2, 3.4};
+    int k, i;
+    for(k = 0; k < 3; ++k){
+        image S = structure_matrix(im, sigmas[k]);
+        image expect = cornerness_response(S);
+        image R = harris_response(im, sigmas[k]);
+        float scale = 0;
+        for(i = 0; i < R.h*R.w; ++i) scale = MAX(scale, fabs(expect.data[i]));
+        int close = 1;
+        for(i = 0; i < R.h*R.w; ++i) close &= fabs(R.data[i] - expect.data[i]) < 1e-4*scale;
+        TEST(close);
+        free_image(S);
+        free_image(expect);
+        free_image(R);
+    }
+    free_image(im);
+}
+
+void test_recursive_gaussian()
+{
+    image im = load_image("data/dog.jpg");
+    float sigmas[] = {1, 2.5, 8};
+    int k, i;
+    for(k = 0; k < 3; ++k){
+        image expect = smooth_image(im, sigmas[k]);
+        image s = smooth_image_mode(im, sigmas[k], SMOOTH_RECURSIVE);
+        float err = 0;
+        for(i = 0; i < im.c*im.h*im.w; ++i) err += fabs(s.data[i] - expect.data[i]);
+        err /= im.c*im.h*im.w;
+        TEST(err < .005);
+        free_image(expect);
+        free_image(s);
+    }
+
+    // Clamped borders, a constant image stays constant.
+    image flat = make_image(1, 40, 150);
+    for(i = 0; i < flat.h*flat.w; ++i) flat.data[i] = .7;
+    image s = recursive_gaussian(flat, 30);
+    TEST(same_image(s, flat, 1e-4));
+    free_image(flat);
+    free_image(s);
+    free_image(im);
+}
+
+void test_nms()
+{
+    // Coarse random values so there are plenty of ties, odd sizes so the
+    // windows hit the borders unevenly.
+    image im = make_image(2, 61, 300);
+    int i, c, y, x, dy, dx;
+    srand(3);
+    for(i = 0; i < im.c*im.h*im.w; ++i) im.data[i] = rand()%16;
+    int ws[] = {0, 1, 3, 40};
+    int k, same = 1;
+    for(k = 0; k < 4; ++k){
+        int w = ws[k];
+        image r = nms_image(im, w);
+        for(c = 0; c < im.c; ++c){
+            for(y = 0; y < im.h; ++y){
+                for(x = 0; x < im.w; ++x){
+                    float v = get_pixel(im, c, y, x);
+                    float expect = v;
+                    for(dy = -w; dy <= w; ++dy){
+                        for(dx = -w; dx <= w; ++dx){
+                            if(get_pixel(im, c, y+dy, x+dx) > v) expect = -999999;
+                        }
+                    }
+                    same &= get_pixel(r, c, y, x) == expect;
+                }
+            }
+        }
+        free_image(r);
+    }
+    TEST(same);
+
+    image g = make_image(1, im.h, im.w);
+    memcpy(g.data, im.data, g.h*g.w*sizeof(float));
+    image r = nms_image(g, 3);
+    int n = 0, count = 0;
+    int *idx = nms_maxima(g, 3, 10, &n);
+    for(i = 0; i < g.h*g.w; ++i){
+        if(r.data[i] > 10){
+            same &= count < n && idx[count] == i;
+            ++count;
+        }
+    }
+    TEST(same && count == n);
+    free(idx);
+    free_image(im);
+    free_image(g);
+    free_image(r);
+}
+
+void test_harris_topk()
+{
+    image im = load_image("data/dogbw.png");
+    int n = 0, k = 0;
+    descriptor *all = harris_corner_detector(im, 2, .05, 3, &n);
+    descriptor *top = harris_corner_detector_topk(im, 2, .05, 3, 40, 1, &k);
+    TEST(n > 40 && k == 40);
+
+    // The k kept are a subset of all corners and none left out is stronger.
+    image R = harris_response(im, 2);
+    int i, j;
+    int subset = 1;
+    float weakest = get_pixel(R, 0, top[k-1].p.y, top[k-1].p.x);
+    for(i = 0; i < k; ++i){
+        for(j = 0; j < n && (top[i].p.x != all[j].p.x || top[i].p.y != all[j].p.y); ++j);
+        subset &= j < n;
+        if(i) subset &= get_pixel(R, 0, top[i].p.y, top[i].p.x) <= get_pixel(R, 0, top[i-1].p.y, top[i-1].p.x);
+    }
+    TEST(subset);
+    int stronger = 0;
+    for(j = 0; j < n; ++j) stronger += get_pixel(R, 0, all[j].p.y, all[j].p.x) > weakest;
+    TEST(stronger < k);
+
+    // With a 4x4 grid no cell keeps more than ceil(40/16) = 3 corners.
+    int g = 0;
+    descriptor *grid = harris_corner_detector_topk(im, 2, .05, 3, 40, 4, &g);
+    int counts[16] = {0};
+    int most = 0;
+    for(i = 0; i < g; ++i){
+        int cell = (int)grid[i].p.y*4/im.h*4 + (int)grid[i].p.x*4/im.w;
+        ++counts[cell];
+        most = MAX(most, counts[cell]);
+    }
+    TEST(g > 0 && g <= 40 && most <= 3);
+
+    free_descriptors(all, n);
+    free_descriptors(top, k);
+    free_descriptors(grid, g);
+    free_image(im);
+    free_image(R);
+}
+
+// Fraction of the best matches that land within 2 pixels of where the
+// known transform puts them, x' = x*ax + y*bx + cx, y' = x*ay + y*by + cy.
+float good_match_fraction(match *m, int n, float ax, float bx, float cx, float ay, float by, float cy)
+{
+    int i, good = 0;
+    for(i = 0; i < n; ++i){
+        float x = m[i].p.x*ax + m[i].p.y*bx + cx;
+        float y = m[i].p.x*ay + m[i].p.y*by + cy;
+        good += fabs(x - m[i].q.x) <= 2 && fabs(y - m[i].q.y) <= 2;
+    }
+    return n ? (float)good/n : 0;
+}
+
+void test_orb()
+{
+    unsigned long long x[4] = {0, ~0ULL, 5, 1ULL << 63};
+    unsigned long long y[4] = {1, ~0ULL, 6, 0};
+    TEST(hamming_distance(x, y, 256) == 4);
+
+    image im = load_image("data/dog.jpg");
+    // Shifted and rotated 90 degrees clockwise copies.
+    image shift = make_image(im.c, im.h - 20, im.w - 30);
+    image rot = make_image(im.c, im.w, im.h);
+    int c, i, j;
+    for(c = 0; c < im.c; ++c){
+        for(i = 0; i < shift.h; ++i){
+            for(j = 0; j < shift.w; ++j) set_pixel(shift, c, i, j, get_pixel(im, c, i + 20, j + 30));
+        }
+        for(i = 0; i < rot.h; ++i){
+            for(j = 0; j < rot.w; ++j) set_pixel(rot, c, i, j, get_pixel(im, c, im.h - 1 - j, i));
+        }
+    }
+    int an = 0, sn = 0, rn = 0, mn = 0;
+    descriptor *a = orb_detector(im, .06, 3, 500, &an);
+    descriptor *s = orb_detector(shift, .06, 3, 500, &sn);
+    descriptor *r = orb_detector(rot, .06, 3, 500, &rn);
+    TEST(an > 100 && an <= 500 && a[0].n == 256 && a[0].bits && !a[0].data);
+
+    match *m = match_descriptors(a, an, s, sn, &mn);
+    TEST(good_match_fraction(m, MIN(mn, 50), 1, 0, -30, 0, 1, -20) > .8);
+    free(m);
+    m = match_descriptors(a, an, r, rn, &mn);
+    TEST(good_match_fraction(m, MIN(mn, 50), 0, -1, im.h - 1, 1, 0, 0) > .6);
+    free(m);
+
+    free_descriptors(a, an);
+    free_descriptors(s, sn);
+    free_descriptors(r, rn);
+    free_image(im);
+    free_image(shift);
+    free_image(rot);
+}
+
+void test_blend_images()
+{
+    // Two overlapping crops of one image stitch back into it in every mode.
+    image im = load_image("data/dog.jpg");
+    image a = make_image(im.c, im.h, 420);
+    image b = make_image(im.c, im.h, im.w - 300);
+    int k, y, x;
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < im.h; ++y){
+            memcpy(a.data + (k*a.h + y)*a.w, im.data + (k*im.h + y)*im.w, a.w*sizeof(float));
+            memcpy(b.data + (k*b.h + y)*b.w, im.data + (k*im.h + y)*im.w + 300, b.w*sizeof(float));
+        }
+    }
+    matrix H = make_translation_homography(-300, 0);
+    BLEND modes[] = {BLEND_NONE, BLEND_FEATHER, BLEND_MULTIBAND};
+    int m;
+    for(m = 0; m < 3; ++m){
+        // The canvas ends at b's last pixel center, like combine_images.
+        image c = combine_images_blend(a, b, H, modes[m], 5);
+        float err = 0;
+        for(k = 0; k < c.c; ++k){
+            for(y = 0; y < c.h; ++y){
+                for(x = 0; x < c.w; ++x){
+                    err = MAX(err, fabs(c.data[(k*c.h + y)*c.w + x] - im.data[(k*im.h + y)*im.w + x]));
+                }
+            }
+        }
+        TEST(c.w == im.w - 1 && c.h == im.h && err < 1e-4);
+        free_image(c);
+    }
+
+    // With b brighter the seam is a step unless it is blended. Rows near
+    // the top and bottom have little room to feather, so they're left out.
+    shift_image(b, 0, .2);
+    float step[3];
+    for(m = 0; m < 3; ++m){
+        image c = combine_images_blend(a, b, H, modes[m], 5);
+        step[m] = 0;
+        for(y = 32; y < im.h - 32; ++y){
+            for(x = 250; x < 470; ++x){
+                float d0 = c.data[y*c.w + x] - im.data[y*im.w + x];
+                float d1 = c.data[y*c.w + x + 1] - im.data[y*im.w + x + 1];
+                step[m] = MAX(step[m], fabs(d1 - d0));
+            }
+        }
+        free_image(c);
+    }
+    TEST(step[0] > .15 && step[1] < .02 && step[2] < .05);
+
+    free_matrix(H);
+    free_image(im);
+    free_image(a);
+    free_image(b);
+}
+
+// Straightforward cylindrical or spherical projection for checking tables.
+image reference_project(image im, float f, int spherical)
+{
+    image out = make_image(im.c, im.h, im.w);
+    int xc = im.w/2, yc = im.h/2;
+    int k, y, x;
+    for(y = 0; y < im.h; ++y){
+        for(x = 0; x < im.w; ++x){
+            double t = (x - xc)/(double)f, p = (y - yc)/(double)f;
+            double X = sin(t), Y = p, Z = cos(t);
+            if(spherical){
+                X = sin(t)*cos(p);
+                Y = sin(p);
+                Z = cos(t)*cos(p);
+            }
+            double sx = f*X/Z + xc, sy = f*Y/Z + yc;
+            if(Z <= 0 || sx < 0 || sy < 0 || sx > im.w - 1 || sy > im.h - 1) continue;
+            int x0 = floor(sx), y0 = floor(sy);
+            int x1 = MIN(x0 + 1, im.w - 1), y1 = MIN(y0 + 1, im.h - 1);
+            float a = sx - x0, b = sy - y0;
+            for(k = 0; k < im.c; ++k){
+                float top = (1-a)*get_pixel(im, k, y0, x0) + a*get_pixel(im, k, y0, x1);
+                float bot = (1-a)*get_pixel(im, k, y1, x0) + a*get_pixel(im, k, y1, x1);
+                set_pixel(out, k, y, x, (1-b)*top + b*bot);
+            }
+        }
+    }
+    return out;
+}
+
+void test_project_image()
+{
+    image im = load_image("data/Rainier1.png");
+    int s;
+    for(s = 0; s < 2; ++s){
+        image ref = reference_project(im, 500, s);
+        image p = s ? spherical_project(im, 500) : cylindrical_project(im, 500);
+        image q = project_image(im, 500, s ? PROJECT_SPHERICAL : PROJECT_CYLINDRICAL, 1);
+        TEST(same_image(p, ref, 1e-4));
+        TEST(same_image(q, ref, .01));
+        free_image(ref);
+        free_image(p);
+        free_image(q);
+    }
+
+    // The center column of a cylinder is the original column.
+    image c = cylindrical_project(im, 300);
+    int k, y, same = 1;
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < im.h; ++y){
+            same &= get_pixel(c, k, y, im.w/2) == get_pixel(im, k, y, im.w/2);
+        }
+    }
+    TEST(same);
+    free_image(c);
+
+    // Frames of one size and focal length share a table.
+    remap_plan *a = get_remap_plan(im.h, im.w, 300, PROJECT_CYLINDRICAL, 0);
+    remap_plan *b = get_remap_plan(im.h, im.w, 300, PROJECT_CYLINDRICAL, 0);
+    remap_plan *d = get_remap_plan(im.h, im.w, 300, PROJECT_CYLINDRICAL, 1);
+    TEST(a == b && a != d);
+    release_remap_plan(a);
+    release_remap_plan(b);
+    release_remap_plan(d);
+    free_image(im);
+}
 
 void test_projection()
 {
@@ -613,6 +1477,97 @@ void test_compute_homography()
     free(m);
 }
 
+void test_tiled_image()
+{
+    image a = load_image("data/dog.jpg");
+    size_t budget = 4*3*64*64*sizeof(float);
+    tiled_image t = image_to_tiled(a, "data/test_tiled_a.tile", 64, TILE_DEFLATE, budget);
+    close_tiled_image(t);
+    t = open_tiled_image("data/test_tiled_a.tile", budget);
+    image back = tiled_to_image(t);
+    TEST(!memcmp(back.data, a.data, (size_t)a.c*a.h*a.w*sizeof(float)));
+    image halo = load_tiled_region(t, -5, a.w - 20, 30, 40);
+    TEST(get_pixel(halo, 1, 0, 39) == get_pixel(a, 1, 0, a.w - 1));
+    TEST(get_pixel(halo, 2, 29, 3) == get_pixel(a, 2, 24, a.w - 17));
+
+    image f = make_gaussian_filter(2);
+    image blur = convolve_image(a, f, 1);
+    tiled_image tblur = convolve_tiled_image(t, f, 1, "data/test_tiled_blur.tile", budget);
+    image blur_back = tiled_to_image(tblur);
+    TEST(same_image(blur_back, blur, EPS));
+
+    // b sits 60 px right of and 25 px above a, b's pixels win where they overlap.
+    image b = copy_image(a);
+    adjust_hsv(b, .5, 1, 1);
+    tiled_image tb = image_to_tiled(b, "data/test_tiled_b.tile", 64, TILE_RAW, budget);
+    matrix H = make_translation_homography(-60, 25);
+    tiled_image tc = combine_tiled_images(t, tb, H, "data/test_tiled_c.tile", budget);
+    image comb = tiled_to_image(tc);
+    TEST(comb.w == a.w + 59 && comb.h == a.h + 25);
+    image expect = make_image(a.c, comb.h, comb.w);
+    int i, j, k;
+    for(k = 0; k < a.c; ++k){
+        for(j = 0; j < comb.h; ++j){
+            for(i = 0; i < comb.w; ++i){
+                int ay = j - 25, bx = i - 60;
+                if(bx >= 0 && bx < b.w && j < b.h) set_pixel(expect, k, j, i, get_pixel(b, k, j, bx));
+                else if(ay >= 0 && ay < a.h && i < a.w) set_pixel(expect, k, j, i, get_pixel(a, k, ay, i));
+            }
+        }
+    }
+    TEST(same_image(comb, expect, EPS));
+
+    // Noise doesn't deflate, the tile falls back to raw storage.
+    image noise = make_image(1, 64, 64);
+    unsigned int state = 7;
+    for(i = 0; i < noise.h*noise.w; ++i){
+        state = state*1103515245 + 12345;
+        memcpy(noise.data + i, &state, sizeof(float));
+        if(!isfinite(noise.data[i])) noise.data[i] = 0;
+    }
+    tiled_image tn = image_to_tiled(noise, "data/test_tiled_n.tile", 64, TILE_DEFLATE, budget);
+    close_tiled_image(tn);
+    tn = open_tiled_image("data/test_tiled_n.tile", budget);
+    image noise_back = tiled_to_image(tn);
+    TEST(!memcmp(noise_back.data, noise.data, (size_t)noise.h*noise.w*sizeof(float)));
+    close_tiled_image(tn);
+
+    // A slot whose size or offset is out of range makes the file unreadable,
+    // and the table is left as it was. The one slot's offset and size sit
+    // after the 36 byte header.
+    int64_t corrupt[2][2] = {{1LL << 40, 44}, {1LL << 40, 36}};
+    for(i = 0; i < 2; ++i){
+        FILE *fp = fopen("data/test_tiled_n.tile", "r+b");
+        int64_t saved;
+        fseek(fp, corrupt[i][1], SEEK_SET);
+        TEST(fread(&saved, sizeof(saved), 1, fp) == 1);
+        fseek(fp, corrupt[i][1], SEEK_SET);
+        fwrite(&corrupt[i][0], sizeof(int64_t), 1, fp);
+        fclose(fp);
+        tiled_image bad = open_tiled_image("data/test_tiled_n.tile", budget);
+        TEST(bad.store == 0);
+        int64_t after = 0;
+        fp = fopen("data/test_tiled_n.tile", "r+b");
+        fseek(fp, corrupt[i][1], SEEK_SET);
+        TEST(fread(&after, sizeof(after), 1, fp) == 1 && after == corrupt[i][0]);
+        fseek(fp, corrupt[i][1], SEEK_SET);
+        fwrite(&saved, sizeof(saved), 1, fp);
+        fclose(fp);
+    }
+    tn = open_tiled_image("data/test_tiled_n.tile", budget);
+    TEST(tn.store != 0);
+    close_tiled_image(tn);
+    remove("data/test_tiled_n.tile");
+    free_image(noise); free_image(noise_back);
+
+    close_tiled_image(t); close_tiled_image(tblur); close_tiled_image(tb); close_tiled_image(tc);
+    remove("data/test_tiled_a.tile"); remove("data/test_tiled_blur.tile");
+    remove("data/test_tiled_b.tile"); remove("data/test_tiled_c.tile");
+    free_matrix(H);
+    free_image(a); free_image(back); free_image(halo); free_image(f); free_image(blur);
+    free_image(blur_back); free_image(b); free_image(comb); free_image(expect);
+}
+
 void test_activate_matrix()
 {
     matrix a = load_matrix("data/test/a.matrix");
@@ -732,6 +1687,177 @@ void test_layer()
     free_matrix(dx);
 }
 
+void test_evaluate_model()
+{
+    matrix a = load_matrix("data/test/a.matrix");
+    matrix w = load_matrix("data/test/w.matrix");
+    layer l = make_layer(64, 16, SOFTMAX);
+    free_matrix(l.w);
+    l.w = w;
+    model m = {&l, 1};
+
+    data d;
+    d.X = a;
+    d.y = make_matrix(a.rows, w.cols);
+    int i, j;
+    for(i = 0; i < d.y.rows; ++i) d.y.data[i][i%d.y.cols] = 1;
+
+    matrix p = matrix_mult_matrix(a, w);
+    activate_matrix(p, SOFTMAX);
+    int correct = 0;
+    for(i = 0; i < p.rows; ++i){
+        int best = 0;
+        for(j = 1; j < p.cols; ++j) if(p.data[i][j] > p.data[i][best]) best = j;
+        if(best == i%d.y.cols) ++correct;
+    }
+
+    evaluation e = evaluate_model(m, d, 5);
+    TEST(within_eps(e.accuracy, (double)correct/a.rows, EPS));
+    double total = 0, diag = 0;
+    for(i = 0; i < e.confusion.rows; ++i){
+        for(j = 0; j < e.confusion.cols; ++j) total += e.confusion.data[i][j];
+        diag += e.confusion.data[i][i];
+    }
+    TEST(within_eps(total, a.rows, EPS));
+    TEST(within_eps(diag, correct, EPS));
+    TEST(within_eps(accuracy_model(m, d), e.accuracy, EPS));
+
+    free_evaluation(e);
+    free_matrix(p);
+    free_data(d);
+    free_matrix(l.w);
+    free_matrix(l.dw);
+    free_matrix(l.v);
+    free_matrix(l.in);
+    free_matrix(l.out);
+}
+
+void test_quantized_model()
+{
+    srand(2);
+    matrix a = load_matrix("data/test/a.matrix");
+    layer l[2] = {make_layer(64, 32, RELU), make_layer(32, 16, LINEAR)};
+    model m = {l, 2};
+    matrix p = matrix_mult_matrix(a, l[0].w);
+    activate_matrix(p, RELU);
+    matrix truth = matrix_mult_matrix(p, l[1].w);
+
+    quantized_model q = quantize_model(m);
+    matrix qp = forward_quantized_model(q, a);
+    double err = 0, mag = 0;
+    int i, j;
+    for(i = 0; i < truth.rows; ++i){
+        for(j = 0; j < truth.cols; ++j){
+            err = MAX(err, fabs(truth.data[i][j] - qp.data[i][j]));
+            mag = MAX(mag, fabs(truth.data[i][j]));
+        }
+    }
+    TEST(err < .05*mag);
+
+    save_quantized_model(q, "data/test/quantized.model");
+    quantized_model loaded = load_quantized_model("data/test/quantized.model");
+    remove("data/test/quantized.model");
+    TEST(loaded.n == 2);
+    matrix lp = forward_quantized_model(loaded, a);
+    TEST(same_matrix(qp, lp));
+
+    // Layers whose sizes don't chain, or whose weights would run past the
+    // end of the file, are rejected. The second layer's inputs sit after
+    // the 12 byte header and the first layer's 12 byte fields, 32 scales
+    // and 64*32 weights.
+    long second = 12 + 12 + 32*sizeof(float) + 64*32;
+    int bad[2] = {31, 1 << 30};
+    for(i = 0; i < 2; ++i){
+        save_quantized_model(q, "data/test/quantized.model");
+        FILE *fp = fopen("data/test/quantized.model", "r+b");
+        fseek(fp, i ? second + 4 : second, SEEK_SET);
+        fwrite(bad + i, sizeof(int), 1, fp);
+        fclose(fp);
+        quantized_model corrupt = load_quantized_model("data/test/quantized.model");
+        TEST(corrupt.n == 0 && corrupt.layers == 0);
+    }
+    remove("data/test/quantized.model");
+
+    // Softmax over logits far too big for expf stays a distribution.
+    q.layers[1].activation = SOFTMAX;
+    for(j = 0; j < q.layers[1].outputs; ++j) q.layers[1].scale[j] *= 1e4;
+    matrix sp = forward_quantized_model(q, a);
+    int ok = 1;
+    for(i = 0; i < sp.rows; ++i){
+        double sum = 0;
+        for(j = 0; j < sp.cols; ++j) sum += sp.data[i][j];
+        ok &= within_eps(sum, 1, 1e-4);
+    }
+    TEST(ok);
+    free_matrix(sp);
+
+    free_quantized_model(q);
+    free_quantized_model(loaded);
+    free_matrix(a);
+    free_matrix(p);
+    free_matrix(truth);
+    free_matrix(qp);
+    free_matrix(lp);
+    for(i = 0; i < 2; ++i){
+        free_matrix(l[i].w);
+        free_matrix(l[i].dw);
+        free_matrix(l[i].v);
+        free_matrix(l[i].in);
+        free_matrix(l[i].out);
+    }
+}
+
+void test_model_checkpoint()
+{
+    srand(3);
+    model m;
+    m.n = 2;
+    m.layers = calloc(m.n, sizeof(layer));
+    m.layers[0] = make_layer(64, 7, LRELU);
+    m.layers[1] = make_layer(7, 16, SOFTMAX);
+    TEST(save_model(m, "data/test/checkpoint.model"));
+
+    model loaded = load_model("data/test/checkpoint.model");
+    remove("data/test/checkpoint.model");
+    TEST(loaded.n == m.n);
+    if(loaded.n != m.n) return;
+    int i;
+    for(i = 0; i < m.n; ++i){
+        TEST(loaded.layers[i].activation == m.layers[i].activation);
+        TEST(same_matrix(loaded.layers[i].w, m.layers[i].w));
+        TEST(((size_t)loaded.layers[i].w.data[0] & 63) == 0);
+    }
+
+    matrix a = load_matrix("data/test/a.matrix");
+    data d = {a, make_matrix(a.rows, 16)};
+    for(i = 0; i < a.rows; ++i) d.y.data[i][i%16] = 1;
+    TEST(within_eps(accuracy_model(loaded, d), accuracy_model(m, d), EPS));
+
+    // A weight offset pointing before the layer table is rejected. The
+    // first table entry's offset sits after the 24 byte header and the
+    // entry's four int32 fields.
+    TEST(save_model(m, "data/test/checkpoint.model"));
+    FILE *fp = fopen("data/test/checkpoint.model", "r+b");
+    int64_t bad = -64;
+    fseek(fp, 24 + 16, SEEK_SET);
+    fwrite(&bad, sizeof(bad), 1, fp);
+    fclose(fp);
+    model corrupt = load_model("data/test/checkpoint.model");
+    remove("data/test/checkpoint.model");
+    TEST(corrupt.n == 0);
+
+    // Models are freed after running them, while layer inputs still point
+    // at a freed input or batch.
+    matrix X = copy_matrix(a);
+    forward_model(loaded, X);
+    free_matrix(X);
+    train_model(m, d, 8, 2, .01, .9, .0005);
+
+    free_data(d);
+    free_model(m);
+    free_model(loaded);
+}
+
 void make_matrix_test()
 {
     srand(1);
@@ -812,6 +1938,19 @@ void test_hw0()
     test_grayscale();
     test_rgb_to_hsv();
     test_hsv_to_rgb();
+    test_adjust_hsv();
+    test_compact_images();
+    test_interleaved_pipeline();
+    test_binary_image();
+    printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
+}
+// The batch and bench subcommands and the profiler, which print their own
+// reports.
+void test_tools()
+{
+    test_batch();
+    test_bench();
+    test_instrument();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw1()
@@ -821,6 +1960,8 @@ void test_hw1()
     test_bl_interpolate();
     test_bl_resize();
     test_multiple_resize();
+    test_resize_any_channels();
+    test_downscale_modes();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw2()
@@ -830,18 +1971,29 @@ void test_hw2()
     test_emboss_filter();
     test_highpass_filter();
     test_convolution();
+    test_fft_convolution();
+    test_border_modes();
     test_gaussian_blur();
     test_hybrid_image();
     test_frequency_image();
     test_sobel();
+    test_sobel_fused();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw3()
 {
     test_structure();
     test_cornerness();
+    test_harris_response();
+    test_recursive_gaussian();
+    test_nms();
+    test_harris_topk();
+    test_orb();
     test_projection();
     test_compute_homography();
+    test_tiled_image();
+    test_blend_images();
+    test_project_image();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void make_hw4_tests()
@@ -946,6 +2098,26 @@ void test_velocity_image()
     free_image(velocity);
     free_image(velocity_t);
 }
+void test_flow_context()
+{
+    image doga = load_image("data/dog_a_small.jpg");
+    image dogb = load_image("data/dog_b_small.jpg");
+    flow_context f = make_flow_context(15, 5);
+    image v0 = optical_flow_next(&f, doga);
+    image v1 = optical_flow_next(&f, dogb);
+    image expect = optical_flow_images(dogb, doga, 15, 5);
+    image zero = make_image(v0.c, v0.h, v0.w);
+    TEST(v0.c == 3 && v0.h == expect.h && v0.w == expect.w);
+    TEST(!memcmp(v0.data, zero.data, (size_t)v0.c*v0.h*v0.w*sizeof(float)));
+    TEST(!memcmp(v1.data, expect.data, (size_t)v1.c*v1.h*v1.w*sizeof(float)));
+    free_flow_context(f);
+    free_image(doga);
+    free_image(dogb);
+    free_image(v0);
+    free_image(v1);
+    free_image(expect);
+    free_image(zero);
+}
 void test_hw4()
 {
     test_integral_image();
@@ -953,6 +2125,7 @@ void test_hw4()
     test_good_enough_box_filter_image();
     test_structure_image();
     test_velocity_image();
+    test_flow_context();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw5()
@@ -960,6 +2133,9 @@ void test_hw5()
     test_activate_matrix();
     test_gradient_matrix();
     test_layer();
+    test_evaluate_model();
+    test_quantized_model();
+    test_model_checkpoint();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
@@ -0,0 +1,652 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "matrix.h"
+#include "stb_image.h"
+
+// Defined with the stb_image_write implementation in load_image.c.
+unsigned char *stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality);
+
+// Tiled image file layout, all values in native byte order:
+//
+//   tiled_header
+//   tile_slot[tiles_y*tiles_x], row-major over tiles
+//   tile payloads in the order they were first written
+//
+// Every tile is stored full size, c planes of tile x tile floats, even at
+// the right and bottom edges. A slot with size 0 was never written and
+// reads as zeros, so a fresh canvas costs nothing on disk. Deflated tiles
+// that outgrow their slot on rewrite are appended and the old space is
+// abandoned. A tile that doesn't deflate smaller than its raw size, or
+// can't be compressed at all, is stored raw; in a deflate file a slot whose
+// size is the full raw size always holds raw floats.
+
+#define TILED_MAGIC "UWTILE"
+#define TILED_VERSION 1
+
+typedef struct{
+    char magic[8];
+    int32_t version;
+    int32_t c, h, w;
+    int32_t tile;
+    int32_t compression;
+    int32_t pad;
+} tiled_header;
+
+typedef struct{
+    int64_t offset;
+    int64_t size;           // Bytes used, 0 if never written
+    int64_t capacity;       // Bytes reserved at offset
+} tile_slot;
+
+typedef struct cached_tile{
+    int index;
+    int dirty;
+    float *data;
+    struct cached_tile *prev, *next;
+} cached_tile;
+
+struct tile_store{
+    int fd;
+    TILE_COMPRESSION compression;
+    int tiles_x, tiles_y;
+    size_t tile_floats;
+    tile_slot *slots;
+    int64_t end;            // First free byte of the file
+    cached_tile **lookup;   // Cached tile by index, 0 if not resident
+    cached_tile *head, *tail;   // Most and least recently used
+    int cached, capacity;
+    pthread_mutex_t lock;
+};
+
+static int64_t slots_offset()
+{
+    return sizeof(tiled_header);
+}
+
+// Group the bytes of every float by significance so deflate sees the
+// slowly varying exponents together.
+static void shuffle_floats(const float *src, unsigned char *dst, size_t n)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    size_t i;
+    int b;
+    for(b = 0; b < 4; ++b){
+        for(i = 0; i < n; ++i) dst[b*n + i] = s[i*4 + b];
+    }
+}
+
+static void unshuffle_floats(const unsigned char *src, float *dst, size_t n)
+{
+    unsigned char *d = (unsigned char *)dst;
+    size_t i;
+    int b;
+    for(b = 0; b < 4; ++b){
+        for(i = 0; i < n; ++i) d[i*4 + b] = src[b*n + i];
+    }
+}
+
+static int read_fully(int fd, void *buf, size_t n, int64_t offset)
+{
+    char *p = buf;
+    while(n){
+        ssize_t r = pread(fd, p, n, offset);
+        if(r <= 0) return 0;
+        p += r; n -= r; offset += r;
+    }
+    return 1;
+}
+
+static int write_fully(int fd, const void *buf, size_t n, int64_t offset)
+{
+    const char *p = buf;
+    while(n){
+        ssize_t r = pwrite(fd, p, n, offset);
+        if(r <= 0) return 0;
+        p += r; n -= r; offset += r;
+    }
+    return 1;
+}
+
+static void read_tile(struct tile_store *s, int index, float *data)
+{
+    tile_slot slot = s->slots[index];
+    size_t bytes = s->tile_floats*sizeof(float);
+    if(slot.size == 0){
+        memset(data, 0, bytes);
+        return;
+    }
+    int ok;
+    if(s->compression == TILE_DEFLATE && slot.size != (int64_t)bytes){
+        char *packed = malloc(slot.size);
+        unsigned char *raw = malloc(bytes);
+        ok = read_fully(s->fd, packed, slot.size, slot.offset)
+            && stbi_zlib_decode_buffer((char *)raw, bytes, packed, slot.size) == (int)bytes;
+        if(ok) unshuffle_floats(raw, data, s->tile_floats);
+        free(packed);
+        free(raw);
+    } else {
+        ok = read_fully(s->fd, data, bytes, slot.offset);
+    }
+    if(!ok){
+        fprintf(stderr, "Failed to read tile %d\n", index);
+        memset(data, 0, bytes);
+    }
+}
+
+static void write_tile(struct tile_store *s, int index, const float *data)
+{
+    tile_slot *slot = s->slots + index;
+    size_t bytes = s->tile_floats*sizeof(float);
+    const void *payload = data;
+    unsigned char *packed = 0;
+    int size = bytes;
+    if(s->compression == TILE_DEFLATE){
+        unsigned char *raw = malloc(bytes);
+        shuffle_floats(data, raw, s->tile_floats);
+        packed = stbi_zlib_compress(raw, bytes, &size, 5);
+        free(raw);
+        if(packed && size < (int)bytes){
+            payload = packed;
+        } else {
+            size = bytes;
+        }
+    }
+    if(size > slot->capacity){
+        slot->offset = s->end;
+        slot->capacity = size;
+        s->end += size;
+    }
+    slot->size = size;
+    if(!write_fully(s->fd, payload, size, slot->offset)){
+        fprintf(stderr, "Failed to write tile %d\n", index);
+    }
+    free(packed);
+}
+
+static void unlink_tile(struct tile_store *s, cached_tile *t)
+{
+    if(t->prev) t->prev->next = t->next;
+    else s->head = t->next;
+    if(t->next) t->next->prev = t->prev;
+    else s->tail = t->prev;
+    t->prev = t->next = 0;
+}
+
+static void push_tile(struct tile_store *s, cached_tile *t)
+{
+    t->next = s->head;
+    t->prev = 0;
+    if(s->head) s->head->prev = t;
+    s->head = t;
+    if(!s->tail) s->tail = t;
+}
+
+// Find a tile in the cache or page it in, evicting the least recently
+// used tile when full. Caller holds the lock.
+static cached_tile *get_tile(struct tile_store *s, int index)
+{
+    cached_tile *t = s->lookup[index];
+    if(t){
+        unlink_tile(s, t);
+        push_tile(s, t);
+        return t;
+    }
+    if(s->cached >= s->capacity){
+        t = s->tail;
+        unlink_tile(s, t);
+        if(t->dirty) write_tile(s, t->index, t->data);
+        s->lookup[t->index] = 0;
+    } else {
+        t = calloc(1, sizeof(cached_tile));
+        t->data = malloc(s->tile_floats*sizeof(float));
+        ++s->cached;
+    }
+    t->index = index;
+    t->dirty = 0;
+    read_tile(s, index, t->data);
+    s->lookup[index] = t;
+    push_tile(s, t);
+    return t;
+}
+
+static tiled_image make_tiled(int fd, tiled_header h, size_t cache_bytes)
+{
+    tiled_image t;
+    t.c = h.c;
+    t.h = h.h;
+    t.w = h.w;
+    t.tile = h.tile;
+    struct tile_store *s = calloc(1, sizeof(struct tile_store));
+    s->fd = fd;
+    s->compression = h.compression;
+    s->tiles_x = (h.w + h.tile - 1) / h.tile;
+    s->tiles_y = (h.h + h.tile - 1) / h.tile;
+    s->tile_floats = (size_t)h.c*h.tile*h.tile;
+    int n = s->tiles_x*s->tiles_y;
+    s->slots = calloc(n, sizeof(tile_slot));
+    s->lookup = calloc(n, sizeof(cached_tile *));
+    s->end = slots_offset() + (int64_t)n*sizeof(tile_slot);
+    s->capacity = cache_bytes / (s->tile_floats*sizeof(float));
+    if(s->capacity < 1) s->capacity = 1;
+    pthread_mutex_init(&s->lock, 0);
+    t.store = s;
+    return t;
+}
+
+// Create an empty tiled image on disk, every pixel starts at 0.
+// const char *fname: file to create, overwritten if it exists.
+// int c, h, w: image size.
+// int tile: tile edge in pixels.
+// TILE_COMPRESSION compression: TILE_RAW or TILE_DEFLATE.
+// size_t cache_bytes: memory budget for resident tiles, at least one tile.
+// returns: the image, store = 0 if the file couldn't be created.
+tiled_image make_tiled_image(const char *fname, int c, int h, int w, int tile,
+        TILE_COMPRESSION compression, size_t cache_bytes)
+{
+    assert(c > 0 && h > 0 && w > 0 && tile > 0);
+    tiled_image t = {0};
+    int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return t;
+    }
+    tiled_header header = {{0}};
+    memcpy(header.magic, TILED_MAGIC, sizeof(TILED_MAGIC));
+    header.version = TILED_VERSION;
+    header.c = c;
+    header.h = h;
+    header.w = w;
+    header.tile = tile;
+    header.compression = compression;
+    t = make_tiled(fd, header, cache_bytes);
+    flush_tiled_image(t);
+    return t;
+}
+
+// Release a store without writing anything back.
+static void free_store(struct tile_store *s)
+{
+    cached_tile *c = s->head;
+    while(c){
+        cached_tile *next = c->next;
+        free(c->data);
+        free(c);
+        c = next;
+    }
+    close(s->fd);
+    pthread_mutex_destroy(&s->lock);
+    free(s->slots);
+    free(s->lookup);
+    free(s);
+}
+
+// Check a slot read from a file of the given size. Written slots lie past
+// the table and inside the file, and hold at most one raw tile, which is
+// what write_tile falls back to when deflate doesn't shrink a tile.
+static int valid_slot(const struct tile_store *s, tile_slot slot, int64_t file_size)
+{
+    int64_t bytes = s->tile_floats*sizeof(float);
+    int64_t first = slots_offset() + (int64_t)s->tiles_x*s->tiles_y*sizeof(tile_slot);
+    if(slot.size < 0 || slot.size > slot.capacity || slot.capacity > bytes) return 0;
+    if(s->compression == TILE_RAW && slot.size != 0 && slot.size != bytes) return 0;
+    if(slot.capacity == 0) return 1;
+    return slot.offset >= first && slot.offset <= file_size - slot.capacity;
+}
+
+// Open a tiled image written by make_tiled_image for reading and writing.
+// const char *fname: file to open.
+// size_t cache_bytes: memory budget for resident tiles, at least one tile.
+// returns: the image, store = 0 if the file couldn't be read or its tile
+//          table is corrupt.
+tiled_image open_tiled_image(const char *fname, size_t cache_bytes)
+{
+    tiled_image t = {0};
+    int fd = open(fname, O_RDWR);
+    if(fd < 0){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return t;
+    }
+    struct stat st;
+    tiled_header header;
+    // Tile counts and tile bytes have to fit the ints they are used as.
+    int valid = fstat(fd, &st) == 0
+            && read_fully(fd, &header, sizeof(header), 0)
+            && !memcmp(header.magic, TILED_MAGIC, sizeof(TILED_MAGIC))
+            && header.version == TILED_VERSION
+            && header.c > 0 && header.h > 0 && header.w > 0 && header.tile > 0
+            && (header.compression == TILE_RAW || header.compression == TILE_DEFLATE);
+    if(valid){
+        int64_t tiles = (int64_t)((header.h + (int64_t)header.tile - 1)/header.tile)
+                      * ((header.w + (int64_t)header.tile - 1)/header.tile);
+        valid = tiles <= INT_MAX/(int64_t)sizeof(tile_slot)
+            && (int64_t)header.tile*header.tile <= INT_MAX/(int64_t)sizeof(float)/header.c
+            && slots_offset() + tiles*(int64_t)sizeof(tile_slot) <= (int64_t)st.st_size;
+    }
+    if(!valid){
+        fprintf(stderr, "Not a tiled image: %s\n", fname);
+        close(fd);
+        return t;
+    }
+    t = make_tiled(fd, header, cache_bytes);
+    struct tile_store *s = t.store;
+    int n = s->tiles_x*s->tiles_y;
+    int i;
+    valid = read_fully(fd, s->slots, n*sizeof(tile_slot), slots_offset());
+    for(i = 0; valid && i < n; ++i) valid = valid_slot(s, s->slots[i], st.st_size);
+    if(!valid){
+        fprintf(stderr, "Corrupt tile table: %s\n", fname);
+        free_store(s);
+        t.store = 0;
+        return t;
+    }
+    for(i = 0; i < n; ++i){
+        int64_t end = s->slots[i].offset + s->slots[i].capacity;
+        if(end > s->end) s->end = end;
+    }
+    return t;
+}
+
+// Write dirty tiles and the tile table back to disk. Tiles stay cached.
+// tiled_image t: image to flush.
+void flush_tiled_image(tiled_image t)
+{
+    struct tile_store *s = t.store;
+    pthread_mutex_lock(&s->lock);
+    cached_tile *c;
+    for(c = s->head; c; c = c->next){
+        if(c->dirty) write_tile(s, c->index, c->data);
+        c->dirty = 0;
+    }
+    tiled_header header = {{0}};
+    memcpy(header.magic, TILED_MAGIC, sizeof(TILED_MAGIC));
+    header.version = TILED_VERSION;
+    header.c = t.c;
+    header.h = t.h;
+    header.w = t.w;
+    header.tile = t.tile;
+    header.compression = s->compression;
+    int n = s->tiles_x*s->tiles_y;
+    if(!write_fully(s->fd, &header, sizeof(header), 0)
+            || !write_fully(s->fd, s->slots, n*sizeof(tile_slot), slots_offset())){
+        fprintf(stderr, "Failed to write tiled image header\n");
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Flush a tiled image and release its cache and file.
+// tiled_image t: image to close.
+void close_tiled_image(tiled_image t)
+{
+    struct tile_store *s = t.store;
+    if(!s) return;
+    flush_tiled_image(t);
+    free_store(s);
+}
+
+// Copy the part of a tiled image that lies inside it. Rows y0..y1 and
+// columns x0..x1 must be in bounds.
+static image load_tiled_core(tiled_image t, int y0, int y1, int x0, int x1)
+{
+    struct tile_store *s = t.store;
+    int h = y1 - y0 + 1, w = x1 - x0 + 1;
+    image out = make_image(t.c, h, w);
+    const size_t area = (size_t)t.tile*t.tile;
+    int ty, tx, k, r;
+
+    pthread_mutex_lock(&s->lock);
+    for(ty = y0 / t.tile; ty <= y1 / t.tile; ++ty){
+        for(tx = x0 / t.tile; tx <= x1 / t.tile; ++tx){
+            cached_tile *c = get_tile(s, ty*s->tiles_x + tx);
+            int ry0 = MAX(y0, ty*t.tile), ry1 = MIN(y1, ty*t.tile + t.tile - 1);
+            int rx0 = MAX(x0, tx*t.tile), rx1 = MIN(x1, tx*t.tile + t.tile - 1);
+            for(k = 0; k < t.c; ++k){
+                for(r = ry0; r <= ry1; ++r){
+                    const float *src = c->data + k*area + (size_t)(r - ty*t.tile)*t.tile + (rx0 - tx*t.tile);
+                    float *dst = out.data + ((size_t)k*h + (r - y0))*w + (rx0 - x0);
+                    memcpy(dst, src, (rx1 - rx0 + 1)*sizeof(float));
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return out;
+}
+
+// Read a region of a tiled image. Pixels outside the image clamp to the
+// nearest edge like get_pixel, so regions can carry a halo.
+// tiled_image t: image to read.
+// int y, x: top left corner of the region, may be negative.
+// int h, w: size of the region.
+// returns: the region as a regular image.
+image load_tiled_region(tiled_image t, int y, int x, int h, int w)
+{
+    int y0 = MAX(0, MIN(t.h - 1, y));
+    int y1 = MAX(0, MIN(t.h - 1, y + h - 1));
+    int x0 = MAX(0, MIN(t.w - 1, x));
+    int x1 = MAX(0, MIN(t.w - 1, x + w - 1));
+    image core = load_tiled_core(t, y0, y1, x0, x1);
+    if(y0 == y && x0 == x && core.h == h && core.w == w) return core;
+
+    image out = make_image(t.c, h, w);
+    int k, r, i;
+    for(k = 0; k < t.c; ++k){
+        for(r = 0; r < h; ++r){
+            int sr = MAX(y0, MIN(y1, y + r)) - y0;
+            const float *src = core.data + ((size_t)k*core.h + sr)*core.w;
+            float *dst = out.data + ((size_t)k*h + r)*w;
+            for(i = 0; i < w; ++i){
+                dst[i] = src[MAX(x0, MIN(x1, x + i)) - x0];
+            }
+        }
+    }
+    free_image(core);
+    return out;
+}
+
+// Write an image into a tiled image, clipping anything outside it.
+// tiled_image t: image to write to.
+// image im: pixels to write, must have t.c channels.
+// int y, x: where the top left corner of im goes.
+void store_tiled_region(tiled_image t, image im, int y, int x)
+{
+    assert(im.c == t.c);
+    struct tile_store *s = t.store;
+    int y0 = MAX(0, y), y1 = MIN(t.h, y + im.h) - 1;
+    int x0 = MAX(0, x), x1 = MIN(t.w, x + im.w) - 1;
+    if(y0 > y1 || x0 > x1) return;
+    const size_t area = (size_t)t.tile*t.tile;
+    int ty, tx, k, r;
+
+    pthread_mutex_lock(&s->lock);
+    for(ty = y0 / t.tile; ty <= y1 / t.tile; ++ty){
+        for(tx = x0 / t.tile; tx <= x1 / t.tile; ++tx){
+            cached_tile *c = get_tile(s, ty*s->tiles_x + tx);
+            int ry0 = MAX(y0, ty*t.tile), ry1 = MIN(y1, ty*t.tile + t.tile - 1);
+            int rx0 = MAX(x0, tx*t.tile), rx1 = MIN(x1, tx*t.tile + t.tile - 1);
+            for(k = 0; k < t.c; ++k){
+                for(r = ry0; r <= ry1; ++r){
+                    float *dst = c->data + k*area + (size_t)(r - ty*t.tile)*t.tile + (rx0 - tx*t.tile);
+                    const float *src = im.data + ((size_t)k*im.h + (r - y))*im.w + (rx0 - x);
+                    memcpy(dst, src, (rx1 - rx0 + 1)*sizeof(float));
+                }
+            }
+            c->dirty = 1;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Copy an in-memory image into a new tiled image.
+tiled_image image_to_tiled(image im, const char *fname, int tile,
+        TILE_COMPRESSION compression, size_t cache_bytes)
+{
+    tiled_image t = make_tiled_image(fname, im.c, im.h, im.w, tile, compression, cache_bytes);
+    if(t.store) store_tiled_region(t, im, 0, 0);
+    return t;
+}
+
+// Read a whole tiled image into memory.
+image tiled_to_image(tiled_image t)
+{
+    return load_tiled_region(t, 0, 0, t.h, t.w);
+}
+
+// Convolve a tiled image one output tile at a time. Each tile is read with
+// a halo of half the filter size, so the result matches convolve_image on
+// the whole image while only a few tiles are ever in memory.
+// tiled_image t: image to filter.
+// image filter: filter as in convolve_image.
+// int preserve: as in convolve_image.
+// const char *fname: file for the result, tiled like t.
+// size_t cache_bytes: memory budget of the result's tile cache.
+// returns: filtered tiled image.
+tiled_image convolve_tiled_image(tiled_image t, image filter, int preserve,
+        const char *fname, size_t cache_bytes)
+{
+    struct tile_store *s = t.store;
+    tiled_image out = make_tiled_image(fname, preserve ? t.c : 1, t.h, t.w, t.tile,
+            s->compression, cache_bytes);
+    if(!out.store) return out;
+    int hy = filter.h / 2, hx = filter.w / 2;
+    int n = s->tiles_x*s->tiles_y;
+    int i;
+    #pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < n; ++i){
+        int y = (i / s->tiles_x)*t.tile;
+        int x = (i % s->tiles_x)*t.tile;
+        int h = MIN(t.tile, t.h - y);
+        int w = MIN(t.tile, t.w - x);
+        image in = load_tiled_region(t, y - hy, x - hx, h + 2*hy, w + 2*hx);
+        image full = convolve_image(in, filter, preserve);
+        image crop = make_image(full.c, h, w);
+        int k, r;
+        for(k = 0; k < full.c; ++k){
+            for(r = 0; r < h; ++r){
+                memcpy(crop.data + ((size_t)k*h + r)*w,
+                       full.data + ((size_t)k*full.h + r + hy)*full.w + hx, w*sizeof(float));
+            }
+        }
+        store_tiled_region(out, crop, y, x);
+        free_image(in);
+        free_image(full);
+        free_image(crop);
+    }
+    return out;
+}
+
+// Bilinear sample of channel c at (x, y), clamping at the edges.
+static float sample_bilinear(image im, int c, float x, float y)
+{
+    int x0 = floorf(x), y0 = floorf(y);
+    float fx = x - x0, fy = y - y0;
+    int x1 = MIN(im.w - 1, x0 + 1), y1 = MIN(im.h - 1, y0 + 1);
+    x0 = MAX(0, MIN(im.w - 1, x0));
+    y0 = MAX(0, MIN(im.h - 1, y0));
+    const float *p = im.data + (size_t)c*im.h*im.w;
+    float top = p[y0*im.w + x0] + fx*(p[y0*im.w + x1] - p[y0*im.w + x0]);
+    float bot = p[y1*im.w + x0] + fx*(p[y1*im.w + x1] - p[y1*im.w + x0]);
+    return top + fy*(bot - top);
+}
+
+static point project(matrix H, float x, float y)
+{
+    double **m = H.data;
+    double z = m[2][0]*x + m[2][1]*y + m[2][2];
+    return make_point((m[0][0]*x + m[0][1]*y + m[0][2]) / z,
+                      (m[1][0]*x + m[1][1]*y + m[1][2]) / z);
+}
+
+// Warp a tiled image into another, one destination tile at a time.
+// Destination pixel (x, y) samples src bilinearly at H applied to
+// (x + dx, y + dy). Pixels that land outside src are left unchanged, so
+// several sources can be composited into one canvas. Only the part of src
+// under the projected tile, plus a one pixel halo, is read.
+// tiled_image dst: image to draw into.
+// tiled_image src: image to sample, same channels as dst.
+// matrix H: homography from canvas coordinates to src coordinates.
+// int dy, dx: canvas origin in the coordinates H expects.
+void warp_tiled_image(tiled_image dst, tiled_image src, matrix H, int dy, int dx)
+{
+    assert(dst.c == src.c);
+    struct tile_store *s = dst.store;
+    int n = s->tiles_x*s->tiles_y;
+    int i;
+    #pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < n; ++i){
+        int y = (i / s->tiles_x)*dst.tile;
+        int x = (i % s->tiles_x)*dst.tile;
+        int h = MIN(dst.tile, dst.h - y);
+        int w = MIN(dst.tile, dst.w - x);
+        point c[4] = {project(H, x + dx, y + dy), project(H, x + w - 1 + dx, y + dy),
+                      project(H, x + dx, y + h - 1 + dy), project(H, x + w - 1 + dx, y + h - 1 + dy)};
+        float minx = c[0].x, maxx = c[0].x, miny = c[0].y, maxy = c[0].y;
+        int j;
+        for(j = 1; j < 4; ++j){
+            minx = MIN(minx, c[j].x); maxx = MAX(maxx, c[j].x);
+            miny = MIN(miny, c[j].y); maxy = MAX(maxy, c[j].y);
+        }
+        int sx0 = MAX(0, (int)floorf(minx) - 1), sx1 = MIN(src.w - 1, (int)ceilf(maxx) + 1);
+        int sy0 = MAX(0, (int)floorf(miny) - 1), sy1 = MIN(src.h - 1, (int)ceilf(maxy) + 1);
+        if(!(minx < src.w && maxx >= 0 && miny < src.h && maxy >= 0) || sx0 > sx1 || sy0 > sy1) continue;
+
+        image patch = load_tiled_region(src, sy0, sx0, sy1 - sy0 + 1, sx1 - sx0 + 1);
+        image out = load_tiled_region(dst, y, x, h, w);
+        int r, q, k;
+        for(r = 0; r < h; ++r){
+            for(q = 0; q < w; ++q){
+                point p = project(H, x + q + dx, y + r + dy);
+                if(p.x < 0 || p.y < 0 || p.x >= src.w || p.y >= src.h) continue;
+                for(k = 0; k < dst.c; ++k){
+                    out.data[((size_t)k*h + r)*w + q] = sample_bilinear(patch, k, p.x - sx0, p.y - sy0);
+                }
+            }
+        }
+        store_tiled_region(dst, out, y, x);
+        free_image(patch);
+        free_image(out);
+    }
+}
+
+// Stitch two tiled images like combine_images, without ever holding the
+// canvas in memory.
+// tiled_image a, b: images to stitch.
+// matrix H: homography from a coordinates to b coordinates.
+// const char *fname: file for the canvas.
+// size_t cache_bytes: memory budget of the canvas tile cache.
+// returns: tiled canvas with a pasted and b warped into it.
+tiled_image combine_tiled_images(tiled_image a, tiled_image b, matrix H,
+        const char *fname, size_t cache_bytes)
+{
+    matrix Hinv = matrix_invert(H);
+    point c[4] = {project(Hinv, 0, 0), project(Hinv, b.w - 1, 0),
+                  project(Hinv, 0, b.h - 1), project(Hinv, b.w - 1, b.h - 1)};
+    float minx = c[0].x, maxx = c[0].x, miny = c[0].y, maxy = c[0].y;
+    int i;
+    for(i = 1; i < 4; ++i){
+        minx = MIN(minx, c[i].x); maxx = MAX(maxx, c[i].x);
+        miny = MIN(miny, c[i].y); maxy = MAX(maxy, c[i].y);
+    }
+    free_matrix(Hinv);
+    int dx = MIN(0, minx);
+    int dy = MIN(0, miny);
+    int w = MAX(a.w, maxx) - dx;
+    int h = MAX(a.h, maxy) - dy;
+
+    tiled_image out = make_tiled_image(fname, a.c, h, w, a.tile, a.store->compression, cache_bytes);
+    if(!out.store) return out;
+    matrix I = make_identity_homography();
+    warp_tiled_image(out, a, I, dy, dx);
+    warp_tiled_image(out, b, H, dy, dx);
+    free_matrix(I);
+    return out;
+}
@@ -2,7 +2,13 @@ import sys, os
 from ctypes import *
 import math
 import random
+try:
+    import numpy as np
+except ImportError:
+    np = None
 
+# CDLL drops the GIL for the length of every call, so native work started
+# from different Python threads runs concurrently.
 lib = CDLL(os.path.join(os.path.dirname(__file__), "libuwimg.so"), RTLD_GLOBAL)
 
 def c_array(ctype, values):
@@ -19,6 +25,14 @@ class IMAGE(Structure):
         return add_image(self, other)
     def __sub__(self, other):
         return sub_image(self, other)
+    # np.asarray(im) views the pixels as a (c, h, w) float32 array, no copy.
+    # The array is only valid until the image is freed.
+    @property
+    def __array_interface__(self):
+        return {"shape": (self.c, self.h, self.w),
+                "typestr": "<f4",
+                "data": (cast(self.data, c_void_p).value or 0, False),
+                "version": 3}
 
 class POINT(Structure):
     _fields_ = [("x", c_float),
@@ -27,13 +41,30 @@ class POINT(Structure):
 class DESCRIPTOR(Structure):
     _fields_ = [("p", POINT),
                 ("n", c_int),
-                ("data", POINTER(c_float))]
+                ("data", POINTER(c_float)),
+                ("bits", POINTER(c_ulonglong))]
 
 class MATRIX(Structure):
     _fields_ = [("rows", c_int),
                 ("cols", c_int),
                 ("data", POINTER(POINTER(c_double))),
                 ("shallow", c_int)]
+    # np.asarray(m) views a matrix as a (rows, cols) float64 array, no copy.
+    # Rows from make_matrix share one block. Views made of arbitrary rows,
+    # like random_batch, can't be expressed with strides and raise.
+    @property
+    def __array_interface__(self):
+        rows = cast(self.data, POINTER(c_void_p))
+        base = rows[0] if self.rows else 0
+        stride = (rows[1] - base) if self.rows > 1 else self.cols*8
+        for i in range(self.rows):
+            if rows[i] != base + i*stride:
+                raise ValueError("matrix rows are not evenly spaced, copy_matrix it first")
+        return {"shape": (self.rows, self.cols),
+                "typestr": "<f8",
+                "strides": (stride, 8),
+                "data": (base or 0, False),
+                "version": 3}
 
 class DATA(Structure):
     _fields_ = [("X", MATRIX),
@@ -41,8 +72,8 @@ class DATA(Structure):
 
 class LAYER(Structure):
     _fields_ = [("in", MATRIX),
-                ("dw", MATRIX),
                 ("w", MATRIX),
+                ("dw", MATRIX),
                 ("v", MATRIX),
                 ("out", MATRIX),
                 ("activation", c_int)]
@@ -51,9 +82,41 @@ class MODEL(Structure):
     _fields_ = [("layers", POINTER(LAYER)),
                 ("n", c_int)]
 
+class QUANTIZED_LAYER(Structure):
+    _fields_ = [("inputs", c_int),
+                ("outputs", c_int),
+                ("w", POINTER(c_byte)),
+                ("scale", POINTER(c_float)),
+                ("activation", c_int)]
+
+class QUANTIZED_MODEL(Structure):
+    _fields_ = [("layers", POINTER(QUANTIZED_LAYER)),
+                ("n", c_int)]
+
+class EVALUATION(Structure):
+    _fields_ = [("accuracy", c_double),
+                ("confusion", MATRIX)]
+
 
 (LINEAR, LOGISTIC, RELU, LRELU, SOFTMAX) = range(5)
 
+def array_to_image(a):
+    """Wrap a (c, h, w) or (h, w) array as an IMAGE.
+
+    C-contiguous float32 arrays are shared with the image, anything else is
+    converted once. The image keeps the array alive, so it must not be
+    passed to free_image. Interleaved (h, w, c) arrays need a
+    transpose(2, 0, 1) first.
+    """
+    a = np.ascontiguousarray(a, dtype=np.float32)
+    if a.ndim == 2:
+        a = a[None]
+    if a.ndim != 3:
+        raise ValueError("expected a (c, h, w) or (h, w) array")
+    im = IMAGE(a.shape[0], a.shape[1], a.shape[2], a.ctypes.data_as(POINTER(c_float)))
+    im._array = a
+    return im
+
 
 add_image = lib.add_image
 add_image.argtypes = [IMAGE, IMAGE]
@@ -106,6 +169,10 @@ shift_image = lib.shift_image
 shift_image.argtypes = [IMAGE, c_int, c_float]
 shift_image.restype = None
 
+adjust_hsv = lib.adjust_hsv
+adjust_hsv.argtypes = [IMAGE, c_float, c_float, c_float]
+adjust_hsv.restype = None
+
 scale_image = lib.scale_image
 scale_image.argtypes = [IMAGE, c_int, c_float]
 scale_image.restype = None
@@ -143,6 +210,17 @@ bilinear_resize = lib.bilinear_resize
 bilinear_resize.argtypes = [IMAGE, c_int, c_int]
 bilinear_resize.restype = IMAGE
 
+(NEAREST, BILINEAR, AREA, LANCZOS3) = range(4)
+(BORDER_CLAMP, BORDER_REFLECT, BORDER_WRAP, BORDER_CONSTANT) = range(4)
+
+resize_image = lib.resize_image
+resize_image.argtypes = [IMAGE, c_int, c_int, c_int]
+resize_image.restype = IMAGE
+
+resize_image_border = lib.resize_image_border
+resize_image_border.argtypes = [IMAGE, c_int, c_int, c_int, c_int, c_float]
+resize_image_border.restype = IMAGE
+
 make_sharpen_filter = lib.make_sharpen_filter
 make_sharpen_filter.argtypes = []
 make_sharpen_filter.restype = IMAGE
@@ -183,10 +261,18 @@ convolve_image = lib.convolve_image
 convolve_image.argtypes = [IMAGE, IMAGE, c_int]
 convolve_image.restype = IMAGE
 
+convolve_image_border = lib.convolve_image_border
+convolve_image_border.argtypes = [IMAGE, IMAGE, c_int, c_int, c_float]
+convolve_image_border.restype = IMAGE
+
 harris_corner_detector = lib.harris_corner_detector
 harris_corner_detector.argtypes = [IMAGE, c_float, c_float, c_int, POINTER(c_int)]
 harris_corner_detector.restype = POINTER(DESCRIPTOR)
 
+harris_corner_detector_topk = lib.harris_corner_detector_topk
+harris_corner_detector_topk.argtypes = [IMAGE, c_float, c_float, c_int, c_int, c_int, POINTER(c_int)]
+harris_corner_detector_topk.restype = POINTER(DESCRIPTOR)
+
 mark_corners = lib.mark_corners
 mark_corners.argtypes = [IMAGE, POINTER(DESCRIPTOR), c_int]
 mark_corners.restype = None
@@ -199,18 +285,55 @@ cylindrical_project = lib.cylindrical_project
 cylindrical_project.argtypes = [IMAGE, c_float]
 cylindrical_project.restype = IMAGE
 
-structure_matrix = lib.structure_matrix
-structure_matrix.argtypes = [IMAGE, c_float]
-structure_matrix.restype = IMAGE
+spherical_project = lib.spherical_project
+spherical_project.argtypes = [IMAGE, c_float]
+spherical_project.restype = IMAGE
+
+(PROJECT_CYLINDRICAL, PROJECT_SPHERICAL) = range(2)
+
+project_image_lib = lib.project_image
+project_image_lib.argtypes = [IMAGE, c_float, c_int, c_int]
+project_image_lib.restype = IMAGE
+
+def project_image(im, f, projection=PROJECT_CYLINDRICAL, fixed=0):
+    return project_image_lib(im, f, projection, fixed)
+
+(SMOOTH_DIRECT, SMOOTH_RECURSIVE) = range(2)
+
+structure_matrix_lib = lib.structure_matrix_mode
+structure_matrix_lib.argtypes = [IMAGE, c_float, c_int]
+structure_matrix_lib.restype = IMAGE
+
+def structure_matrix(im, sigma, mode=SMOOTH_DIRECT):
+    return structure_matrix_lib(im, sigma, mode)
+
+recursive_gaussian = lib.recursive_gaussian
+recursive_gaussian.argtypes = [IMAGE, c_float]
+recursive_gaussian.restype = IMAGE
 
 find_and_draw_matches = lib.find_and_draw_matches
 find_and_draw_matches.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int]
 find_and_draw_matches.restype = IMAGE
 
-panorama_image_lib = lib.panorama_image
-panorama_image_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_float, c_int, c_int]
+(HARRIS, ORB) = range(2)
+
+panorama_image_lib = lib.panorama_image_features
+panorama_image_lib.argtypes = [IMAGE, IMAGE, c_int, c_int, c_float, c_float, c_int, c_float, c_int, c_int]
 panorama_image_lib.restype = IMAGE
 
+(BLEND_NONE, BLEND_FEATHER, BLEND_MULTIBAND) = range(3)
+
+combine_images_blend_lib = lib.combine_images_blend
+combine_images_blend_lib.argtypes = [IMAGE, IMAGE, MATRIX, c_int, c_int]
+combine_images_blend_lib.restype = IMAGE
+
+def combine_images_blend(a, b, H, mode=BLEND_MULTIBAND, bands=5):
+    return combine_images_blend_lib(a, b, H, mode, bands)
+
+detect_features = lib.detect_features
+detect_features.argtypes = [IMAGE, c_int, c_float, c_float, c_int, POINTER(c_int)]
+detect_features.restype = POINTER(DESCRIPTOR)
+
 draw_flow = lib.draw_flow
 draw_flow.argtypes = [IMAGE, IMAGE, c_float]
 draw_flow.restype = None
@@ -219,16 +342,23 @@ box_filter_image = lib.box_filter_image
 box_filter_image.argtypes = [IMAGE, c_int]
 box_filter_image.restype = IMAGE
 
-optical_flow_images = lib.optical_flow_images
-optical_flow_images.argtypes = [IMAGE, IMAGE, c_int, c_int]
-optical_flow_images.restype = IMAGE
+optical_flow_images_lib = lib.optical_flow_images_mode
+optical_flow_images_lib.argtypes = [IMAGE, IMAGE, c_int, c_int, c_int]
+optical_flow_images_lib.restype = IMAGE
+
+def optical_flow_images(im, prev, smooth, stride, mode=SMOOTH_DIRECT):
+    return optical_flow_images_lib(im, prev, smooth, stride, mode)
 
 optical_flow_webcam = lib.optical_flow_webcam
 optical_flow_webcam.argtypes = [c_int, c_int, c_int]
 optical_flow_webcam.restype = None
 
-def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
-    return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff)
+# thresh defaults to 5 for HARRIS cornerness, .06 for the ORB FAST test.
+# blend is one of BLEND_NONE, BLEND_FEATHER, BLEND_MULTIBAND.
+def panorama_image(a, b, sigma=2, thresh=None, nms=3, inlier_thresh=2, iters=10000, cutoff=30, features=HARRIS, blend=BLEND_NONE):
+    if thresh is None:
+        thresh = .06 if features == ORB else 5
+    return panorama_image_lib(a, b, features, blend, sigma, thresh, nms, inlier_thresh, iters, cutoff)
 
 
 train_model = lib.train_model
@@ -239,6 +369,42 @@ accuracy_model = lib.accuracy_model
 accuracy_model.argtypes = [MODEL, DATA]
 accuracy_model.restype = c_double
 
+evaluate_model = lib.evaluate_model
+evaluate_model.argtypes = [MODEL, DATA, c_int]
+evaluate_model.restype = EVALUATION
+
+free_evaluation = lib.free_evaluation
+free_evaluation.argtypes = [EVALUATION]
+free_evaluation.restype = None
+
+save_model = lib.save_model
+save_model.argtypes = [MODEL, c_char_p]
+save_model.restype = c_int
+
+load_model = lib.load_model
+load_model.argtypes = [c_char_p]
+load_model.restype = MODEL
+
+quantize_model = lib.quantize_model
+quantize_model.argtypes = [MODEL]
+quantize_model.restype = QUANTIZED_MODEL
+
+free_quantized_model = lib.free_quantized_model
+free_quantized_model.argtypes = [QUANTIZED_MODEL]
+free_quantized_model.restype = None
+
+accuracy_quantized_model = lib.accuracy_quantized_model
+accuracy_quantized_model.argtypes = [QUANTIZED_MODEL, DATA]
+accuracy_quantized_model.restype = c_double
+
+save_quantized_model = lib.save_quantized_model
+save_quantized_model.argtypes = [QUANTIZED_MODEL, c_char_p]
+save_quantized_model.restype = None
+
+load_quantized_model = lib.load_quantized_model
+load_quantized_model.argtypes = [c_char_p]
+load_quantized_model.restype = QUANTIZED_MODEL
+
 forward_model = lib.forward_model
 forward_model.argtypes = [MODEL, MATRIX]
 forward_model.restype = MATRIX